@@ -101,11 +101,13 @@ typedef void *(*thread_fn_t)(void *);
 //};
 //#endif /* HAVE_STRUCT_IN6_ADDR */
 
+/* A prefix is not changed once made, so it needs no lock; only the
+ * reference count moves, and that atomically (see Ref_Prefix ()).
+ */
 typedef struct _prefix_t {
     u_short family;		/* AF_INET | AF_INET6 */
     u_short bitlen;		/* prefix length */
     int ref_count;		/* reference count */
-    pthread_mutex_t mutex_lock; /* lock down structure */
     union {
 	struct in_addr sin;
 	struct in6_addr sin6;
@@ -118,7 +120,6 @@ typedef struct _v4_prefix_t {
     u_short family;		/* AF_INET only */
     u_short bitlen;		/* prefix length */
     int ref_count;		/* reference count */
-    pthread_mutex_t mutex_lock; /* lock down structure */
     union {
 	struct in_addr sin;
     } add;
@@ -5,18 +5,25 @@
 #ifndef _RADIX_H
 #define _RADIX_H
 
+/* Nodes are carved out of RADIX_BLOCK_NODES sized blocks aligned to
+ * RADIX_NODE_ALIGN, and carry a copy of their prefix's bits, so walking
+ * down the tree touches one cache line per node and never the prefix_t.
+ */
 typedef struct _radix_node_t {
    u_int bit;			/* flag if this node used */
    prefix_t *prefix;		/* who we are in radix tree */
    struct _radix_node_t *l, *r;	/* left and right children */
    struct _radix_node_t *parent;/* may be used */
    void *data;			/* pointer to data */
+   u_char key[16];		/* prefix->add, when there is a prefix */
 } radix_node_t;
 
 typedef struct _radix_tree_t {
    radix_node_t 	*head;
    u_int		maxbits; /* for 32 for IPv4, 128 for IPv6 */
    int num_active_node;		/* for debug purpose */
+   radix_node_t		*free_nodes;	/* chained through ->r */
+   radix_node_t		*blocks;	/* chained through ->l of their first node */
 } radix_tree_t;
 
 radix_node_t *radix_search_exact (radix_tree_t *radix, prefix_t *prefix);
@@ -24,6 +31,8 @@ radix_node_t *radix_search_exact_raw (radix_tree_t *radix, prefix_t *prefix);
 //radix_node_t *radix_search_best (radix_tree_t *radix, prefix_t *prefix);
 radix_node_t * radix_search_best (radix_tree_t *radix, prefix_t *prefix, 
 				   int inclusive);
+int radix_search_covering (radix_tree_t *radix, prefix_t *prefix,
+			   radix_node_t **stack);
 radix_node_t *radix_lookup (radix_tree_t *radix, prefix_t *prefix);
 void radix_remove (radix_tree_t *radix, radix_node_t *node);
 radix_tree_t *New_Radix (int maxbits);
@@ -32,6 +41,8 @@ void Destroy_Radix (radix_tree_t *radix, void_fn_t func);
 void radix_process (radix_tree_t *radix, void_fn_t func);
 
 #define RADIX_MAXBITS 128   /* upto 128 bits (for IPv6) */
+#define RADIX_BLOCK_NODES 256	/* nodes allocated at a time */
+#define RADIX_NODE_ALIGN 64	/* a cache line */
 #define RADIX_NBIT(x)        (0x80 >> ((x) & 0x7f))
 #define RADIX_NBYTE(x)       ((x) >> 3)
 
@@ -72,6 +72,25 @@ struct hostent *p_gethostbyaddr_r (const char *addr,
  
 int num_active_prefixes = 0;
 
+/* prefixes are shared between threads through the radix trees, so the
+ * reference count is changed atomically */
+#ifdef __GNUC__
+#define prefix_atomic_add(counter, n)	__sync_add_and_fetch ((counter), (n))
+#else
+static pthread_mutex_t prefix_ref_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int
+prefix_atomic_add (int *counter, int n)
+{
+    int value;
+
+    pthread_mutex_lock (&prefix_ref_lock);
+    value = (*counter += n);
+    pthread_mutex_unlock (&prefix_ref_lock);
+    return (value);
+}
+#endif /* __GNUC__ */
+
 /* 
    this is a new feature introduced by masaki. This is intended to shift to
    use a static memory as much as possible. If ref_count == 0, the prefix
@@ -87,20 +106,18 @@ New_Prefix (int family, void *dest, int bitlen)
 
     if (family == AF_INET) {
       prefix = (prefix_t *) irrd_malloc(sizeof(v4_prefix_t));
-      pthread_mutex_init (&prefix->mutex_lock, NULL);
       memcpy (&prefix->add.sin, dest, 4);
     }
     else
     if (family == AF_INET6) {
       prefix = (prefix_t *) irrd_malloc(sizeof(prefix_t));
-      pthread_mutex_init (&prefix->mutex_lock, NULL);
       memcpy (&prefix->add.sin6, dest, 16);
     }
     else
       return (NULL);
 
     prefix->ref_count = 1;
-    num_active_prefixes++;
+    prefix_atomic_add (&num_active_prefixes, 1);
     prefix->bitlen = bitlen;
     prefix->family = family;
     return (prefix);
@@ -242,9 +259,7 @@ Ref_Prefix (prefix_t * prefix)
 	/* make a copy in case of a static prefix */
         return (New_Prefix (prefix->family, &prefix->add, prefix->bitlen));
     }
-    pthread_mutex_lock (&prefix->mutex_lock);
-    prefix->ref_count++;
-    pthread_mutex_unlock (&prefix->mutex_lock);
+    prefix_atomic_add (&prefix->ref_count, 1);
     return (prefix);
 }
 
@@ -255,16 +270,11 @@ Deref_Prefix (prefix_t * prefix)
 	return;
     /* for secure programming, raise an assert. no static prefix can call this */
     assert (prefix->ref_count > 0);
-    pthread_mutex_lock (&prefix->mutex_lock);
 
-    prefix->ref_count--;
-    if (prefix->ref_count <= 0) {
-        pthread_mutex_destroy (&prefix->mutex_lock);
+    if (prefix_atomic_add (&prefix->ref_count, -1) <= 0) {
 	irrd_free(prefix);
-        num_active_prefixes--;
-	return;
+        prefix_atomic_add (&num_active_prefixes, -1);
     }
-    pthread_mutex_unlock (&prefix->mutex_lock);
 }
 
 /* ascii2prefix
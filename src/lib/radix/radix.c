@@ -4,6 +4,8 @@
  */
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include <mrt.h>
 #include <radix.h>
@@ -14,6 +16,48 @@ static int num_active_radix = 0;
 
 /* these routines support continuous mask only */
 
+/* take a node from the tree's free list, carving up a new block if it
+ * is empty; the first node of a block links the blocks together */
+static radix_node_t *
+radix_node_new (radix_tree_t *radix, prefix_t *prefix)
+{
+    radix_node_t *node, *block;
+    int i;
+
+    if (radix->free_nodes == NULL) {
+	if (posix_memalign ((void **) &block, RADIX_NODE_ALIGN,
+			    RADIX_BLOCK_NODES * sizeof (radix_node_t)) != 0)
+	    return (NULL);
+	block->l = radix->blocks;
+	radix->blocks = block;
+	for (i = RADIX_BLOCK_NODES - 1; i > 0; i--) {
+	    block[i].r = radix->free_nodes;
+	    radix->free_nodes = &block[i];
+	}
+    }
+
+    node = radix->free_nodes;
+    radix->free_nodes = node->r;
+    memset (node, 0, sizeof (radix_node_t));
+    if (prefix != NULL) {
+	node->bit = prefix->bitlen;
+	node->prefix = Ref_Prefix (prefix);
+	memcpy (node->key, prefix_touchar (prefix), radix->maxbits >> 3);
+    }
+    radix->num_active_node++;
+    return (node);
+}
+
+static void
+radix_node_free (radix_tree_t *radix, radix_node_t *node)
+{
+    node->prefix = NULL;
+    node->data = NULL;
+    node->r = radix->free_nodes;
+    radix->free_nodes = node;
+    radix->num_active_node--;
+}
+
 radix_tree_t *
 New_Radix (int maxbits)
 {
@@ -22,6 +66,8 @@ New_Radix (int maxbits)
     radix->maxbits = maxbits;
     radix->head = NULL;
     radix->num_active_node = 0;
+    radix->free_nodes = NULL;
+    radix->blocks = NULL;
     num_active_radix++;
     return (radix);
 }
@@ -34,6 +80,8 @@ New_Radix (int maxbits)
 void
 Destroy_Radix (radix_tree_t *radix, void_fn_t func)
 {
+    radix_node_t *block;
+
     if (radix->head) {
 
         radix_node_t *Xstack[RADIX_MAXBITS+1];
@@ -49,7 +97,6 @@ Destroy_Radix (radix_tree_t *radix, void_fn_t func)
 		if (Xrn->data && func)
 	    	func (Xrn->data);
     	    }
-    	    irrd_free(Xrn);
 	    Xrn = NULL;
 	    radix->num_active_node--;
 
@@ -67,6 +114,11 @@ Destroy_Radix (radix_tree_t *radix, void_fn_t func)
             }
         }
     }
+    /* the nodes go with their blocks */
+    while ((block = radix->blocks) != NULL) {
+	radix->blocks = block->l;
+	free (block);
+    }
     irrd_free(radix);
     num_active_radix--;
 }
@@ -137,8 +189,7 @@ radix_search_exact (radix_tree_t *radix, prefix_t *prefix)
 #endif /* RADIX_DEBUG */
     if (node->bit > bitlen || node->prefix == NULL)
 	return (NULL);
-    if (comp_with_mask (prefix_tochar (node->prefix), prefix_tochar (prefix),
-			bitlen)) {
+    if (comp_with_mask (node->key, prefix_tochar (prefix), bitlen)) {
 #ifdef RADIX_DEBUG
         fprintf (stderr, "radix_search_exact: found %s/%d\n", 
 	         prefix_toa (node->prefix), node->prefix->bitlen);
@@ -223,9 +274,7 @@ radix_search_best (radix_tree_t *radix, prefix_t *prefix, int inclusive)
         fprintf (stderr, "radix_search_best: pop %s/%d\n", 
 	         prefix_toa (node->prefix), node->prefix->bitlen);
 #endif /* RADIX_DEBUG */
-	if (comp_with_mask (prefix_tochar (node->prefix), 
-			    prefix_tochar (prefix),
-			    node->prefix->bitlen)) {
+	if (comp_with_mask (node->key, prefix_tochar (prefix), node->bit)) {
 #ifdef RADIX_DEBUG
             fprintf (stderr, "radix_search_best: found %s/%d\n", 
 	             prefix_toa (node->prefix), node->prefix->bitlen);
@@ -237,6 +286,45 @@ radix_search_best (radix_tree_t *radix, prefix_t *prefix, int inclusive)
 }
 
 
+/* radix_search_covering
+ * Fill (stack) with the nodes holding a prefix that covers (prefix), its
+ * own included, least specific first.  (stack) needs RADIX_MAXBITS + 1
+ * entries.  Returns how many there are.
+ */
+int
+radix_search_covering (radix_tree_t *radix, prefix_t *prefix,
+		       radix_node_t **stack)
+{
+    radix_node_t *node;
+    u_char *addr;
+    u_int bitlen;
+    int i, n = 0, cnt = 0;
+
+    if ((node = radix->head) == NULL)
+	return (0);
+
+    addr = prefix_touchar (prefix);
+    bitlen = prefix->bitlen;
+
+    while (node != NULL && node->bit <= bitlen) {
+	if (node->prefix)
+	    stack[n++] = node;
+	if (node->bit == bitlen)
+	    break;
+	if (BIT_TEST (addr[node->bit >> 3], 0x80 >> (node->bit & 0x07)))
+	    node = node->r;
+	else
+	    node = node->l;
+    }
+
+    /* the path skips bits, so drop the prefixes that differ from ours */
+    for (i = 0; i < n; i++)
+	if (comp_with_mask (stack[i]->key, prefix_tochar (prefix),
+			    stack[i]->bit))
+	    stack[cnt++] = stack[i];
+    return (cnt);
+}
+
 radix_node_t *
 radix_lookup (radix_tree_t *radix, prefix_t *prefix)
 {
@@ -246,18 +334,13 @@ radix_lookup (radix_tree_t *radix, prefix_t *prefix)
     int i, j, r;
 
     if (radix->head == NULL) {
-	node = irrd_malloc(sizeof(radix_node_t));
-	node->bit = prefix->bitlen;
-	node->prefix = Ref_Prefix (prefix);
-	node->parent = NULL;
-	node->l = node->r = NULL;
-	node->data = NULL;
+	if ((node = radix_node_new (radix, prefix)) == NULL)
+	    return (NULL);
 	radix->head = node;
 #ifdef RADIX_DEBUG
 	fprintf (stderr, "radix_lookup: new_node #0 %s/%d (head)\n", 
 		 prefix_toa (prefix), prefix->bitlen);
 #endif /* RADIX_DEBUG */
-	radix->num_active_node++;
 	return (node);
     }
 
@@ -299,7 +382,7 @@ radix_lookup (radix_tree_t *radix, prefix_t *prefix)
 	     prefix_toa (node->prefix), node->prefix->bitlen);
 #endif /* RADIX_DEBUG */
 
-    test_addr = prefix_touchar (node->prefix);
+    test_addr = node->key;
     /* find the first bit different */
     check_bit = (node->bit < bitlen)? node->bit: bitlen;
     differ_bit = 0;
@@ -345,6 +428,7 @@ radix_lookup (radix_tree_t *radix, prefix_t *prefix)
 	    return (node);
 	}
 	node->prefix = Ref_Prefix (prefix);
+	memcpy (node->key, addr, radix->maxbits >> 3);
 #ifdef RADIX_DEBUG
 	fprintf (stderr, "radix_lookup: new node #1 %s/%d (glue mod)\n",
 		 prefix_toa (prefix), prefix->bitlen);
@@ -352,13 +436,8 @@ radix_lookup (radix_tree_t *radix, prefix_t *prefix)
 	return (node);
     }
 
-    new_node = irrd_malloc(sizeof(radix_node_t));
-    new_node->bit = prefix->bitlen;
-    new_node->prefix = Ref_Prefix (prefix);
-    new_node->parent = NULL;
-    new_node->l = new_node->r = NULL;
-    new_node->data = NULL;
-    radix->num_active_node++;
+    if ((new_node = radix_node_new (radix, prefix)) == NULL)
+	return (NULL);
 
     if (node->bit == differ_bit) {
 	new_node->parent = node;
@@ -401,12 +480,13 @@ radix_lookup (radix_tree_t *radix, prefix_t *prefix)
 #endif /* RADIX_DEBUG */
     }
     else {
-        glue = irrd_malloc(sizeof(radix_node_t));
+        if ((glue = radix_node_new (radix, NULL)) == NULL) {
+	    Deref_Prefix (new_node->prefix);
+	    radix_node_free (radix, new_node);
+	    return (NULL);
+	}
         glue->bit = differ_bit;
-        glue->prefix = NULL;
         glue->parent = node->parent;
-        glue->data = NULL;
-        radix->num_active_node++;
 	if (differ_bit < radix->maxbits &&
 	    BIT_TEST (addr[differ_bit >> 3], 0x80 >> (differ_bit & 0x07))) {
 	    glue->r = new_node;
@@ -464,11 +544,10 @@ radix_remove (radix_tree_t *radix, radix_node_t *node)
 #endif /* RADIX_DEBUG */
 	parent = node->parent;
 	Deref_Prefix (node->prefix);
-        radix->num_active_node--;
 
 	if (parent == NULL) {
 	  radix->head = NULL;
-	  irrd_free(node);
+	  radix_node_free (radix, node);
 	  node = NULL;
 	  return;
 	}
@@ -483,7 +562,7 @@ radix_remove (radix_tree_t *radix, radix_node_t *node)
 	}
 
 	/* bug fix -- we need to cleanup memory AFTER testing conditions */
-	irrd_free(node);
+	radix_node_free (radix, node);
 	node = NULL;
 
 	if (parent->prefix)
@@ -501,9 +580,8 @@ radix_remove (radix_tree_t *radix, radix_node_t *node)
 	    parent->parent->l = child;
 	}
 	child->parent = parent->parent;
-	irrd_free(parent);
+	radix_node_free (radix, parent);
 	/*a	Child->parent = NULL;*/
-        radix->num_active_node--;
 	return;
     }
 
@@ -521,11 +599,10 @@ radix_remove (radix_tree_t *radix, radix_node_t *node)
     child->parent = parent;
 
     Deref_Prefix (node->prefix);
-    radix->num_active_node--;
 
     if (parent == NULL) {
 	radix->head = child;
-	irrd_free(node);
+	radix_node_free (radix, node);
 	node = NULL;
 	return;
     }
@@ -537,7 +614,7 @@ radix_remove (radix_tree_t *radix, radix_node_t *node)
 	parent->l = child;
     }
 
-    irrd_free(node);
+    radix_node_free (radix, node);
     node = NULL;
 }
 
@@ -445,6 +445,9 @@ int db_rollback (irr_database_t *db, char *fname) {
     goto CLEAN_UP;
   }
 
+  /* the DB goes back to what an index snapshot may not have seen */
+  irr_snapshot_remove (db);
+
   /* we need to have the DB closed for the file truncation operation.
    * so if the DB is open (ie, transacton abort) then we need to re-open
    * it after we truncate */
@@ -1075,6 +1078,7 @@ int journal_rollback (irr_database_t *db, char *fname) {
 	   "file (%s) to (%ld) bytes: (%s)\n", buf, jsize, strerror (errno));
     goto CLEAN_UP;
   }
+  journal_index_reset (db);
   
   /* set the original current serial */
   db->serial_number = cs;
@@ -1172,7 +1176,7 @@ CLEAN_UP:
  *  -0 otherwise
  */
 int update_journal (FILE *fin, irr_database_t *db, int n_updates) {
-  char buf[BUFSIZE+1], tag[64];
+  char buf[BUFSIZE+1];
   int n = 0, bl = 0;
   long save_fpos;
 
@@ -1202,8 +1206,8 @@ int update_journal (FILE *fin, irr_database_t *db, int n_updates) {
     if (!memcmp (buf, "ADD", 3) ||
 	!memcmp (buf, "DEL", 3)) {
       n++;
-      sprintf (tag, "%% SERIAL %u\n", ++db->serial_number);
-      if (write (db->journal_fd, tag, strlen (tag)) < 0) {
+      db->serial_number++;
+      if (journal_log_serial_number (db) < 0) {
 	trace (ERROR, default_trace, "update_journal (): file I/O write tag "
 	       "error: (%s)\n", strerror (errno));
 	return 0;
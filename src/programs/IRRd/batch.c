@@ -0,0 +1,186 @@
+/* Batches of queries, sent as
+ *
+ *   !ps
+ *   !gas1234
+ *   !r192.0.2.0/24,l
+ *   ...
+ *   !pe
+ *
+ * The queries are held until the !pe and then run IRR_BATCH_LOCKED at a
+ * time under one read lock of the connection's sources, so each group
+ * sees the same state of the databases and an update waits for no more
+ * than a group.  They run on the task pool, up to IRR_BATCH_WINDOW at a
+ * time, each on a copy of the connection that keeps its answer instead
+ * of writing it out.  The answers are sent in the order of the queries,
+ * each framed as it would be on its own (A<len>...C, C, D or F), and the
+ * batch ends with a "C".  Nothing is written to the client while the
+ * batch holds the locks: answers piling up past IRR.answer_buffer_size
+ * are put aside in the connection's spill file (see irr_write_spill ())
+ * and go out between the groups, once the locks are released.
+ *
+ * Only the queries that leave the connection alone may be batched; the
+ * others, eg !s which changes the sources locked, get an error.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <glib.h>
+
+#include "mrt.h"
+#include "trace.h"
+#include "config_file.h"
+#include "irrd.h"
+
+typedef struct _batch_query_t {
+  irr_task_t		task;
+  irr_connection_t	irr;	/* a copy of the batch's connection */
+} batch_query_t;
+
+/* irr_batch_start
+ * !ps, collect the following queries until a !pe
+ */
+void irr_batch_start (irr_connection_t *irr) {
+
+  if (irr->ll_batch != NULL)
+    LL_Destroy (irr->ll_batch);
+  irr->ll_batch = LL_Create (LL_DestroyFunction, free, 0);
+  irr->batch_dropped = 0;
+  irr->state = IRR_MODE_BATCH;
+}
+
+void irr_batch_add (irr_connection_t *irr, char *query) {
+
+  if (*query == '\0')
+    return;
+
+  /* the rest are answered with an error, to keep the answers in step */
+  if (LL_GetCount (irr->ll_batch) >= IRR_BATCH_MAX_QUERIES) {
+    irr->batch_dropped++;
+    return;
+  }
+  LL_Add (irr->ll_batch, strdup (query));
+}
+
+/* can (query) run as part of a batch? */
+static int batch_query_allowed (char *query) {
+
+  if (*query++ != '!')
+    return 0;
+  if (!strncasecmp (query, "gas", 3) || !strncasecmp (query, "6as", 3))
+    return 1;
+  return (*query != '\0' && strchr ("rRiIaAoOmM", *query) != NULL);
+}
+
+static void batch_query_run (batch_query_t *q) {
+
+  if (!batch_query_allowed (q->irr.cp))
+    irr_send_error (&q->irr, "command not allowed in a batch");
+  else
+    irr_process_command (&q->irr);
+}
+
+/* set up (q) to run (query) for the batch on (irr) */
+static void batch_query_init (batch_query_t *q, irr_connection_t *irr,
+			      char *query) {
+  irr_database_t *database;
+
+  memcpy (&q->irr, irr, sizeof (irr_connection_t));
+  q->task.fn = (void (*) (void *)) batch_query_run;
+  q->task.arg = q;
+
+  /* iterating a list moves its cursor, so each query needs its own */
+  q->irr.ll_database = LL_Create (0);
+  LL_ContIterate (irr->ll_database, database)
+    LL_Add (q->irr.ll_database, database);
+
+  q->irr.ll_answer = NULL;
+  q->irr.ll_final_answer = NULL;
+  q->irr.final_answer_bytes = 0;
+  q->irr.stream_answer = 0;
+  q->irr.spill_fp = NULL;
+  q->irr.answer = NULL;
+  q->irr.answer_len = 0;
+  q->irr.ll_batch = NULL;
+  q->irr.state = 0;
+  q->irr.batch_query = 1;
+  strcpy (q->irr.tmp, query);
+  q->irr.cp = q->irr.tmp;
+}
+
+/* queue the answer of (q) behind what (irr) already has */
+static void batch_query_done (irr_connection_t *irr, batch_query_t *q) {
+  final_answer_t *final_answer;
+
+  LL_Destroy (q->irr.ll_database);
+  if (q->irr.scheduled_for_deletion)
+    irr->scheduled_for_deletion = 1;
+  if (q->irr.ll_final_answer == NULL)
+    return;
+
+  if (irr->ll_final_answer == NULL)
+    irr->ll_final_answer = q->irr.ll_final_answer;
+  else {
+    LL_ContIterate (q->irr.ll_final_answer, final_answer)
+      LL_Add (irr->ll_final_answer, final_answer);
+    LL_DestroyFn (q->irr.ll_final_answer, NULL);
+  }
+  irr->final_answer_bytes += q->irr.final_answer_bytes;
+
+  /* under the batch's locks, so not to the socket yet */
+  if (IRR.answer_buffer_size > 0 &&
+      irr->final_answer_bytes >= IRR.answer_buffer_size)
+    irr_write_spill (irr);
+}
+
+/* irr_batch_run
+ * !pe, answer the queries of the batch
+ */
+void irr_batch_run (irr_connection_t *irr) {
+  batch_query_t *window;
+  char *query;
+  u_int i, submitted = 0, done = 0, end, n;
+
+  irr->state = 0;
+  n = LL_GetCount (irr->ll_batch);
+  trace (NORM, default_trace, "Batch of %u queries\n", n + irr->batch_dropped);
+
+  window = irrd_malloc (IRR_BATCH_WINDOW * sizeof (batch_query_t));
+
+  query = LL_ContGetHead (irr->ll_batch);
+  while (done < n) {
+    end = (n - done > IRR_BATCH_LOCKED) ? done + IRR_BATCH_LOCKED : n;
+    irr_lock_all (irr);
+    irr->batch_locked = 1;
+
+    while (done < end) {
+      /* keep the window full, the oldest query is answered first */
+      while (submitted < end && submitted - done < IRR_BATCH_WINDOW) {
+	batch_query_init (&window[submitted % IRR_BATCH_WINDOW], irr, query);
+	irr_task_submit (&window[submitted % IRR_BATCH_WINDOW].task);
+	query = LL_ContGetNext (irr->ll_batch, query);
+	submitted++;
+      }
+      irr_task_wait (&window[done % IRR_BATCH_WINDOW].task);
+      batch_query_done (irr, &window[done % IRR_BATCH_WINDOW]);
+      done++;
+    }
+
+    /* the group is done, let waiting updates in and the client catch up */
+    irr->batch_locked = 0;
+    irr_unlock_all (irr);
+    if (done < n)
+      irr_write_buffer_flush (irr);
+    if (irr->scheduled_for_deletion)
+      break;
+  }
+
+  for (i = 0; i < irr->batch_dropped; i++)
+    irr_write (irr, "F batch too large\n", 18);
+  irr_write (irr, "C\n", 2);
+  irr_write_buffer_flush (irr);
+
+  irrd_free (window);
+  LL_Destroy (irr->ll_batch);
+  irr->ll_batch = NULL;
+}
@@ -79,7 +79,7 @@ void irr_less_all (irr_connection_t *irr, prefix_t *prefix, int flag, int mode);
 void irr_show_sources (irr_connection_t *irr);
 int irr_set_sources (irr_connection_t *irr, char *sources, int mode);
 int irr_set_ALL_sources (irr_connection_t *irr, int mode); 
-void irr_more_all (irr_connection_t *irr, prefix_t *prefix, int mode);
+int irr_more_all (irr_connection_t *irr, prefix_t *prefix, int flag, int mode);
 void irr_ripewhois(irr_connection_t *irr);
 void irr_m_command (irr_connection_t *irr);
 #ifdef notdef
@@ -88,6 +88,8 @@ void irr_d_command (irr_connection_t *irr);
 #endif
 void irr_inversequery (irr_connection_t *irr, enum IRR_OBJECTS type, char *key);
 void show_gas_answer (irr_connection_t *irr, char *key); 
+void show_gas_roa_answer (irr_connection_t *irr, char *key, int family,
+			  char *flag);
 void irr_journal_range (irr_connection_t *irr, char *db);
 void irr_journal_add_answer (irr_connection_t *irr);
 
@@ -227,6 +229,15 @@ void irr_process_command (irr_connection_t * irr) {
     return;
   }
 
+  /* hold the queries of a batch until its !pe */
+  if (irr->state == IRR_MODE_BATCH) {
+    if (!strcasecmp (com_ptr, "!pe"))
+      irr_batch_run (irr);
+    else
+      irr_batch_add (irr, com_ptr);
+    return;
+  }
+
   if (*com_ptr == '\0') {
     irr_write_nobuffer(irr, "% No search key specified\n\n");
     return;
@@ -278,23 +289,33 @@ void irr_process_command (irr_connection_t * irr) {
     return;
   }
 
-  /* Get IPv6 prefixes with specified origin. !6as237 */
+  /* Get IPv6 prefixes with specified origin. !6as237[,<roa flag>] */
   if (!strncasecmp (com_ptr, "6as", 3)) {
-    char sixas_key[BUFSIZE];
+    char sixas_key[BUFSIZE], *cp;
 
     com_ptr += 3;
+    if ((cp = strchr (com_ptr, ',')) != NULL)
+      *cp++ = '\0';
     make_6as_key (sixas_key, com_ptr);
-    show_gas_answer (irr, sixas_key);
+    if (cp != NULL)
+      show_gas_roa_answer (irr, sixas_key, AF_INET6, cp);
+    else
+      show_gas_answer (irr, sixas_key);
     return;
   }
 
-  /* Get routes with specified origin.   !gas1234 */
+  /* Get routes with specified origin.   !gas1234[,<roa flag>] */
   if (!strncasecmp (com_ptr, "gas", 3)) {
-    char gas_key[BUFSIZE];
+    char gas_key[BUFSIZE], *cp;
 
     com_ptr += 3;
+    if ((cp = strchr (com_ptr, ',')) != NULL)
+      *cp++ = '\0';
     make_gas_key (gas_key, com_ptr);
-    show_gas_answer (irr, gas_key);
+    if (cp != NULL)
+      show_gas_roa_answer (irr, gas_key, AF_INET, cp);
+    else
+      show_gas_answer (irr, gas_key);
     return;
   }
 
@@ -333,7 +354,10 @@ void irr_process_command (irr_connection_t * irr) {
 	  irr_exact (irr, prefix, SHOW_JUST_ORIGIN, RAWHOISD_MODE);
 	  break;
 	case 'M':
-	  irr_more_all (irr, prefix, RAWHOISD_MODE);
+	  irr_more_all (irr, prefix, SEARCH_ALL_LEVELS, RAWHOISD_MODE);
+	  break;
+	case 'm':
+	  irr_more_all (irr, prefix, SEARCH_ONE_LEVEL, RAWHOISD_MODE);
 	  break;
 	default:
 	  irr_send_error (irr, "unrecognized flag");
@@ -351,6 +375,13 @@ void irr_process_command (irr_connection_t * irr) {
     return;
   }
 
+  /* aggregated prefixes of a ROUTE-SET/AS-SET or AS !a[4|6]RS-FOO */
+  if (command_char == 'a' || command_char == 'A') {
+    com_ptr++;
+    irr_set_aggregate (irr, com_ptr);
+    return;
+  }
+
   /* AS-SET/ROUTE-SET expansion !iAS-ESNETEU[,1] */
   if (!strncasecmp(com_ptr, "i6", 2)) {
     com_ptr += 2;
@@ -385,6 +416,19 @@ void irr_process_command (irr_connection_t * irr) {
     return;
   }
 
+  /* batch of queries, !ps <queries, one per line> !pe
+   * see batch.c for the queries allowed
+   */
+  if (!strcasecmp (com_ptr, "ps")) {
+    irr_batch_start (irr);
+    return;
+  }
+
+  if (!strcasecmp (com_ptr, "pe")) {
+    irr_send_error (irr, "no batch started");
+    return;
+  }
+
   /* update !us<database> - DB we're authoritative for
    * ADD DEL object
    * terminated by a !ue
@@ -749,7 +793,7 @@ void irr_m_command (irr_connection_t *irr) {
  */
 void irr_ripewhois (irr_connection_t *irr) {
   prefix_t *prefix;
-  int lookup_mode, mode;
+  int lookup_mode, mode, ret = 1, roa_locked = 0;
   char *key = irr->cp;
   char lookupkey[BUFSIZE];
   enum IRR_OBJECTS lookup_type;
@@ -791,7 +835,7 @@ void irr_ripewhois (irr_connection_t *irr) {
   irr->ll_answer = LL_Create (LL_DestroyFunction, free, 0);
   irr_lock_all (irr);
   if (irr->ripe_flags & ROA_STATUS)
-    irr_lock(IRR.roa_database); /* Lock ROA db if roa-status desired */
+    roa_locked = irr_roa_read_lock (irr); /* Lock ROA db if roa-status desired */
 
   if (*key >= '0' && *key <= '9' &&
       ( ((irr->ripe_flags & OBJ_TYPE) == 0) || irr->ripe_type == ROUTE || irr->ripe_type == ROUTE6 || irr->ripe_type == INET6NUM || irr->ripe_type == IPV6_SITE)) {
@@ -809,8 +853,10 @@ void irr_ripewhois (irr_connection_t *irr) {
         irr_less_all (irr, prefix, SEARCH_ALL_LEVELS, mode);
       else if (irr->ripe_flags & LESS_ONE)
         irr_less_all (irr, prefix, SEARCH_ONE_LEVEL_NOT_EXACT, mode);
-      else if (irr->ripe_flags & MORE_ALL) /* still need MORE_ONE support */
-        irr_more_all (irr, prefix, mode);
+      else if (irr->ripe_flags & MORE_ALL)
+        ret = irr_more_all (irr, prefix, SEARCH_ALL_LEVELS, mode);
+      else if (irr->ripe_flags & MORE_ONE)
+        ret = irr_more_all (irr, prefix, SEARCH_ONE_LEVEL, mode);
       else if (irr->ripe_flags & EXACT_MATCH)
 	irr_exact(irr, prefix, SHOW_FULL_OBJECT, mode);
       else
@@ -819,76 +865,183 @@ void irr_ripewhois (irr_connection_t *irr) {
     }
   }
 
-  if (irr->ripe_flags & OBJ_TYPE)  {
-    lookup_mode = TYPE_MODE;
-    lookup_type = irr->ripe_type;
-  }  else {
-    lookup_mode = 0;
-    lookup_type = NO_FIELD;
-  }
-
-  if ( irr->ripe_flags & INVERSE_ATTR ) {
-    if (irr->inverse_type == MNT_BY) {  /* check for inverse mnt-by lookup */
-      make_mntobj_key (lookupkey, key);
-      irr_inversequery(irr, lookup_type, lookupkey); 
-    } else if (irr->inverse_type == ORIGIN) { /* check for inverse origin lookup */
-      if (!strncasecmp (key, "as", 2)) /* skip initial AS in string */
-        key += 2;
-      make_gas_key (lookupkey, key); /* look up route objects first */
-      irr_inversequery(irr, lookup_type, lookupkey); 
-      make_6as_key (lookupkey, key); /* now route6 objects */
-      irr_inversequery(irr, lookup_type, lookupkey); 
-    } else if (irr->inverse_type == MEMBER_OF) { /* check for set membership */
-      make_spec_key (lookupkey, NULL, key);
-      irr_inversequery(irr, lookup_type, lookupkey); 
+  /* the error has been sent, no answer follows it */
+  if (ret > 0) {
+    if (irr->ripe_flags & OBJ_TYPE)  {
+      lookup_mode = TYPE_MODE;
+      lookup_type = irr->ripe_type;
+    }  else {
+      lookup_mode = 0;
+      lookup_type = NO_FIELD;
     }
-  } else {
-    irr_database_find_matches (irr, key, PRIMARY, lookup_mode, lookup_type, NULL, NULL);
 
-    if ((irr->ripe_flags & (FAST_OUT | RECURS_OFF | OBJ_TYPE | INVERSE_ATTR)) == 0)
-      lookup_object_references (irr);  /* dupe ripe whois behavior */
+    if ( irr->ripe_flags & INVERSE_ATTR ) {
+      if (irr->inverse_type == MNT_BY) {  /* check for inverse mnt-by lookup */
+        make_mntobj_key (lookupkey, key);
+        irr_inversequery(irr, lookup_type, lookupkey); 
+      } else if (irr->inverse_type == ORIGIN) { /* check for inverse origin lookup */
+        if (!strncasecmp (key, "as", 2)) /* skip initial AS in string */
+          key += 2;
+        make_gas_key (lookupkey, key); /* look up route objects first */
+        irr_inversequery(irr, lookup_type, lookupkey); 
+        make_6as_key (lookupkey, key); /* now route6 objects */
+        irr_inversequery(irr, lookup_type, lookupkey); 
+      } else if (irr->inverse_type == MEMBER_OF) { /* check for set membership */
+        make_spec_key (lookupkey, NULL, key);
+        irr_inversequery(irr, lookup_type, lookupkey); 
+      }
+    } else {
+      irr_database_find_matches (irr, key, PRIMARY, lookup_mode, lookup_type, NULL, NULL);
+
+      if ((irr->ripe_flags & (FAST_OUT | RECURS_OFF | OBJ_TYPE | INVERSE_ATTR)) == 0)
+        lookup_object_references (irr);  /* dupe ripe whois behavior */
 
+    }
+    send_dbobjs_answer (irr, DISK_INDEX, RIPEWHOIS_MODE);
   }
-  send_dbobjs_answer (irr, DISK_INDEX, RIPEWHOIS_MODE);
-  if (irr->ripe_flags & ROA_STATUS)
-    irr_unlock(IRR.roa_database); /* Unlock ROA db if roa-status desired */
+  if (roa_locked)
+    irr_read_unlock(IRR.roa_database); /* Unlock ROA db if roa-status desired */
   irr_unlock_all (irr);
   irr_write_buffer_flush (irr);
   LL_Destroy (irr->ll_answer);
 }
 
+/* show_gas_answer
+ * Answer !gas/!6as for the GASX/GASX6 (key) from the answer cache, or
+ * build the response from the packed prefix lists of each source and
+ * cache it.
+ */
 void show_gas_answer (irr_connection_t *irr, char *key) {
   irr_database_t *db;
-  int empty_answer = 1;
-  hash_spec_t *hash_item;
-  LINKED_LIST *ll;
-  
-  irr->ll_answer = LL_Create (LL_DestroyFunction, free, 0);
-  ll = LL_Create (LL_DestroyFunction, Delete_hash_spec, 0);
+  char *answer, *cp, *prefixes;
+  u_int len, answer_size = 0;
+  int first = 1;
 
   irr_lock_all (irr);
+  if (irr_gas_cache_send (irr, key)) {
+    irr_unlock_all (irr);
+    irr_write_buffer_flush (irr);
+    return;
+  }
+
+  /* prefix lists seperated by a space, then a carriage return */
   LL_ContIterate (irr->ll_database, db) {
-    if ((hash_item = fetch_hash_spec (db, key, FAST)) != NULL) {
-      if (hash_item->len1 > 0) {
-        if (!empty_answer) /* need to add a space between prefixes */
-          irr_build_memory_answer (irr, 1, " ");
-        irr_build_memory_answer (irr, hash_item->len1 - 1, hash_item->gas_answer);
-        empty_answer = 0;
-      }
-      LL_Add (ll, hash_item);
+    if ((prefixes = fetch_gas_answer (db, key, &len)) != NULL)
+      answer_size += len + 1;
+  }
+
+  if (answer_size == 0) {
+    irr_write (irr, "D\n", 2);
+    irr_unlock_all (irr);
+    trace (NORM, default_trace, "No entries found\n");
+    irr_write_buffer_flush (irr);
+    return;
+  }
+
+  answer = irrd_malloc (answer_size + 16);
+  cp = answer + sprintf (answer, "A%d\n", (int) answer_size);
+  LL_ContIterate (irr->ll_database, db) {
+    if ((prefixes = fetch_gas_answer (db, key, &len)) != NULL) {
+      if (!first) /* need to add a space between prefixes */
+	*cp++ = ' ';
+      memcpy (cp, prefixes, len);
+      cp += len;
+      first = 0;
     }
   }
+  *cp++ = '\n';
+  *cp++ = 'C';
+  *cp++ = '\n';
 
-  /* tack on a carriage return */
-  if (!empty_answer)
-    irr_build_memory_answer (irr, 1, "\n");
-  send_dbobjs_answer (irr, MEM_INDEX, RAWHOISD_MODE);
+  irr_write (irr, answer, cp - answer);
+  irr_gas_cache_store (irr, key, answer, cp - answer);
   irr_unlock_all (irr);
+  trace (NORM, default_trace, "Sent %d bytes\n", answer_size);
   irr_write_buffer_flush (irr);
-  LL_Destroy (irr->ll_answer);
-  LL_Destroy (ll);
 } 
 
+/* show_gas_roa_answer
+ * Answer !gas/!6as with the prefixes checked against the ROAs, for
+ * the GASX/GASX6 (key) and the roa flag (flag):
+ *  r - all prefixes, each as <prefix>=<valid|invalid|unknown>
+ *  v - only the valid prefixes
+ *  n - the prefixes that are not invalid
+ *  i - only the invalid prefixes
+ * These are not cached, the ROAs change apart from the routes.
+ */
+void show_gas_roa_answer (irr_connection_t *irr, char *key, int family,
+			  char *flag) {
+  static char *status_name[] = {"unknown", "invalid", "valid"};
+  enum OBJ_ROASTATUS status;
+  irr_prefix_object_t *roa;
+  irr_database_t *db;
+  prefix_t *prefix;
+  char buf[BUFSIZE], *cp, *end, *q;
+  uint32_t origin;
+  u_int len;
+  int show, first = 1, roa_locked;
+
+  if (IRR.roa_database == NULL) {
+    irr_send_error (irr, "ROA database not configured");
+    return;
+  }
+  if (*flag == '\0' || flag[1] != '\0' || strchr ("rvni", *flag) == NULL) {
+    irr_send_error (irr, "unrecognized flag");
+    return;
+  }
+  if (convert_to_32 (key + 1, &origin) != 1) {
+    irr_send_error (irr, NULL);
+    return;
+  }
+
+  irr_lock_all (irr);
+  roa_locked = irr_roa_read_lock (irr);
+  LL_ContIterate (irr->ll_database, db) {
+    if ((cp = fetch_gas_answer (db, key, &len)) == NULL)
+      continue;
+    /* the answer is a space separated list of prefixes */
+    for (end = cp + len; cp < end; cp = q + 1) {
+      if ((q = memchr (cp, ' ', end - cp)) == NULL)
+	q = end;
+      if (q == cp || q - cp >= BUFSIZE)
+	continue;
+      memcpy (buf, cp, q - cp);
+      buf[q - cp] = '\0';
+      if ((prefix = ascii2prefix (family, buf)) == NULL)
+	continue;
+      status = irr_roa_validate (prefix, origin, &roa);
+      Deref_Prefix (prefix);
+
+      switch (*flag) {
+	case 'v':
+	  show = (status == ROA_VALID);
+	  break;
+	case 'n':
+	  show = (status != ROA_INVALID);
+	  break;
+	case 'i':
+	  show = (status == ROA_INVALID);
+	  break;
+	default:
+	  show = 1;
+	  break;
+      }
+      if (!show)
+	continue;
+      if (*flag == 'r')
+	irr_add_answer (irr, "%s%s=%s", first ? "" : " ", buf,
+			status_name[status]);
+      else
+	irr_add_answer (irr, "%s%s", first ? "" : " ", buf);
+      first = 0;
+    }
+  }
+  if (roa_locked)
+    irr_read_unlock (IRR.roa_database);
+  irr_unlock_all (irr);
+  irr_send_answer (irr);
+}
+
 /* Route searches.  L -  all level less specific eg, !r141.211.128/24,L
    Route searches.  l - one-level less specific eg, !r141.211.128/24,l
    Both these searches are inclusive (ie, the supplied route will be 
@@ -898,7 +1051,6 @@ void show_gas_answer (irr_connection_t *irr, char *key) {
 void irr_less_all (irr_connection_t *irr, prefix_t *prefix, 
 		   int flag, int mode) {
   radix_node_t *node = NULL;
-  radix_node_t *roa_node = NULL;
   irr_prefix_object_t *prefix_object;
   irr_database_t *database;
   prefix_t *tmp_prefix = NULL;
@@ -908,10 +1060,6 @@ void irr_less_all (irr_connection_t *irr, prefix_t *prefix,
   if (mode & RAWHOISD_MODE) {
      irr->ll_answer = LL_Create (LL_DestroyFunction, free, 0);
      irr_lock_all (irr);
-  } else {
-    if (mode & INCLUDE_ROASTATUS) {
-      roa_node = prefix_search_best (IRR.roa_database, prefix);
-    }
   }
 	
   LL_ContIterate (irr->ll_database, database) {
@@ -928,8 +1076,8 @@ void irr_less_all (irr_connection_t *irr, prefix_t *prefix,
 	  if (irr->full_obj == 0 && mode & RAWHOISD_MODE) {
 	    irr_add_answer(irr, "%s %s-AS%s\n",database->name, prefix_toax(node->prefix), print_as(tmpstr, prefix_object->origin));
 	  } else {
-	    if ( (mode & INCLUDE_ROASTATUS) && roa_node) { /* need to include info for ROA */
-	      irr_build_roa_answer (irr, database, prefix_object, node->prefix->bitlen, roa_node);
+	    if (mode & INCLUDE_ROASTATUS) { /* need to include info for ROA */
+	      irr_build_roa_answer (irr, database, prefix_object, node->prefix);
 	    } else
 	      irr_build_prefix_answer (irr, database, prefix_object);
 	  }
@@ -955,8 +1103,8 @@ void irr_less_all (irr_connection_t *irr, prefix_t *prefix,
 	  if (irr->full_obj == 0 && mode & RAWHOISD_MODE) {
 	    irr_add_answer(irr, "%s %s-AS%s\n",database->name, prefix_toax(tmp_prefix), print_as(tmpstr,prefix_object->origin));
 	  } else
-	    if ( (mode & INCLUDE_ROASTATUS) && roa_node) { /* need to include info for ROA */
-	      irr_build_roa_answer (irr, database, prefix_object, node->prefix->bitlen, roa_node);
+	    if (mode & INCLUDE_ROASTATUS) { /* need to include info for ROA */
+	      irr_build_roa_answer (irr, database, prefix_object, node->prefix);
 	    } else
 	      irr_build_prefix_answer(irr, database, prefix_object);
 	  if (prefix_object->type == ROUTE || prefix_object->type == ROUTE6)
@@ -983,70 +1131,116 @@ void irr_less_all (irr_connection_t *irr, prefix_t *prefix,
   }
 }
 
-/* Route searches. M - all more specific eg, !r199.208.0.0/16,M */
-/* TODO: Need to implement m for one level only more specific */
-void irr_more_all (irr_connection_t *irr, prefix_t *prefix, int mode) {
+/* more_specifics
+ * Go through the routes in (database) more specific than (prefix), all of
+ * them for SEARCH_ALL_LEVELS, or for SEARCH_ONE_LEVEL only the first
+ * found on each branch below it, not looking any deeper there.  They
+ * are added to the answer, unless (count_over) is set: then they are only
+ * counted, and the walk stops once more than (count_over) are found.
+ *
+ * Return:
+ *  the number of objects found
+ */
+static u_long more_specifics (irr_connection_t *irr, irr_database_t *database,
+			      prefix_t *prefix, int flag, int mode,
+			      u_long count_over) {
   radix_node_t *node, *start_node;
-  radix_node_t *roa_node = NULL;
   irr_prefix_object_t *prefix_object;
   radix_tree_t *radix;
-  irr_database_t *database;
   char tmpstr[16];
-  
-  if (prefix->bitlen < 8) {
+  u_long found = 0;
+  int found_here;
+
+  if (prefix->family == AF_INET6)
+    radix = database->radix_v6;
+  else
+    radix = database->radix_v4;
+
+  /* memory  -- find the prefix, or the best large node */
+  if ((start_node = radix_search_exact_raw (radix, prefix)) == NULL)
+    return (0);
+
+  RADIX_WALK (start_node, node) {
+    found_here = 0;
+    if ((node->prefix->bitlen > prefix->bitlen) &&
+	(comp_with_mask ((void *) node->key, 
+			 (void *) prefix_tochar (prefix),  prefix->bitlen))) {
+      prefix_object = (irr_prefix_object_t *) node->data;
+      while (prefix_object != NULL) {
+	if (!(mode & RAWHOISD_MODE) || prefix_object->type == ROUTE || prefix_object->type == ROUTE6) {
+	  found_here++;
+	  if (count_over)
+	    ;
+	  else if (irr->full_obj == 0 && mode & RAWHOISD_MODE) {
+	    irr_add_answer(irr, "%s %s-AS%s\n",database->name, prefix_toax(node->prefix), print_as(tmpstr,prefix_object->origin));
+	  } else {
+	    if (mode & INCLUDE_ROASTATUS) { /* need to include info for ROA */
+	      irr_build_roa_answer (irr, database, prefix_object, node->prefix);
+	    } else
+	      irr_build_prefix_answer (irr, database, prefix_object);
+	  }
+	}
+	prefix_object = prefix_object->next;
+      }
+    }
+    found += found_here;
+    /* a search over the limit is refused, no need to know by how much */
+    if (count_over && found > count_over)
+      break;
+    /* the next level down is hidden by this one */
+    if (found_here && flag == SEARCH_ONE_LEVEL)
+      RADIX_WALK_BREAK;
+  }
+  RADIX_WALK_END;
+  return (found);
+}
+
+/* Route searches. M - all more specific eg, !r199.208.0.0/16,M
+ *                 m - one level more specific eg, !r199.208.0.0/16,m
+ * flag is SEARCH_ALL_LEVELS or SEARCH_ONE_LEVEL
+ * Returns 1, or -1 if the search was refused and the error sent */
+int irr_more_all (irr_connection_t *irr, prefix_t *prefix, int flag, int mode) {
+  irr_database_t *database;
+  char buf[BUFSIZE];
+  u_long found = 0;
+
+  /* without a limit on the answer, keep away from the biggest ones */
+  if (IRR.more_specifics_limit == 0 && prefix->bitlen < 8) {
     irr_mode_send_error (irr, mode, "only allow more specific searches >= /8");
-    return;
+    return (-1);
   }
 
   if (mode & RAWHOISD_MODE) {
      irr->ll_answer = LL_Create (LL_DestroyFunction, free, 0);
      irr_lock_all (irr);
-  } else {
-    if (mode & INCLUDE_ROASTATUS) {
-      roa_node = prefix_search_best (IRR.roa_database, prefix);
-    }
   }
 
-  LL_ContIterate (irr->ll_database, database) {
-    start_node = NULL;
-    node = NULL;    
-
-    if (prefix->family == AF_INET6)
-      radix = database->radix_v6;
-    else
-      radix = database->radix_v4;
-
-    /* memory  -- find the prefix, or the best large node */
-    start_node = radix_search_exact_raw (radix, prefix);
-
-    if (start_node != NULL) {
-      RADIX_WALK (start_node, node) {
-	if ((node->prefix != NULL) &&
-	    (node->prefix->bitlen > prefix->bitlen) &&
-	    (comp_with_mask ((void *) prefix_tochar (node->prefix), 
-			     (void *) prefix_tochar (prefix),  prefix->bitlen))) {
-	  prefix_object = (irr_prefix_object_t *) node->data;
-	  while (prefix_object != NULL) {
-	    if (!(mode & RAWHOISD_MODE) || prefix_object->type == ROUTE || prefix_object->type == ROUTE6) {
-	      if (irr->full_obj == 0 && mode & RAWHOISD_MODE) {
-	        irr_add_answer(irr, "%s %s-AS%s\n",database->name, prefix_toax(node->prefix), print_as(tmpstr,prefix_object->origin));
-	      } else {
-		if ( (mode & INCLUDE_ROASTATUS) && roa_node) { /* need to include info for ROA */
-		  irr_build_roa_answer (irr, database, prefix_object, node->prefix->bitlen, roa_node);
-		} else
-		  irr_build_prefix_answer (irr, database, prefix_object);
-	      }
-	    }
-            prefix_object = prefix_object->next;
-	  }
-	}
+  /* count first, so an answer over the limit is never built */
+  if (IRR.more_specifics_limit > 0) {
+    LL_ContIterate (irr->ll_database, database) {
+      found += more_specifics (irr, database, prefix, flag, mode,
+			       IRR.more_specifics_limit);
+      if (found > IRR.more_specifics_limit)
+	break;
+    }
+    if (found > IRR.more_specifics_limit) {
+      if (mode & RAWHOISD_MODE) {
+	irr_unlock_all (irr);
+	LL_Destroy (irr->ll_answer);
       }
-      RADIX_WALK_END;
+      sprintf (buf, "more specific search matches over the limit of %lu objects",
+	       IRR.more_specifics_limit);
+      irr_mode_send_error (irr, mode, buf);
+      return (-1);
     }
   }
+
+  LL_ContIterate (irr->ll_database, database) {
+    more_specifics (irr, database, prefix, flag, mode, 0);
+  }
   
   if (!(mode & RAWHOISD_MODE))  /* if using RIPE MODE, data will be sent later*/
-    return;
+    return (1);
 
   if (irr->full_obj == 0) {
     irr_unlock_all(irr);
@@ -1057,6 +1251,7 @@ void irr_more_all (irr_connection_t *irr, prefix_t *prefix, int mode) {
     irr_write_buffer_flush (irr);
     LL_Destroy(irr->ll_answer);
   }
+  return (1);
 }
 
 /* Route searches.  o - return origin of exact match(es) eg, !r141.211.128/24,o 
@@ -1073,10 +1268,6 @@ void irr_exact (irr_connection_t *irr, prefix_t *prefix, int flag, int mode) {
     if (flag == SHOW_FULL_OBJECT)
       irr->ll_answer = LL_Create (LL_DestroyFunction, free, 0);
     irr_lock_all (irr);
-  } else {
-    if (mode & INCLUDE_ROASTATUS) {
-      (void)prefix_search_best (IRR.roa_database, prefix);
-    }
   }
 
   LL_ContIterate (irr->ll_database, database) {
@@ -114,6 +114,177 @@ int config_irr_max_con (uii_connection_t *uii, int max) {
   return (1);
 }
 
+void get_config_irr_worker_threads () {
+  config_add_output ("irr_worker_threads %d\r\n", IRR.worker_threads);
+}
+
+/* irr_worker_threads %d 
+ * number of threads answering whois queries when connections are served
+ * by the reactor.  Takes effect at startup.
+ */
+int config_irr_worker_threads (uii_connection_t *uii, int num) {
+
+  if ((num <= 0) || (num > 1000)) {
+    config_notice (NORM, uii, "CONFIG Error -- usage: irr_worker_threads <1-1000>\n");
+    return (-1);
+  }
+  IRR.worker_threads = num;
+  config_add_module (0, "irr_worker_threads", get_config_irr_worker_threads, NULL); 
+  return (1);
+}
+
+void get_config_irr_load_threads () {
+  config_add_output ("irr_load_threads %d\r\n", IRR.load_threads);
+}
+
+/* irr_load_threads %d 
+ * number of databases loaded at once on bootstrap and by 'reload all'
+ */
+int config_irr_load_threads (uii_connection_t *uii, int num) {
+
+  if ((num <= 0) || (num > 64)) {
+    config_notice (NORM, uii, "CONFIG Error -- usage: irr_load_threads <1-64>\n");
+    return (-1);
+  }
+  IRR.load_threads = num;
+  config_add_module (0, "irr_load_threads", get_config_irr_load_threads, NULL); 
+  return (1);
+}
+
+void get_config_irr_scan_threads () {
+  config_add_output ("irr_scan_threads %d\r\n", IRR.scan_threads);
+}
+
+/* irr_scan_threads %d 
+ * number of threads parsing a single .db file on a load, 1 for a serial scan
+ */
+int config_irr_scan_threads (uii_connection_t *uii, int num) {
+
+  if ((num <= 0) || (num > 64)) {
+    config_notice (NORM, uii, "CONFIG Error -- usage: irr_scan_threads <1-64>\n");
+    return (-1);
+  }
+  IRR.scan_threads = num;
+  config_add_module (0, "irr_scan_threads", get_config_irr_scan_threads, NULL); 
+  return (1);
+}
+
+void get_config_irr_expand_threads () {
+  config_add_output ("irr_expand_threads %d\r\n", IRR.expand_threads);
+}
+
+/* irr_expand_threads %d 
+ * threads expanding the nested sets of !i queries, 0 for none
+ */
+int config_irr_expand_threads (uii_connection_t *uii, int num) {
+
+  if ((num < 0) || (num > 64)) {
+    config_notice (NORM, uii, "CONFIG Error -- usage: irr_expand_threads <0-64>\n");
+    return (-1);
+  }
+  IRR.expand_threads = num;
+  config_add_module (0, "irr_expand_threads", get_config_irr_expand_threads, NULL); 
+  return (1);
+}
+
+void get_config_irr_gas_cache () {
+  config_add_output ("irr_gas_cache %lu\r\n", IRR.gas_cache_size / (1024 * 1024));
+}
+
+/* irr_gas_cache %d 
+ * megabytes of ready-to-send !gas/!6as answers to keep, 0 to disable
+ */
+int config_irr_gas_cache (uii_connection_t *uii, int megabytes) {
+
+  if ((megabytes < 0) || (megabytes > 4096)) {
+    config_notice (NORM, uii, "CONFIG Error -- usage: irr_gas_cache <0-4096>\n");
+    return (-1);
+  }
+  IRR.gas_cache_size = (u_long) megabytes * 1024 * 1024;
+  irr_gas_cache_flush ();
+  config_add_module (0, "irr_gas_cache", get_config_irr_gas_cache, NULL); 
+  return (1);
+}
+
+void get_config_irr_expand_cache () {
+  config_add_output ("irr_expand_cache %lu\r\n", IRR.expand_cache_size / (1024 * 1024));
+}
+
+/* irr_expand_cache %d 
+ * megabytes of expanded as-sets and route-sets to keep, 0 to disable
+ */
+int config_irr_expand_cache (uii_connection_t *uii, int megabytes) {
+
+  if ((megabytes < 0) || (megabytes > 4096)) {
+    config_notice (NORM, uii, "CONFIG Error -- usage: irr_expand_cache <0-4096>\n");
+    return (-1);
+  }
+  IRR.expand_cache_size = (u_long) megabytes * 1024 * 1024;
+  irr_expand_cache_flush ();
+  config_add_module (0, "irr_expand_cache", get_config_irr_expand_cache, NULL); 
+  return (1);
+}
+
+void get_config_irr_answer_buffer () {
+  config_add_output ("irr_answer_buffer %lu\r\n", IRR.answer_buffer_size / 1024);
+}
+
+/* irr_answer_buffer %d 
+ * kilobytes of a query answer to queue before writing it out while it is
+ * still being built, 0 to queue whole answers
+ */
+int config_irr_answer_buffer (uii_connection_t *uii, int kilobytes) {
+
+  if ((kilobytes < 0) || (kilobytes > 1024 * 1024)) {
+    config_notice (NORM, uii, "CONFIG Error -- usage: irr_answer_buffer <0-1048576>\n");
+    return (-1);
+  }
+  IRR.answer_buffer_size = (u_long) kilobytes * 1024;
+  config_add_module (0, "irr_answer_buffer", get_config_irr_answer_buffer, NULL); 
+  return (1);
+}
+
+void get_config_irr_more_specifics_limit () {
+  config_add_output ("irr_more_specifics_limit %lu\r\n", IRR.more_specifics_limit);
+}
+
+/* irr_more_specifics_limit %d 
+ * most objects a more specific route search may return, 0 for no limit
+ */
+int config_irr_more_specifics_limit (uii_connection_t *uii, int limit) {
+
+  if (limit < 0) {
+    config_notice (NORM, uii, "CONFIG Error -- usage: irr_more_specifics_limit <0-...>\n");
+    return (-1);
+  }
+  IRR.more_specifics_limit = limit;
+  config_add_module (0, "irr_more_specifics_limit", get_config_irr_more_specifics_limit, NULL); 
+  return (1);
+}
+
+void get_config_irr_index_snapshot () {
+  if (IRR.index_snapshot)
+    config_add_output ("irr_index_snapshot\r\n");
+}
+
+/* irr_index_snapshot
+ * write a <db>.idx snapshot of each database's indexes after it is
+ * loaded or cleaned, and load from it at startup when it is still valid.
+ */
+int config_irr_index_snapshot (uii_connection_t *uii) {
+
+  IRR.index_snapshot = 1;
+  config_add_module (0, "irr_index_snapshot", get_config_irr_index_snapshot, NULL); 
+  return (1);
+}
+
+/* no irr_index_snapshot */
+int no_config_irr_index_snapshot (uii_connection_t *uii) {
+
+  IRR.index_snapshot = 0;
+  return (1);
+}
+
 /* return the irr_port (whois) on which we are listening */
 void get_config_irr_port () {
   if (IRR.irr_port_access == 0)
@@ -215,6 +386,13 @@ void get_config_irr_database (irr_database_t *database) {
     atts =1;
   }
 
+  if (database->mirror_batch != MIRROR_BATCH) {
+    config_add_output ("irr_database %s mirror_batch %d\r\n",
+                       database->name,
+                       database->mirror_batch);
+    atts =1;
+  }
+
   if (database->access_list != 0) {
     config_add_output ("irr_database %s access %d\r\n", 
 		       database->name,
@@ -286,6 +464,12 @@ void get_config_irr_database (irr_database_t *database) {
 			database->name);
     atts = 1;
   }
+
+  if (database->flags & IRR_MIRROR_KEEPALIVE) {
+    config_add_output ("irr_database %s mirror_keepalive\r\n",
+			database->name);
+    atts = 1;
+  }
   
 #ifdef JOURNAL_SIZE
   if (database->max_journal_bytes != 0) {
@@ -1079,6 +1263,46 @@ int config_irr_database_mirror_protocol (uii_connection_t *uii, char *name, int
   return (1);
 }
 
+/* config irr_database %s mirror_batch %d */
+int config_irr_database_mirror_batch (uii_connection_t *uii, char *name, int num) {
+  irr_database_t *database = NULL;
+
+  if ((database = find_database (name)) == NULL) {
+    config_notice (ERROR, uii, "Database %s not found!\r\n", name);
+    irrd_free (name);
+    return (-1);
+  }
+
+  if (num < 0) {
+    config_notice (ERROR, uii, "Invalid mirror batch size %d.\r\n", num);
+    irrd_free (name);
+    return (-1);
+  }
+
+  trace (NORM, default_trace, "CONFIG %s mirror batch %d\n", name, num);
+  config_add_module (0, "mirror batch", get_config_irr_database, database);
+
+  database->mirror_batch = num;
+  irrd_free (name);
+  return (1);
+}
+
+/* config irr_database %s mirror_keepalive */
+int config_irr_database_mirror_keepalive (uii_connection_t *uii, char *name) {
+  irr_database_t *database = NULL;
+
+  if ((database = find_database (name)) == NULL) {
+    config_notice (ERROR, uii, "Database %s not found!\r\n", name);
+    irrd_free (name);
+    return (-1);
+  }
+
+  trace (NORM, default_trace, "CONFIG %s mirror keepalive\n", name);
+  database->flags |= IRR_MIRROR_KEEPALIVE;
+  irrd_free (name);
+  return (1);
+}
+
 /* config irr_database %s mirror-access %d */
 int config_irr_database_mirror_access (uii_connection_t *uii, char *name, int num) {
   irr_database_t *database = NULL;
@@ -1185,9 +1409,11 @@ int no_config_irr_database (uii_connection_t *uii, char *name) {
   config_notice (NORM, uii, "CONFIG database %s deleted\r\n", db->name);
   LL_Remove (IRR.ll_database, db);
   irr_update_lock (db);
+  irr_gas_cache_flush ();
+  irr_expand_cache_flush ();
   radix_flush(db->radix_v4);
   radix_flush(db->radix_v6);
-  g_hash_table_destroy(db->hash);
+  irr_key_index_destroy(db->key_index);
   g_hash_table_destroy(db->hash_spec);
   irrd_free(db->name);
   if (db->obj_filter_str)
@@ -1199,7 +1425,8 @@ int no_config_irr_database (uii_connection_t *uii, char *name) {
   if (db->compress_script)
     irrd_free(db->compress_script);
   irr_update_unlock (db);
-  pthread_mutex_destroy(&db->mutex_lock);
+  irr_db_unmap(db);
+  pthread_rwlock_destroy(&db->rwlock);
   pthread_mutex_destroy(&db->mutex_clean_lock);
   irrd_free(db);
   irrd_free(name);
@@ -4,6 +4,7 @@
  */
 
 #include <sys/types.h>
+#include <sys/time.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <stdio.h>
@@ -27,47 +28,114 @@ static int reopen_DB        (irr_database_t *, char *);
 static int reopen_JOURNAL   (irr_database_t *, char *);
 static int replace_cache_db (irr_database_t *, uii_connection_t *, char *);
 
+static int reload_database  (irr_database_t *, uii_connection_t *, char *, int);
+
 /* bootstrap load support functions */
 static int ftp_db_fetch     (irr_database_t *);
 static int fetch_remote_db  (irr_database_t *, char *);
+static int load_database    (irr_database_t *, void *);
+static int reload_one       (irr_database_t *, void *);
+
+/* a set of DB's loaded or reloaded on a few threads at once */
+struct load_pool {
+  irr_database_t **dbs;
+  int		n;
+  int		next;		/* next DB to hand out */
+  int		done;
+  int		running;	/* threads besides the caller */
+  int		ret;		/* sum of what fn returned */
+  int		(*fn) (irr_database_t *, void *);
+  void		*arg;
+  char		*what;
+  pthread_mutex_t mutex_lock;
+  pthread_cond_t cond;
+};
+
+struct load_args {
+  int		db_fetch_flag;
+  int		verbose;
+};
+
+static int irr_database_array (irr_database_t ***);
+static int irr_database_pool (irr_database_t **, int, 
+			      int (*) (irr_database_t *, void *), void *, char *);
+static void irr_database_pool_work (struct load_pool *);
+static void *irr_database_pool_thread (struct load_pool *);
+static u_long msecs_since (struct timeval *);
 
 void munge_buffer (char *buffer, irr_database_t *irr_database);
 int irr_check_serial_vs_journal (irr_database_t *database);
 
-/* database_clear
- * delete all indicies associated with a database 
+/* swap_indexes
+ * Publish the indexes and db file built in (fresh) on (database).  The
+ * set being replaced is moved into (fresh) for free_indexes ().  Caller
+ * holds the writer lock, so no query can still be using the old set
+ * once the lock is dropped; the teardown then runs without stalling them.
  */
-void database_clear (irr_database_t *db) {
-  int i;
-
-  if (db == NULL) {
-    trace (ERROR, default_trace, "*** NULL DATABASE!!! ****\n");
-    return;
+static void swap_indexes (irr_database_t *database, irr_database_t *fresh) {
+  radix_tree_t *radix;
+  irr_key_index_t *key_index;
+  GHashTable *hash;
+  FILE *fp;
+  int i, n, bytes;
+
+  radix = database->radix_v4;
+  database->radix_v4 = fresh->radix_v4;
+  fresh->radix_v4 = radix;
+
+  radix = database->radix_v6;
+  database->radix_v6 = fresh->radix_v6;
+  fresh->radix_v6 = radix;
+
+  key_index = database->key_index;
+  database->key_index = fresh->key_index;
+  fresh->key_index = key_index;
+
+  hash = database->hash_spec;
+  database->hash_spec = fresh->hash_spec;
+  fresh->hash_spec = hash;
+
+  fp = database->db_fp;
+  database->db_fp = fresh->db_fp;
+  fresh->db_fp = fp;
+
+  bytes = database->bytes;
+  database->bytes = fresh->bytes;
+  fresh->bytes = bytes;
+
+  for (i = 0; i < IRR_MAX_CLASS_KEYS; i++) {
+    n = database->num_objects[i];
+    database->num_objects[i] = fresh->num_objects[i];
+    fresh->num_objects[i] = n;
   }
 
-  trace (NORM, default_trace, "Clearing out database %s\n", db->name);
+  /* cached !gas answers and set expansions came from the old spec hash */
+  irr_gas_cache_flush ();
+  irr_expand_cache_flush ();
+}
+
+/* free_indexes
+ * Release a shadow database built by new_database () for a clean or
+ * reload, along with whatever indexes and db file it still holds.
+ * The journal is shared with the live database and is left open.
+ */
+static void free_indexes (irr_database_t *db) {
 
-  db->bytes = 0;
-  for (i=0; i< IRR_MAX_CLASS_KEYS; i++) 
-    db->num_objects[i] = 0;
-  
   radix_flush (db->radix_v4);
   radix_flush (db->radix_v6);
-
-  if (db->hash)
-    g_hash_table_remove_all(db->hash);
-
+  irr_key_index_destroy (db->key_index);
   if (db->hash_spec)
-    g_hash_table_remove_all(db->hash_spec);
-
-  db->radix_v4 = New_Radix (32);
-  db->radix_v6 = New_Radix (128);
-  fclose (db->db_fp);
-
-  db->db_fp = NULL;
+    g_hash_table_destroy (db->hash_spec);
+  if (db->db_fp != NULL)
+    fclose (db->db_fp);
+  irr_db_unmap (db);
+
+  irrd_free(db->name);
+  pthread_rwlock_destroy (&db->rwlock);
+  pthread_mutex_destroy (&db->mutex_clean_lock);
+  irrd_free(db);
 }
 
-
 /* Control the process of reloading database (name).
  *
  * Can be invoked by irrdcacher via the !B command or from the
@@ -108,39 +176,106 @@ int irr_reload_database (char *name, uii_connection_t *uii, char *tmp_dir) {
   }
 
   /* if we are called for rollback then we already have the lock */
-  if (uii != NULL || tmp_dir != NULL)
-    irr_update_lock (database);
+  return (reload_database (database, uii, tmp_dir, 
+			   (uii != NULL || tmp_dir != NULL)));
+}
+
+/* reload_database
+ * The work of irr_reload_database ().  (locked) is 0 if the caller
+ * already holds the update lock (a rollback).
+ */
+static int reload_database (irr_database_t *database, uii_connection_t *uii, 
+			    char *tmp_dir, int locked) {
+  irr_database_t *fresh;
+  char fname[BUFSIZE+1], newdb[256];
+  struct timeval start;
+  FILE *fp;
+
+  gettimeofday (&start, NULL);
+
+  /* only updates are held off while the new indexes are built;
+   * queries keep using the current ones until the swap */
+  if (locked)
+    irr_clean_lock (database);
+
+  /* build the new indexes from the replacement DB if there is one,
+   * else from the DB in our cache */
+  sprintf (fname, "%s/%s.db", (tmp_dir != NULL) ? tmp_dir : IRR.database_dir,
+	   database->name);
+  if ((fp = fopen (fname, "r+")) == NULL) {
+    trace (ERROR, default_trace, "irr_reload_database (): could not open "
+	   "(%s): %s\n", fname, strerror (errno));
+    if (locked)
+      irr_clean_unlock (database);
+    if (uii != NULL) 
+      uii_send_data (uii, "Operation aborted!\r\n");
+    return 0;
+  }
+
+  if (uii != NULL) 
+    uii_send_data (uii,"Loading the database and re-building the indicies ...\r\n");
+
+  sprintf (newdb, ".%s.reload", database->name);
+  fresh = new_database (newdb);
+  fresh->db_fp = fp;
+  fresh->journal_fd = database->journal_fd;
+  fresh->obj_filter = database->obj_filter;
+  scan_irr_file (fresh, NULL, 0, NULL);
+
+  /* scan_irr_file () opens the journal if we did not have one yet */
+  if (database->journal_fd < 0)
+    database->journal_fd = fresh->journal_fd;
+
+  if (locked)
+    irr_lock (database);
 
   /* atomically move the new DB into our cache area */
   if (tmp_dir != NULL) {
     if (!replace_cache_db (database, uii, tmp_dir)) {
       irr_update_unlock (database);
+      free_indexes (fresh);
       trace (ERROR, default_trace, "irr_reload_database (): reload (%s) aborted!\n",
 	     database->name);
       if (uii != NULL) 
 	uii_send_data (uii, "Operation aborted!\r\n");
       return 0;
     }
+
+    /* the indexes were built from the (tmp_dir) copy, serve and
+     * append to the one now in the cache area */
+    fclose (fresh->db_fp);
+    if (!reopen_DB (database, IRR.database_dir)) {
+      trace (ERROR, default_trace, 
+	     "irr_reload_database (): could not reopen (%s). exit (0)\n", 
+	     database->name);
+      exit (0);
+    }
+    fresh->db_fp = database->db_fp;
+    database->db_fp = NULL;
   }
-    
-  if (uii != NULL) 
-    uii_send_data (uii, "Clearing out old data...\r\n");
-  database_clear (database);
 
-  if (uii != NULL) 
-    uii_send_data (uii,"Loading the database and re-building the indicies ...\r\n");
+  swap_indexes (database, fresh);
+  database->time_loaded = fresh->time_loaded;
+  database->load_msecs = msecs_since (&start);
 
-  /* rebuild the indexes and reload the serial file */
-  scan_irr_file (database, NULL, 0, NULL);
+  /* reload the serial file */
   scan_irr_serial (database);
 
   /* TODO - Check return code and do something besides log the trace */
   irr_check_serial_vs_journal (database);
 
   /* if we are called for rollback then we already have the lock */
-  if (uii != NULL || tmp_dir != NULL)
+  if (locked)
     irr_update_unlock (database);
 
+  /* no query can reference the old indexes now */
+  free_indexes (fresh);
+
+  /* a rollback still holds the lock; it removed the snapshot, and the
+   * next load does a full scan */
+  if (locked && IRR.index_snapshot)
+    irr_snapshot_write (database);
+
   if (uii != NULL) 
     uii_send_data (uii, "Successful operation\r\n");
 
@@ -206,51 +341,234 @@ void append_blank_line (FILE *fp) {
  *   no objects)
  */
 int irr_load_data (int db_fetch_flag, int verbose) {
-  int empty_dbs = 0, n = 0, i;
+  struct load_args args;
+  irr_database_t **dbs;
+  int empty_dbs, n;
+
+  /* signal to caller that the user has not config'd any DB's */
+  if ((n = irr_database_array (&dbs)) == 0)
+    return -1;
+
+  /* shared by every load, so build it before they start */
+  if (IRR.key_string_hash == NULL)
+    populate_keyhash (dbs[0]);
+
+  args.db_fetch_flag = db_fetch_flag;
+  args.verbose = verbose;
+  empty_dbs = irr_database_pool (dbs, n, load_database, &args, "Loaded");
+  irrd_free (dbs);
+
+  /* return the number of empty DB's. */
+  return empty_dbs;
+}
+
+/* load_database
+ * Load one DB on bootstrap.  Return 1 if it is empty, 0 otherwise.
+ */
+static int load_database (irr_database_t *db, void *arg) {
+  struct load_args *args = (struct load_args *) arg;
+  struct timeval start;
+  int empty = 0, snapshot;
+
+  gettimeofday (&start, NULL);
+  irr_update_lock (db);
+
+  /* the index snapshot is checked against the serial */
+  scan_irr_serial (db);
+  snapshot = IRR.index_snapshot ? irr_snapshot_load (db) : -1;
+
+  /* load the DB and build the indicies.  if DB is not in our
+   * cache then attempt a remote irrdcacher fetch */
+  if (snapshot < 0 && scan_irr_file (db, NULL, 0, NULL) != NULL) {
+    empty = 1;
+
+    /* did the user override our missing DB remote fetch behavior? 
+     * if not then see if we can retrieve the DB from an ftp site */
+    if (args->db_fetch_flag &&
+	!(db->flags & IRR_AUTHORITATIVE))
+      empty -= ftp_db_fetch (db);
+
+    /* DB is empty and we could not remote fetch */
+    if (empty) {
+      trace (NORM, default_trace, "WARNING: Database %s is empty!\n", db->name);
+      if (args->verbose)
+	printf ("WARNING: Database %s is empty!\n", db->name);
+    }
+  }
+
+  /* initialize the serial file */
+  scan_irr_serial (db);
+
+  /* TODO - Check return code and do something besides log the trace */
+  irr_check_serial_vs_journal (db);
+  append_blank_line (db->db_fp);
+
+  db->load_msecs = msecs_since (&start);
+  irr_update_unlock (db);
+
+  /* save a scan next time around */
+  if (IRR.index_snapshot && snapshot != 1)
+    irr_snapshot_write (db);
+
+  return empty;
+}
+
+/* irr_reload_all
+ * Rebuild the indexes of every DB, IRR.load_threads at a time.
+ *
+ * Return:
+ *  the number of DB's which could not be reloaded
+ */
+int irr_reload_all (uii_connection_t *uii) {
+  irr_database_t **dbs;
+  int failed, n, i;
+
+  if ((n = irr_database_array (&dbs)) == 0) {
+    uii_send_data (uii, "No databases configured\r\n");
+    return 0;
+  }
+
+  uii_send_data (uii, "Reloading %d databases, %d at a time ...\r\n", n,
+		 (IRR.load_threads < n) ? IRR.load_threads : n);
+  failed = irr_database_pool (dbs, n, reload_one, NULL, "Reloaded");
+
+  for (i = 0; i < n; i++)
+    uii_send_data (uii, "  %-20s %lu.%03lu seconds\r\n", dbs[i]->name,
+		   dbs[i]->load_msecs / 1000, dbs[i]->load_msecs % 1000);
+  irrd_free (dbs);
+
+  if (failed)
+    uii_send_data (uii, "%d databases could not be reloaded\r\n", failed);
+  else
+    uii_send_data (uii, "Successful operation\r\n");
+  return failed;
+}
+
+static int reload_one (irr_database_t *db, void *arg) {
+
+  return (reload_database (db, NULL, NULL, 1) ? 0 : 1);
+}
+
+/* irr_database_array
+ * Copy the configured DB's into an array for irr_database_pool ().
+ * Return the number of DB's; (*dbs) is to be irrd_free ()'d.
+ */
+static int irr_database_array (irr_database_t ***dbs) {
   irr_database_t *db;
+  int n = 0;
 
-  LL_Iterate (IRR.ll_database, db) {
+  *dbs = irrd_malloc ((LL_GetCount (IRR.ll_database) + 1) *
+		      sizeof (irr_database_t *));
+  LL_Iterate (IRR.ll_database, db)
+    (*dbs)[n++] = db;
+  return n;
+}
 
-    /* keep a count.  want to know if the user has not configured any DB's */
-    n++;
+/* irr_database_pool
+ * Call (fn) on each of the (n) DB's in (dbs), on up to IRR.load_threads
+ * threads.  Each DB has its own file, indexes and lock, so the loads are
+ * independent; the calling thread takes its share and returns once all
+ * of them are done.  (what) is for the progress log.
+ *
+ * Return:
+ *  the sum of what (fn) returned
+ */
+static int irr_database_pool (irr_database_t **dbs, int n,
+			      int (*fn) (irr_database_t *, void *), void *arg,
+			      char *what) {
+  struct load_pool pool;
+  struct timeval start;
+  u_long msecs;
+  int i;
 
-    irr_update_lock (db);
+  memset (&pool, 0, sizeof (pool));
+  pool.dbs = dbs;
+  pool.n = n;
+  pool.fn = fn;
+  pool.arg = arg;
+  pool.what = what;
+  pthread_mutex_init (&pool.mutex_lock, NULL);
+  pthread_cond_init (&pool.cond, NULL);
+  gettimeofday (&start, NULL);
+
+#ifdef HAVE_LIBPTHREAD
+  for (i = 1; i < IRR.load_threads && i < n; i++) {
+    pthread_mutex_lock (&pool.mutex_lock);
+    pool.running++;
+    pthread_mutex_unlock (&pool.mutex_lock);
+    if (mrt_thread_create ("IRR load", NULL, 
+			   (thread_fn_t) irr_database_pool_thread, &pool) == NULL) {
+      pthread_mutex_lock (&pool.mutex_lock);
+      pool.running--;
+      pthread_mutex_unlock (&pool.mutex_lock);
+      trace (ERROR, default_trace, "irr_database_pool (): could not start "
+	     "thread %d, continuing with fewer\n", i);
+      break;
+    }
+  }
+#endif /* HAVE_LIBPTHREAD */
 
-    /* load the DB and build the indicies.  if DB is not in our
-     * cache then attempt a remote irrdcacher fetch */
-    if (scan_irr_file (db, NULL, 0, NULL) != NULL) {
-      i = empty_dbs++;	
-	
-	/* did the user override our missing DB remote fetch behavior? 
-	 * if not then see if we can retrieve the DB from an ftp site */
-	if (db_fetch_flag &&
-	    !(db->flags & IRR_AUTHORITATIVE))
-	  empty_dbs -= ftp_db_fetch (db);
-
-	/* DB is empty and we could not remote fetch */
-	if (empty_dbs > i) {
-	  trace (NORM, default_trace, "WARNING: Database %s is empty!\n", db->name);
-	  if (verbose)
-	    printf ("WARNING: Database %s is empty!\n", db->name);
-	}
-      }
-      
-    /* initialize the serial file */
-    scan_irr_serial (db);
-      
-    /* TODO - Check return code and do something besides log the trace */
-    irr_check_serial_vs_journal (db);
-    append_blank_line (db->db_fp);
+  irr_database_pool_work (&pool);
 
-    irr_update_unlock (db);
+  pthread_mutex_lock (&pool.mutex_lock);
+  while (pool.running > 0)
+    pthread_cond_wait (&pool.cond, &pool.mutex_lock);
+  pthread_mutex_unlock (&pool.mutex_lock);
+
+  pthread_mutex_destroy (&pool.mutex_lock);
+  pthread_cond_destroy (&pool.cond);
+
+  msecs = msecs_since (&start);
+  trace (NORM, default_trace, "%s %d databases in %lu.%03lu seconds\n",
+	 what, n, msecs / 1000, msecs % 1000);
+  return pool.ret;
+}
+
+static void irr_database_pool_work (struct load_pool *pool) {
+  irr_database_t *db;
+  int ret;
+
+  while (1) {
+    pthread_mutex_lock (&pool->mutex_lock);
+    if (pool->next == pool->n) {
+      pthread_mutex_unlock (&pool->mutex_lock);
+      return;
+    }
+    db = pool->dbs[pool->next++];
+    pthread_mutex_unlock (&pool->mutex_lock);
+
+    ret = (pool->fn) (db, pool->arg);
+
+    pthread_mutex_lock (&pool->mutex_lock);
+    pool->ret += ret;
+    pool->done++;
+    trace (NORM, default_trace, "%s %s in %lu.%03lu seconds (%d of %d)\n",
+	   pool->what, db->name, db->load_msecs / 1000, db->load_msecs % 1000,
+	   pool->done, pool->n);
+    pthread_mutex_unlock (&pool->mutex_lock);
   }
+}
 
-  /* signal to caller that the user has not config'd any DB's */
-  if (n == 0)
-    return -1;
+static void *irr_database_pool_thread (struct load_pool *pool) {
 
-  /* return the number of empty DB's. */
-  return empty_dbs;
+  irr_database_pool_work (pool);
+
+  pthread_mutex_lock (&pool->mutex_lock);
+  pool->running--;
+  pthread_cond_signal (&pool->cond);
+  pthread_mutex_unlock (&pool->mutex_lock);
+
+  mrt_thread_exit ();
+  return (NULL);
+}
+
+/* milliseconds from (start) to now */
+static u_long msecs_since (struct timeval *start) {
+  struct timeval now;
+
+  gettimeofday (&now, NULL);
+  return ((u_long) (now.tv_sec - start->tv_sec) * 1000 +
+	  (now.tv_usec - start->tv_usec) / 1000);
 }
 
 /* the database on disk contains "xx", or deleted objects. Our pointers
@@ -349,48 +667,39 @@ int irr_database_clean (irr_database_t *database) {
   cleaned_db->obj_filter = database->obj_filter;
 
   scan_irr_file (cleaned_db, NULL, 0, NULL);
+  fclose (clean_fp);
+  cleaned_db->db_fp = NULL;
 
   irr_lock(database);
 
-  radix_flush(database->radix_v4);
-  radix_flush(database->radix_v6);
-  database->radix_v4 = cleaned_db->radix_v4;
-  database->radix_v6 = cleaned_db->radix_v6;
-  if (database->hash)
-    g_hash_table_destroy(database->hash);
-  database->hash = cleaned_db->hash;
-  if (database->hash_spec)
-    g_hash_table_destroy(database->hash_spec);
-  database->hash_spec = cleaned_db->hash_spec;
-
-  /* clean up temporary database */
-  irrd_free(cleaned_db->name);
-  pthread_mutex_destroy (&cleaned_db->mutex_lock);
-  pthread_mutex_destroy (&cleaned_db->mutex_clean_lock);
-  irrd_free(cleaned_db);
-
-  fclose (clean_fp);
-  fclose (database->db_fp);	/* close old database file */
-
   /* move .<database>.clean.db to <database>.db */
   if (rename (cleanfilename, dbfilename) < 0) {
     trace (TR_ERROR, default_trace, "Could not rename file to %s:%s\n", 
 	   dbfilename, strerror (errno));
     irr_update_unlock (database);
+    free_indexes (cleaned_db);
     return (-1);
   }
 
-  if ((db_fp = fopen (dbfilename, "r+")) == NULL) {
+  if ((cleaned_db->db_fp = fopen (dbfilename, "r+")) == NULL) {
     trace (TR_ERROR, default_trace, "Could not open db file %s:%s\n", 
 	   dbfilename, strerror (errno));
     irr_update_unlock (database);
+    free_indexes (cleaned_db);
     return (-1);
   }
 
-  database->db_fp = db_fp;
+  swap_indexes (database, cleaned_db);
   irr_update_unlock (database);
+
+  /* the old indexes and db file are no longer reachable by queries */
+  free_indexes (cleaned_db);
   trace (NORM, default_trace, "Finished clean of %s\n", database->name);
 
+  /* the clean rewrote the db file, the old snapshot is of no use */
+  if (IRR.index_snapshot)
+    irr_snapshot_write (database);
+
   return (1);
 }
 
@@ -664,6 +973,7 @@ int replace_cache_db (irr_database_t *db, uii_connection_t *uii, char *tmp_dir)
     }
     return 0;
   }
+  journal_index_reset (db);
 
   /* clean up the *.bak files */
   atomic_cleanup (&afinfo);
@@ -0,0 +1,340 @@
+/* A cache of !i set expansions, shared by all connections.
+ *
+ * Every set expanded by a query, the one asked for and each set nested
+ * in it, is kept here as an irr_expansion_t holding its fully expanded
+ * members.  So a query for AS-A can reuse the expansion of AS-C done
+ * for an earlier AS-B.  The key is the set name together with the
+ * expansion type, the address family and the order the sources are
+ * searched in (see rpsl_commands.c).
+ *
+ * An expansion lists the spec hash keys its members were read from
+ * (set objects, mbrs-by-ref and !gas entries), nested sets included.
+ * Those keys are indexed here, and commit_spec_hash () drops every
+ * expansion depending on a key it rewrites.  A reload or dbclean that
+ * swaps in new indexes empties the cache.  Both run under the writer
+ * lock of the database, while expansions read it under the readers'
+ * locks one set at a time.  An expansion is therefore only stored if no
+ * key was invalidated since it was started (see irr_expand_cache_epoch).
+ *
+ * Expansions are reference counted, so a query can keep using one that
+ * is dropped from the cache under it.  Once the expansions reach
+ * IRR.expand_cache_size bytes the cache is emptied and starts over.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <glib.h>
+
+#include "mrt.h"
+#include "trace.h"
+#include "config_file.h"
+#include "irrd.h"
+
+/* a spec hash key and the expansions depending on it */
+typedef struct _expand_dep_t {
+  char			*key;		/* an expansion's key */
+  struct _expand_dep_t	*next;
+} expand_dep_t;
+
+static struct {
+  pthread_mutex_t	mutex_lock;
+  GHashTable		*hash;		/* key -> irr_expansion_t */
+  GHashTable		*deps;		/* spec key -> chain of expand_dep_t */
+  u_long		epoch;		/* bumped by every invalidation */
+  u_long		bytes;
+  u_long		entries;
+  u_long		hits;
+  u_long		misses;
+  u_long		invalidations;
+  u_long		evictions;	/* dropped because the cache filled up */
+} expand_cache;
+
+/* rough cost of an entry and its hash slot, for the size limit */
+#define EXPAND_CACHE_OVERHEAD	64
+
+/* what (e) costs the cache when stored under (key) */
+static u_long expansion_size (char *key, irr_expansion_t *e) {
+  u_long size;
+  u_int i;
+
+  size = e->bytes + strlen (key) + 1 + EXPAND_CACHE_OVERHEAD;
+  for (i = 0; i < e->ndeps; i++)
+    size += sizeof (expand_dep_t) + strlen (key) + strlen (e->deps[i]) + 2 +
+      EXPAND_CACHE_OVERHEAD;
+  if (e->answer != NULL)
+    size += e->answer_len;
+  return (size);
+}
+
+/* expand_dep_unlink
+ * Take the expansion cached under (key) off the chain of the spec hash
+ * key (spec).  Caller holds the cache lock.
+ */
+static void expand_dep_unlink (char *spec, char *key) {
+  expand_dep_t *head, *dep, **prev;
+
+  if ((head = g_hash_table_lookup (expand_cache.deps, spec)) == NULL)
+    return;
+
+  if (!strcmp (head->key, key)) {
+    if ((dep = head->next) == NULL) {
+      g_hash_table_remove (expand_cache.deps, spec);
+      return;
+    }
+    /* the head stays put as the hash value, it takes over the next one */
+    irrd_free (head->key);
+    head->key = dep->key;
+    head->next = dep->next;
+    irrd_free (dep);
+    return;
+  }
+
+  for (prev = &head->next; (dep = *prev) != NULL; prev = &dep->next) {
+    if (!strcmp (dep->key, key)) {
+      *prev = dep->next;
+      irrd_free (dep->key);
+      irrd_free (dep);
+      return;
+    }
+  }
+}
+
+static void expand_dep_chain_free (expand_dep_t *dep) {
+  expand_dep_t *next;
+
+  for (; dep != NULL; dep = next) {
+    next = dep->next;
+    irrd_free (dep->key);
+    irrd_free (dep);
+  }
+}
+
+/* caller holds the cache lock */
+static void expansion_release_locked (irr_expansion_t *e) {
+
+  if (--e->ref_count == 0)
+    irr_expansion_free (e);
+}
+
+static void expand_cache_entry_free (irr_expansion_t *e) {
+
+  e->cached = 0;
+  expansion_release_locked (e);
+}
+
+static void expand_cache_flush_locked () {
+
+  if (expand_cache.hash != NULL) {
+    g_hash_table_destroy (expand_cache.hash);
+    g_hash_table_destroy (expand_cache.deps);
+  }
+  expand_cache.hash = g_hash_table_new_full (g_str_hash, g_str_equal, free,
+				   (GDestroyNotify) expand_cache_entry_free);
+  expand_cache.deps = g_hash_table_new_full (g_str_hash, g_str_equal, free,
+				   (GDestroyNotify) expand_dep_chain_free);
+  expand_cache.bytes = 0;
+  expand_cache.entries = 0;
+}
+
+void irr_expand_cache_init () {
+
+  pthread_mutex_init (&expand_cache.mutex_lock, NULL);
+  expand_cache_flush_locked ();
+}
+
+/* irr_expand_cache_lookup
+ * Find the expansion cached under (key).  Caller releases it with
+ * irr_expansion_release ().
+ *
+ * Return:
+ *  the expansion, or NULL if it has to be built
+ */
+irr_expansion_t *irr_expand_cache_lookup (char *key) {
+  irr_expansion_t *e;
+
+  if (IRR.expand_cache_size == 0)
+    return (NULL);
+
+  pthread_mutex_lock (&expand_cache.mutex_lock);
+  if ((e = g_hash_table_lookup (expand_cache.hash, key)) != NULL) {
+    expand_cache.hits++;
+    e->ref_count++;
+  } else
+    expand_cache.misses++;
+  pthread_mutex_unlock (&expand_cache.mutex_lock);
+  return (e);
+}
+
+/* irr_expand_cache_epoch
+ * Return a stamp to pass to irr_expand_cache_store () for an expansion
+ * about to be built.
+ */
+u_long irr_expand_cache_epoch () {
+  u_long epoch;
+
+  pthread_mutex_lock (&expand_cache.mutex_lock);
+  epoch = expand_cache.epoch;
+  pthread_mutex_unlock (&expand_cache.mutex_lock);
+  return (epoch);
+}
+
+/* irr_expand_cache_store
+ * Remember (e) under (key), unless a spec hash key was invalidated since
+ * (epoch) and (e) may be out of date, or (e) was read from a damaged
+ * entry and members may be missing.  The cache takes a reference to
+ * (e), the caller keeps its own.
+ */
+void irr_expand_cache_store (char *key, irr_expansion_t *e, u_long epoch) {
+  expand_dep_t *dep, *head;
+  u_long size;
+  u_int i;
+
+  if (IRR.expand_cache_size == 0 || e->incomplete)
+    return;
+
+  pthread_mutex_lock (&expand_cache.mutex_lock);
+  size = expansion_size (key, e);
+  if (size > IRR.expand_cache_size || epoch != expand_cache.epoch ||
+      g_hash_table_lookup (expand_cache.hash, key) != NULL) {
+    pthread_mutex_unlock (&expand_cache.mutex_lock);
+    return;
+  }
+
+  if (expand_cache.bytes + size > IRR.expand_cache_size) {
+    expand_cache.evictions += expand_cache.entries;
+    expand_cache_flush_locked ();
+  }
+
+  e->ref_count++;
+  e->cached = 1;
+  g_hash_table_insert (expand_cache.hash, strdup (key), e);
+  for (i = 0; i < e->ndeps; i++) {
+    dep = irrd_malloc (sizeof (expand_dep_t));
+    dep->key = strdup (key);
+    /* the head of a chain stays put as the hash value */
+    if ((head = g_hash_table_lookup (expand_cache.deps, e->deps[i])) != NULL) {
+      dep->next = head->next;
+      head->next = dep;
+    } else {
+      dep->next = NULL;
+      g_hash_table_insert (expand_cache.deps, strdup (e->deps[i]), dep);
+    }
+  }
+  expand_cache.bytes += size;
+  expand_cache.entries++;
+  pthread_mutex_unlock (&expand_cache.mutex_lock);
+}
+
+void irr_expansion_hold (irr_expansion_t *e) {
+
+  pthread_mutex_lock (&expand_cache.mutex_lock);
+  e->ref_count++;
+  pthread_mutex_unlock (&expand_cache.mutex_lock);
+}
+
+void irr_expansion_release (irr_expansion_t *e) {
+
+  pthread_mutex_lock (&expand_cache.mutex_lock);
+  expansion_release_locked (e);
+  pthread_mutex_unlock (&expand_cache.mutex_lock);
+}
+
+/* irr_expansion_send
+ * Send the members of (e) to (irr).  The response is built once and
+ * kept with (e) for the next query.
+ */
+void irr_expansion_send (irr_connection_t *irr, irr_expansion_t *e) {
+  char *answer;
+  u_int len;
+
+  pthread_mutex_lock (&expand_cache.mutex_lock);
+  answer = e->answer;
+  pthread_mutex_unlock (&expand_cache.mutex_lock);
+
+  if (answer == NULL) {
+    if ((answer = irr_expansion_answer (e, &len)) == NULL) {
+      irr_write_nobuffer (irr, "D\n");
+      trace (NORM, default_trace, "No entries found\n");
+      return;
+    }
+
+    /* another query may have beaten us to it */
+    pthread_mutex_lock (&expand_cache.mutex_lock);
+    if (e->answer == NULL) {
+      e->answer = answer;
+      e->answer_len = len;
+      if (e->cached)
+	expand_cache.bytes += len;
+    } else
+      irrd_free (answer);
+    answer = e->answer;
+    pthread_mutex_unlock (&expand_cache.mutex_lock);
+  }
+
+  /* the answer lives as long as our reference to (e) */
+  irr_write (irr, answer, e->answer_len);
+  irr_write_buffer_flush (irr);
+  trace (NORM, default_trace, "Sent %u bytes\n", e->answer_len);
+}
+
+/* irr_expand_cache_invalidate
+ * Drop the expansions that read the spec hash key (key), and take them
+ * off the chains of the other keys they read.  Caller holds the writer
+ * lock of the database whose entry changed.
+ */
+void irr_expand_cache_invalidate (char *key) {
+  expand_dep_t *dep;
+  irr_expansion_t *e;
+  u_int i;
+
+  pthread_mutex_lock (&expand_cache.mutex_lock);
+  expand_cache.epoch++;
+  for (dep = g_hash_table_lookup (expand_cache.deps, key); dep != NULL;
+       dep = dep->next) {
+    if ((e = g_hash_table_lookup (expand_cache.hash, dep->key)) == NULL)
+      continue;
+    /* the chain of (key) goes as a whole below */
+    for (i = 0; i < e->ndeps; i++)
+      if (strcmp (e->deps[i], key))
+	expand_dep_unlink (e->deps[i], dep->key);
+    expand_cache.bytes -= expansion_size (dep->key, e);
+    expand_cache.entries--;
+    expand_cache.invalidations++;
+    g_hash_table_remove (expand_cache.hash, dep->key);
+  }
+  g_hash_table_remove (expand_cache.deps, key);
+  pthread_mutex_unlock (&expand_cache.mutex_lock);
+}
+
+/* irr_expand_cache_flush
+ * Drop every cached expansion, eg when a database gets new indexes.
+ */
+void irr_expand_cache_flush () {
+
+  pthread_mutex_lock (&expand_cache.mutex_lock);
+  expand_cache.invalidations += expand_cache.entries;
+  expand_cache.epoch++;
+  expand_cache_flush_locked ();
+  pthread_mutex_unlock (&expand_cache.mutex_lock);
+}
+
+void show_expand_cache (uii_connection_t *uii) {
+  u_long lookups;
+
+  pthread_mutex_lock (&expand_cache.mutex_lock);
+  if (IRR.expand_cache_size == 0)
+    uii_add_bulk_output (uii, "!i expansion cache disabled\r\n");
+  else {
+    lookups = expand_cache.hits + expand_cache.misses;
+    uii_add_bulk_output (uii, "!i expansion cache: %lu sets, %lu of %lu "
+			 "bytes\r\n", expand_cache.entries, expand_cache.bytes,
+			 IRR.expand_cache_size);
+    uii_add_bulk_output (uii, "   %lu hits, %lu misses (%lu%% hit rate), "
+			 "%lu invalidated, %lu evicted\r\n",
+			 expand_cache.hits, expand_cache.misses,
+			 lookups ? (expand_cache.hits * 100) / lookups : 0,
+			 expand_cache.invalidations, expand_cache.evictions);
+  }
+  pthread_mutex_unlock (&expand_cache.mutex_lock);
+}
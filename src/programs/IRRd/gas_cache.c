@@ -0,0 +1,310 @@
+/* A cache of ready-to-send !gas and !6as answers, shared by all
+ * connections.
+ *
+ * An answer depends on the origin and on the sources the connection
+ * queries (!s), so entries are looked up by the GASX/GASX6 key and then
+ * by the list of source names.  The whole "A<len>\n...C\n" response is
+ * kept, and a hit is a single copy into the connection's output.
+ *
+ * The GASX/GASX6 hash entries only change in commit_spec_hash (), which
+ * drops the cached answers for each key it rewrites, and when a reload
+ * or dbclean swaps in new indexes, which empties the cache.  Both run
+ * under the writer lock of the database, while answers are looked up and
+ * stored under the readers' locks of every source queried, so a cached
+ * answer is never older than the indexes it came from.
+ *
+ * Once the answers reach IRR.gas_cache_size bytes the least recently
+ * used ones make room for the new.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <glib.h>
+
+#include "mrt.h"
+#include "trace.h"
+#include "config_file.h"
+#include "irrd.h"
+
+typedef struct _gas_cache_entry_t {
+  char			*key;		/* the GASX/GASX6 key */
+  char			*sources;	/* eg, "RADB,RIPE" */
+  char			*answer;	/* the response, ready to send */
+  u_int			len;
+  GList			*lru;		/* our link in gas_cache.lru */
+  struct _gas_cache_entry_t *next;
+} gas_cache_entry_t;
+
+static struct {
+  pthread_mutex_t	mutex_lock;
+  GHashTable		*hash;		/* key -> chain of gas_cache_entry_t */
+  GQueue		*lru;		/* the entries, most recently used first */
+  u_long		bytes;
+  u_long		entries;
+  u_long		hits;
+  u_long		misses;
+  u_long		invalidations;
+  u_long		evictions;	/* dropped to make room */
+} gas_cache;
+
+/* rough cost of an entry and its hash slot, for the size limit */
+#define GAS_CACHE_OVERHEAD	(sizeof (gas_cache_entry_t) + 64)
+
+static u_long gas_cache_entry_bytes (gas_cache_entry_t *entry) {
+
+  return (entry->len + strlen (entry->key) + strlen (entry->sources) + 2 +
+	  GAS_CACHE_OVERHEAD);
+}
+
+/* caller holds the cache lock */
+static void gas_cache_entry_free (gas_cache_entry_t *entry) {
+
+  g_queue_delete_link (gas_cache.lru, entry->lru);
+  gas_cache.bytes -= gas_cache_entry_bytes (entry);
+  gas_cache.entries--;
+  irrd_free (entry->key);
+  irrd_free (entry->sources);
+  irrd_free (entry->answer);
+  irrd_free (entry);
+}
+
+static void gas_cache_chain_free (gas_cache_entry_t *entry) {
+  gas_cache_entry_t *next;
+
+  for (; entry != NULL; entry = next) {
+    next = entry->next;
+    gas_cache_entry_free (entry);
+  }
+}
+
+/* gas_cache_evict
+ * Drop the least recently used answer.  Caller holds the cache lock.
+ */
+static void gas_cache_evict () {
+  gas_cache_entry_t *entry, *head, **prev;
+  gpointer orig_key, value;
+  GList *link;
+
+  if ((link = g_queue_peek_tail_link (gas_cache.lru)) == NULL)
+    return;
+  entry = link->data;
+  gas_cache.evictions++;
+
+  if (!g_hash_table_lookup_extended (gas_cache.hash, entry->key, &orig_key,
+				     &value)) {
+    gas_cache_entry_free (entry);
+    return;
+  }
+  head = value;
+
+  /* the head of a chain is the hash value, its successor takes over */
+  if (head == entry) {
+    g_hash_table_steal (gas_cache.hash, entry->key);
+    if (entry->next != NULL)
+      g_hash_table_insert (gas_cache.hash, orig_key, entry->next);
+    else
+      free (orig_key);
+    gas_cache_entry_free (entry);
+    return;
+  }
+
+  for (prev = &head->next; *prev != NULL; prev = &(*prev)->next) {
+    if (*prev == entry) {
+      *prev = entry->next;
+      break;
+    }
+  }
+  gas_cache_entry_free (entry);
+}
+
+/* gas_cache_sources
+ * Write the names of the DB's (irr) queries into (buf).
+ *
+ * Return:
+ *  1 if they fit, 0 otherwise
+ */
+static int gas_cache_sources (irr_connection_t *irr, char *buf, int size) {
+  irr_database_t *db;
+  int n, len = 0;
+
+  buf[0] = '\0';
+  LL_ContIterate (irr->ll_database, db) {
+    n = strlen (db->name) + 1;
+    if (len + n >= size)
+      return 0;
+    if (len > 0)
+      buf[len - 1] = ',';
+    strcpy (buf + len, db->name);
+    len += n;
+  }
+  return 1;
+}
+
+static void gas_cache_flush_locked () {
+
+  g_hash_table_destroy (gas_cache.hash);
+  gas_cache.hash = g_hash_table_new_full (g_str_hash, g_str_equal, free,
+					  (GDestroyNotify) gas_cache_chain_free);
+  gas_cache.bytes = 0;
+  gas_cache.entries = 0;
+}
+
+void irr_gas_cache_init () {
+
+  pthread_mutex_init (&gas_cache.mutex_lock, NULL);
+  gas_cache.lru = g_queue_new ();
+  gas_cache.hash = g_hash_table_new_full (g_str_hash, g_str_equal, free,
+					  (GDestroyNotify) gas_cache_chain_free);
+}
+
+/* irr_gas_cache_send
+ * Send the cached answer to the !gas/!6as query for (key) on (irr)'s
+ * sources, if there is one.  Caller holds the sources' read locks.
+ *
+ * Return:
+ *  1 if the answer was sent, 0 if it has to be built
+ */
+int irr_gas_cache_send (irr_connection_t *irr, char *key) {
+  gas_cache_entry_t *entry;
+  char sources[BUFSIZE];
+  u_int len;
+
+  if (IRR.gas_cache_size == 0 ||
+      !gas_cache_sources (irr, sources, sizeof (sources)))
+    return 0;
+
+  pthread_mutex_lock (&gas_cache.mutex_lock);
+  for (entry = g_hash_table_lookup (gas_cache.hash, key); entry != NULL;
+       entry = entry->next)
+    if (!strcmp (entry->sources, sources))
+      break;
+
+  if (entry == NULL) {
+    gas_cache.misses++;
+    pthread_mutex_unlock (&gas_cache.mutex_lock);
+    return 0;
+  }
+
+  gas_cache.hits++;
+  g_queue_unlink (gas_cache.lru, entry->lru);
+  g_queue_push_head_link (gas_cache.lru, entry->lru);
+  len = entry->len;
+  irr_write (irr, entry->answer, len);
+  pthread_mutex_unlock (&gas_cache.mutex_lock);
+
+  trace (NORM, default_trace, "Sent %u bytes from the !gas cache\n", len);
+  return 1;
+}
+
+/* irr_gas_cache_store
+ * Remember (answer), the (len) byte response to the !gas/!6as query for
+ * (key) on (irr)'s sources.  The cache takes over (answer).  Caller holds
+ * the sources' read locks, the same ones the answer was built under.
+ */
+void irr_gas_cache_store (irr_connection_t *irr, char *key,
+			  char *answer, u_int len) {
+  gas_cache_entry_t *entry, *head;
+  char sources[BUFSIZE];
+  u_long size;
+
+  if (IRR.gas_cache_size == 0 ||
+      !gas_cache_sources (irr, sources, sizeof (sources))) {
+    irrd_free (answer);
+    return;
+  }
+
+  size = len + strlen (key) + strlen (sources) + 2 + GAS_CACHE_OVERHEAD;
+  if (size > IRR.gas_cache_size) {
+    irrd_free (answer);
+    return;
+  }
+
+  pthread_mutex_lock (&gas_cache.mutex_lock);
+
+  /* another query may have beaten us to it */
+  head = g_hash_table_lookup (gas_cache.hash, key);
+  for (entry = head; entry != NULL; entry = entry->next) {
+    if (!strcmp (entry->sources, sources)) {
+      pthread_mutex_unlock (&gas_cache.mutex_lock);
+      irrd_free (answer);
+      return;
+    }
+  }
+
+  /* make room, the chain of (key) may go too */
+  if (gas_cache.bytes + size > IRR.gas_cache_size) {
+    while (gas_cache.entries > 0 &&
+	   gas_cache.bytes + size > IRR.gas_cache_size)
+      gas_cache_evict ();
+    head = g_hash_table_lookup (gas_cache.hash, key);
+  }
+
+  entry = irrd_malloc (sizeof (gas_cache_entry_t));
+  entry->key = strdup (key);
+  entry->sources = strdup (sources);
+  entry->answer = answer;
+  entry->len = len;
+  g_queue_push_head (gas_cache.lru, entry);
+  entry->lru = g_queue_peek_head_link (gas_cache.lru);
+
+  /* the head of a chain stays put as the hash value */
+  if (head != NULL) {
+    entry->next = head->next;
+    head->next = entry;
+  } else {
+    entry->next = NULL;
+    g_hash_table_insert (gas_cache.hash, strdup (key), entry);
+  }
+
+  gas_cache.bytes += size;
+  gas_cache.entries++;
+  pthread_mutex_unlock (&gas_cache.mutex_lock);
+}
+
+/* irr_gas_cache_invalidate
+ * Drop the answers cached for the GASX/GASX6 key (key).  Caller holds
+ * the writer lock of the database whose entry changed.
+ */
+void irr_gas_cache_invalidate (char *key) {
+  gas_cache_entry_t *entry;
+
+  pthread_mutex_lock (&gas_cache.mutex_lock);
+  if ((entry = g_hash_table_lookup (gas_cache.hash, key)) != NULL) {
+    for (; entry != NULL; entry = entry->next)
+      gas_cache.invalidations++;
+    g_hash_table_remove (gas_cache.hash, key);
+  }
+  pthread_mutex_unlock (&gas_cache.mutex_lock);
+}
+
+/* irr_gas_cache_flush
+ * Drop every cached answer, eg when a database gets new indexes.
+ */
+void irr_gas_cache_flush () {
+
+  pthread_mutex_lock (&gas_cache.mutex_lock);
+  gas_cache.invalidations += gas_cache.entries;
+  gas_cache_flush_locked ();
+  pthread_mutex_unlock (&gas_cache.mutex_lock);
+}
+
+void show_gas_cache (uii_connection_t *uii) {
+  u_long lookups;
+
+  pthread_mutex_lock (&gas_cache.mutex_lock);
+  if (IRR.gas_cache_size == 0)
+    uii_add_bulk_output (uii, "!gas answer cache disabled\r\n");
+  else {
+    lookups = gas_cache.hits + gas_cache.misses;
+    uii_add_bulk_output (uii, "!gas answer cache: %lu answers, %lu of %lu "
+			 "bytes\r\n", gas_cache.entries, gas_cache.bytes,
+			 IRR.gas_cache_size);
+    uii_add_bulk_output (uii, "   %lu hits, %lu misses (%lu%% hit rate), "
+			 "%lu invalidated, %lu evicted\r\n",
+			 gas_cache.hits, gas_cache.misses,
+			 lookups ? (gas_cache.hits * 100) / lookups : 0,
+			 gas_cache.invalidations, gas_cache.evictions);
+  }
+  pthread_mutex_unlock (&gas_cache.mutex_lock);
+}
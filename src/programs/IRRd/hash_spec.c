@@ -104,10 +104,9 @@ int util_get_ll_string (LINKED_LIST **ll, u_long items, char **cp) {
       trace (ERROR, default_trace, "util_get_ll_string: badly formatted list - %s;\n", *cp);
       break;
     }
-    *b = '\0';
-    LL_Add ((*ll), new_irr_hash_string (a));
-    *b++ = ' ';
-    a = b;
+    /* the packed value is shared by the readers, copy the name out */
+    LL_Add ((*ll), new_irr_hash_string_len (a, b - a));
+    a = b + 1;
     items--;
   }
   return_len = a - *cp;	/* calculate the length of this string */
@@ -116,6 +115,104 @@ int util_get_ll_string (LINKED_LIST **ll, u_long items, char **cp) {
   return (return_len);
 }
 
+#define OBJLIST_SIZE	(2 * NETLONG_SIZE + NETSHORT_SIZE)
+
+/* store_hash_spec_delta
+ * Write back an entry changed by an update (see memory_hash_spec_open ()).
+ * The names and objects of the stored value are copied across less the
+ * ones deleted, then the ones added are appended, so nothing is unpacked.
+ * An entry left empty is removed.
+ */
+static void store_hash_spec_delta (irr_database_t *database,
+				   hash_spec_t *hash_sval) {
+  char *cp, *buf, *items_p, *names = NULL, *objs = NULL, *a, *b;
+  u_long items, old_items2 = 0, items1 = 0, items2 = 0, offset;
+  u_short _id;
+  u_int str_size, *count;
+  hash_item_t *hash_x;
+  irr_hash_string_t *p;
+
+  _id = hash_sval->id;
+  str_size = NETSHORT_SIZE + 2 * NETLONG_SIZE + hash_sval->len1 + 1 +
+    hash_sval->items2 * OBJLIST_SIZE;
+
+  /* find the names and objects stored so far */
+  if ((hash_x = g_hash_table_lookup (database->hash_spec, hash_sval->key)) != NULL) {
+    str_size += hash_spec_value_len (hash_x->value);
+    cp = hash_x->value + NETSHORT_SIZE;
+    if (_id != MNTOBJS) {
+      UTIL_GET_NETLONG (items, cp);
+      if (items > 0) {
+	names = cp;
+	cp += strlen (cp) + 1;
+      }
+    }
+    UTIL_GET_NETLONG (old_items2, cp);
+    objs = cp;
+  }
+
+  cp = buf = malloc (str_size);
+  UTIL_PUT_NETSHORT (_id, cp);
+
+  if (_id != MNTOBJS) {
+    items_p = cp;
+    cp += NETLONG_SIZE;
+    /* the names are each followed by a ' ' */
+    for (a = names; a != NULL && (b = strchr (a, ' ')) != NULL; a = b + 1) {
+      /* never terminated in place, the stored value is the readers' */
+      memcpy (cp, a, b - a);
+      cp[b - a] = '\0';
+      if (hash_sval->del_1 != NULL &&
+	  (count = g_hash_table_lookup (hash_sval->del_1, cp)) != NULL &&
+	  *count > 0)
+	(*count)--;
+      else {
+	cp += b - a;
+	*cp++ = ' ';
+	items1++;
+      }
+    }
+    LL_Iterate (hash_sval->ll_1, p) {
+      strcpy (cp, p->string);
+      cp += strlen (p->string);
+      *cp++ = ' ';
+      items1++;
+    }
+    if (items1 > 0)
+      *cp++ = '\0';
+    UTIL_PUT_NETLONG (items1, items_p);
+  }
+
+  items_p = cp;
+  cp += NETLONG_SIZE;
+  for (; old_items2 > 0; old_items2--, objs += OBJLIST_SIZE) {
+    a = objs;
+    UTIL_GET_NETLONG (offset, a);
+    if (hash_sval->del_2 != NULL &&
+	(count = g_hash_table_lookup (hash_sval->del_2,
+				      (gpointer) (uintptr_t) offset)) != NULL &&
+	*count > 0)
+      (*count)--;
+    else {
+      memcpy (cp, objs, OBJLIST_SIZE);
+      cp += OBJLIST_SIZE;
+      items2++;
+    }
+  }
+  util_put_ll_objs (hash_sval->ll_2, &cp);
+  items2 += hash_sval->items2;
+  UTIL_PUT_NETLONG (items2, items_p);
+
+  if (items1 == 0 && items2 == 0) {
+    free (buf);
+    remove_hash_spec (database, hash_sval->key);
+    return;
+  }
+  if (hash_x != NULL)
+    g_hash_table_remove (database->hash_spec, hash_x->key);
+  irr_spec_hash_store (database, hash_sval->key, buf);
+}
+
 /* Marshal the hash_spec_t struct into a hash_item_t struct.
  * this means flattening out the linked lists (ie, put both
  * ll's into a single char string).
@@ -168,6 +265,32 @@ void store_hash_spec (irr_database_t *database, hash_spec_t *hash_sval) {
   irr_spec_hash_store (database, hash_sval->key, buf);
 }
 
+/* hash_spec_value_len
+ * The size in bytes of a value packed by store_hash_spec ().
+ */
+u_int hash_spec_value_len (char *value) {
+  char *cp = value;
+  u_short _id;
+  u_long items;
+
+  UTIL_GET_NETSHORT (_id, cp);
+  UTIL_GET_NETLONG (items, cp);
+  if (_id == MNTOBJS)
+    return ((cp - value) + items * (2 * NETLONG_SIZE + NETSHORT_SIZE));
+
+  if (items > 0)
+    cp += strlen (cp) + 1;
+  if (_id == SET_OBJX) {
+    UTIL_GET_NETLONG (items, cp);
+    if (items > 0)
+      cp += strlen (cp) + 1;
+  } else if (_id == GASX || _id == GASX6 || _id == SET_MBRSX) {
+    UTIL_GET_NETLONG (items, cp);
+    cp += items * (2 * NETLONG_SIZE + NETSHORT_SIZE);
+  }
+  return (cp - value);
+}
+
 void remove_hash_spec (irr_database_t *db, char *key) {
   /* printf("enter remove_hash_spec( key-(%s))\n",key); */
   g_hash_table_remove(db->hash_spec, key);
@@ -196,10 +319,14 @@ hash_spec_t *fetch_hash_spec (irr_database_t *database, char *key,
       if (mode == UNPACK) {
         hash_sval->len1 = util_get_ll_string (&hash_sval->ll_1, 
                    hash_sval->items1, &cp);
+        if (LL_GetCount (hash_sval->ll_1) != hash_sval->items1)
+          hash_sval->incomplete = 1;
         if (_id == SET_OBJX) {
           UTIL_GET_NETLONG (hash_sval->items2, cp);
           hash_sval->len2 = util_get_ll_string (&hash_sval->ll_2,
                    hash_sval->items2, &cp);
+          if (LL_GetCount (hash_sval->ll_2) != hash_sval->items2)
+            hash_sval->incomplete = 1;
 /* XXX right for GASX6? */
         } else if (_id == GASX || _id == GASX6 || _id == SET_MBRSX) {
           UTIL_GET_NETLONG (hash_sval->items2, cp);
@@ -221,11 +348,106 @@ hash_spec_t *fetch_hash_spec (irr_database_t *database, char *key,
   return (hash_sval);
 }
 
+/* fetch_gas_answer
+ * Find the !gas/!6as answer packed in the GASX/GASX6 entry (key) of
+ * (database) without unpacking it.  (*len) is set to the length of the
+ * prefix list less its trailing ' '.
+ *
+ * Return:
+ *  the prefix list, or NULL if there is none
+ */
+char *fetch_gas_answer (irr_database_t *database, char *key, u_int *len) {
+  hash_item_t *hash_item;
+  u_short _id;
+  u_long items;
+  char *cp;
+
+  if ((hash_item = g_hash_table_lookup(database->hash_spec, key)) == NULL)
+    return (NULL);
+
+  cp = hash_item->value;
+  UTIL_GET_NETSHORT (_id, cp);
+  if (_id != GASX && _id != GASX6)
+    return (NULL);
+  UTIL_GET_NETLONG (items, cp);
+  if (items == 0 || *cp == '\0')
+    return (NULL);
+
+  *len = strlen (cp) - 1;
+  return (cp);
+}
+
+/* hash_spec_count_del
+ * Note one more (key) deleted from the stored entry, in (*del).
+ */
+static void hash_spec_count_del (GHashTable **del, gpointer key, int string) {
+  u_int *count;
+
+  if (*del == NULL) {
+    if (string)
+      *del = g_hash_table_new_full (g_str_hash, g_str_equal, free, free);
+    else
+      *del = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL, free);
+  }
+  if ((count = g_hash_table_lookup (*del, key)) == NULL) {
+    count = irrd_malloc (sizeof (u_int));
+    g_hash_table_insert (*del, string ? strdup (key) : key, count);
+  }
+  (*count)++;
+}
+
+/* memory_hash_spec_del_delta
+ * Delete the name and object of (irr_object) from an entry opened as a
+ * delta: drop them if this update added them, otherwise have them left
+ * out when the entry is written back.
+ */
+static void memory_hash_spec_del_delta (hash_spec_t *hash_value,
+					enum SPEC_KEYS id,
+					irr_object_t *irr_object) {
+  irr_hash_string_t *irr_hash_str;
+  objlist_t *obj_p;
+
+  if (id != MNTOBJS) {
+    if (irr_object->name == NULL)
+      return;
+    if ( (irr_object->type == ROUTE && id == GASX) ||
+	 (irr_object->type == ROUTE6 && id == GASX6) ||
+	 (id == SET_MBRSX) ) {
+      LL_Iterate (hash_value->ll_1, irr_hash_str) {
+	if (!strcmp (irr_object->name, irr_hash_str->string))
+	  break;
+      }
+      if (irr_hash_str != NULL) {
+	LL_Remove (hash_value->ll_1, irr_hash_str);
+	hash_value->items1--;
+	hash_value->len1 -= strlen (irr_object->name) + 1;
+      } else
+	hash_spec_count_del (&hash_value->del_1, irr_object->name, 1);
+    }
+  }
+
+  LL_Iterate (hash_value->ll_2, obj_p) {
+    if (irr_object->offset == obj_p->offset)
+      break;
+  }
+  if (obj_p != NULL) {
+    LL_Remove (hash_value->ll_2, obj_p);
+    hash_value->items2--;
+  } else
+    hash_spec_count_del (&hash_value->del_2,
+			 (gpointer) (uintptr_t) irr_object->offset, 0);
+}
+
 void memory_hash_spec_del (hash_spec_t *hash_value, enum SPEC_KEYS id, 
                             irr_object_t *irr_object) {
   irr_hash_string_t *irr_hash_str;
   objlist_t *obj_p;
 
+  if (hash_value->delta) {
+    memory_hash_spec_del_delta (hash_value, id, irr_object);
+    return;
+  }
+
   switch (id) {
     case SET_OBJX:
       hash_value->len1 = hash_value->len2 = 0; 
@@ -296,21 +518,56 @@ hash_spec_t *memory_hash_spec_create (char *key, enum SPEC_KEYS id) {
   return (hash_value);
 }
 
-int memory_hash_spec_remove (irr_database_t *db, char *key, enum SPEC_KEYS id,
-                            irr_object_t *irr_object) {
+/* memory_hash_spec_open
+ * Find the entry (key) an update changes, in the update's memory hash or
+ * else in the stored index.  A set object entry is unpacked and written
+ * back whole.  The origin, maintainer and mbrs-by-ref entries can run to
+ * many thousand objects, so those are not unpacked: the entry only
+ * collects what is added and deleted, and store_hash_spec_delta ()
+ * applies that to the stored value on commit.
+ *
+ * Return:
+ *  the entry, or NULL if there is none and (create) is not set
+ */
+static hash_spec_t *memory_hash_spec_open (irr_database_t *db, char *key,
+					   enum SPEC_KEYS id, int create) {
   hash_spec_t *hash_sval;
+  hash_item_t *hash_item;
+  char *cp;
+  u_short _id;
 
   convert_toupper(key);
-  hash_sval = g_hash_table_lookup(db->hash_spec_tmp, key);
+  if ((hash_sval = g_hash_table_lookup(db->hash_spec_tmp, key)) != NULL)
+    return (hash_sval);
 
-  if (hash_sval == NULL) { /* might be in the mem hash index */
-				    
-    if ((hash_sval = fetch_hash_spec (db, key, UNPACK)) == NULL)
-      return (-1); /* item not found, can't delete */
+  /* might be in the mem hash index */
+  if ((hash_item = g_hash_table_lookup(db->hash_spec, key)) != NULL) {
+    cp = hash_item->value;
+    UTIL_GET_NETSHORT (_id, cp);
+    id = _id;
+  } else if (!create)
+    return (NULL);
 
-    g_hash_table_insert(db->hash_spec_tmp, hash_sval->key, hash_sval);
+  if (id == SET_OBJX) {
+    if (hash_item == NULL ||
+	(hash_sval = fetch_hash_spec (db, key, UNPACK)) == NULL)
+      hash_sval = memory_hash_spec_create (key, id);
+  } else {
+    hash_sval = memory_hash_spec_create (key, id);
+    hash_sval->delta = 1;
   }
 
+  g_hash_table_insert(db->hash_spec_tmp, hash_sval->key, hash_sval);
+  return (hash_sval);
+}
+
+int memory_hash_spec_remove (irr_database_t *db, char *key, enum SPEC_KEYS id,
+                            irr_object_t *irr_object) {
+  hash_spec_t *hash_sval;
+
+  if ((hash_sval = memory_hash_spec_open (db, key, id, 0)) == NULL)
+    return (-1); /* item not found, can't delete */
+
   memory_hash_spec_del (hash_sval, id, irr_object);
   return (1);
 } 
@@ -324,16 +581,7 @@ int memory_hash_spec_store (irr_database_t *db, char *key, enum SPEC_KEYS id,
   objlist_t *obj_p;
   int retval = 1;
 
-  convert_toupper(key);
-  hash_sval = g_hash_table_lookup(db->hash_spec_tmp, key);
-
-  if (hash_sval == NULL) { /* might be in the mem hash index */
-				    
-    if ((hash_sval = fetch_hash_spec (db, key, UNPACK)) == NULL)
-      hash_sval = memory_hash_spec_create (key, id);
-
-    g_hash_table_insert(db->hash_spec_tmp, hash_sval->key, hash_sval);
-  }
+  hash_sval = memory_hash_spec_open (db, key, id, 1);
 
 if (id == GASX6)
   /* if the hash lookup found something and the id's don't match
@@ -420,6 +668,12 @@ void Delete_hash_spec (hash_spec_t *hash_sval) {
   if (hash_sval->ll_2)
     LL_Destroy (hash_sval->ll_2);
 
+  if (hash_sval->del_1)
+    g_hash_table_destroy (hash_sval->del_1);
+
+  if (hash_sval->del_2)
+    g_hash_table_destroy (hash_sval->del_2);
+
   irrd_free(hash_sval);
 }
 
@@ -433,7 +687,15 @@ void commit_spec_hash (irr_database_t *db) {
  * don't support iteration in hash tables 
  */
 void commit_spec_hash_process(gpointer key, hash_spec_t *hash_tval, irr_database_t *db) {
-    if (hash_tval->items1 == 0 && hash_tval->items2 == 0)
+    /* a route for this origin came or went */
+    if (hash_tval->id == GASX || hash_tval->id == GASX6)
+      irr_gas_cache_invalidate (hash_tval->key);
+    /* set expansions which read this entry */
+    irr_expand_cache_invalidate (hash_tval->key);
+
+    if (hash_tval->delta)
+      store_hash_spec_delta (db, hash_tval);
+    else if (hash_tval->items1 == 0 && hash_tval->items2 == 0)
       remove_hash_spec (db, hash_tval->key); 
     else 
       store_hash_spec (db, hash_tval); 
@@ -22,70 +22,31 @@
 #include "irrd.h"
 
 /* irr_database_store
- * 2 count | [1 type | 1 primary/secondary | 8 offset | 8 len] | ...
+ * Record that the object at (offset, len) carries (key).  The key
+ * index keeps every object for a key in one array, see key_index.c.
  */
-
-#define OBJCOUNT_SIZE (NETSHORT_SIZE)
-#define OBJINFO_SIZE (2 + NETLONG_SIZE + NETLONG_SIZE)
-
 int irr_database_store (irr_database_t *database, char *key, u_char p_or_s,
 			enum IRR_OBJECTS type, u_long offset, u_long len) {
-  hash_item_t *hash_item;
-  char *buffer, *cp;
-  u_char _type = (u_char) type;
-  u_int _size_old, _size_new;
-  u_short count;
-  int ret_code = 1;
+  int count;
 
   convert_toupper(key);
-  hash_item = g_hash_table_lookup(database->hash, key);
 
   /* JW want to dissallow duplicate primary key additions of same type */
 
-  /* create a new hash entry */
-  if (hash_item == NULL) {
-    _size_new = OBJCOUNT_SIZE + OBJINFO_SIZE;
-    buffer = malloc (_size_new);
-    count = 0;
-    cp = buffer + OBJCOUNT_SIZE;
+  count = irr_key_index_add (database->key_index, key, (u_char) type, p_or_s,
+			     offset, len);
+  if (count < 0) {
+    trace (ERROR, default_trace, 
+	   "irr_database_store(): out of memory storing key %s\n", key);
+    return -1;
   }
-  /* just append the new data to the end of the hash entry */
-  else {
-    cp = hash_item->value;
-    UTIL_GET_NETSHORT (count, cp);
-
-    if (count > 1000) {
-      trace (ERROR, default_trace, 
-     "%d entries for hash key %s exceeds 1000\n", count, key);
-    }
 
-    cp = hash_item->value; /* reset ptr to keep things simple */
-
-    _size_old = OBJCOUNT_SIZE + (count * OBJINFO_SIZE);
-    _size_new = _size_old + OBJINFO_SIZE;
-
-    buffer = realloc (cp, _size_new);
-    cp = buffer + _size_old;
-  } /* end append data */
-
-  *cp++ = _type;
-  *cp++ = p_or_s;
-  UTIL_PUT_NETLONG (offset, cp); 
-  UTIL_PUT_NETLONG (len, cp);
-
-  cp = buffer;
-  count++;
-  UTIL_PUT_NETSHORT (count, cp); /* count */
-
-  if (hash_item == NULL) {
-    hash_item = irrd_malloc(sizeof(hash_item_t));
-    hash_item->key = strdup (key);
-    hash_item->value = buffer;
-    g_hash_table_insert(database->hash, hash_item->key, hash_item);
-  } else
-    hash_item->value = buffer;
+  if (count > 1000) {
+    trace (ERROR, default_trace, 
+	   "%d entries for hash key %s exceeds 1000\n", count, key);
+  }
 
-  return ret_code; 
+  return 1;
 }
 
 void irr_hash_destroy (hash_item_t *hash_item) {
@@ -105,8 +66,7 @@ void irr_hash_destroy (hash_item_t *hash_item) {
 }
 
 /* irr_database_find_matches
- * find matches and extract info from hash table entry
- * 2 count | [1 type | 1 primary/secondary | 8 offset | 8 len] | ...
+ * find matches and extract info from the key index entry
  */
 int irr_database_find_matches (irr_connection_t *irr, char *key, 
 				   u_char p_or_s,
@@ -114,12 +74,9 @@ int irr_database_find_matches (irr_connection_t *irr, char *key,
 				   enum IRR_OBJECTS type,
 				   u_long *ret_offset, u_long *ret_len) {
   irr_database_t *database;
-  hash_item_t *hash_item = NULL;
-  u_long offset, len;
-  u_char _type /*XXX , _p_or_s */;
-  u_short count;
+  irr_key_entry_t *entry;
+  u_int count;
   int exit_on_match = 0;
-  char *cp;
 
   convert_toupper(key);
 
@@ -128,38 +85,31 @@ int irr_database_find_matches (irr_connection_t *irr, char *key,
 
   LL_Iterate (irr->ll_database, database) {
     
-    hash_item = g_hash_table_lookup(database->hash, key);
+    entry = irr_key_index_lookup (database->key_index, key, &count);
     
-    if (hash_item == NULL)
+    if (entry == NULL)
       continue;
 
-    cp = hash_item->value;
-    UTIL_GET_NETSHORT (count, cp);
-    
-    while (count--) {
-      _type = *cp++;
-      /*XXX _p_or_s = * */ cp++;
-      UTIL_GET_NETLONG (offset, cp);
-      UTIL_GET_NETLONG (len, cp);
+    for (; count > 0; count--, entry++) {
 
       /*
        * if (p_or_s != PRIMARY)
-       *     if (_p_or_s != p_or_s)
+       *     if (entry->p_or_s != p_or_s)
        *      continue;
        *
        */
       
       /* check type */
-      if ((match_behavior & TYPE_MODE) && (type != _type))
+      if ((match_behavior & TYPE_MODE) && (type != entry->type))
 	continue;
 
       /* if ret_offset is not null, we're loading an object, so fill it in */
       if (ret_offset != NULL) {
-	*ret_offset = offset;
-	*ret_len = len;
+	*ret_offset = entry->offset;
+	*ret_len = entry->len;
 	break;
       }
-      irr_build_answer (irr, database, _type, offset, len);
+      irr_build_answer (irr, database, entry->type, entry->offset, entry->len);
 
       /* RAWHOISD_MODE means exit after first the match */
       if (exit_on_match)
@@ -195,59 +145,22 @@ int find_object_offset_len (irr_database_t *db, char *key,
 }
 
 /* irr_database_remove
- * 2 count | [1 type | 1 primary/secondary | 8 offset | 8 len] | ...
- *
+ * Drop the object at (offset) from the entry for (key).
  */
 int irr_database_remove (irr_database_t *database, char *key, u_long offset) {
-  hash_item_t *hash_item;
-  char *cp;
-  char *buffer_new = NULL;
-  u_long _offset;
-  u_short count, new_count;
+  int ret;
   
   convert_toupper (key);
-  hash_item = g_hash_table_lookup(database->hash, key);
+  ret = irr_key_index_remove (database->key_index, key, offset);
 
-  if (hash_item == NULL)  {
+  if (ret == 0)  {
     trace (ERROR, default_trace, 
    "irr_database_remove(): unable to find hash for key %s\n", key);
     return -1;
   }
-
-  cp = hash_item->value;
-  UTIL_GET_NETSHORT (count, cp);
-
-  if (count == 0) {
-      trace (ERROR, default_trace, 
-     "irr_database_remove(): count value (%d) for hash key %s is <= 0\n", count, key);
-      return -1;
-  }
-
-  new_count = count - 1;
-  if (new_count > 0) {
-    int found = 0;
-
-    while (!found) {
-      cp += 2;	/* skip over type and primary/secondary flag */
-      UTIL_GET_NETLONG (_offset, cp); 
-      cp += NETLONG_SIZE;	/* skip length field */
-      count--; 
-      if (offset == _offset) found = 1; /* found the entry */
-      if (count == 0) break;	/* we have scanned all the entries */
-    }
-    if (!found) {
-      trace (ERROR, default_trace, "irr_database_remove(): did not find entry for key: %s, at offset: %d\n", key, offset);
-      return -1;
-    }
-    if (count > 0) {  /* see if we need to shift down entries */
-      memmove(cp - OBJINFO_SIZE, cp, count * OBJINFO_SIZE);
-    }
-    cp = hash_item->value;  /* point back to beginning of buffer */
-    UTIL_PUT_NETSHORT (new_count, cp); /* store new count */
-    buffer_new = realloc(hash_item->value, OBJCOUNT_SIZE + (new_count * OBJINFO_SIZE)); /* free unused space */
-    hash_item->value = buffer_new;
-  } else {
-    g_hash_table_remove(database->hash, hash_item->key);
+  if (ret < 0) {
+    trace (ERROR, default_trace, "irr_database_remove(): did not find entry for key: %s, at offset: %lu\n", key, offset);
+    return -1;
   }
 
   return 1;
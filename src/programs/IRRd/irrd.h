@@ -20,6 +20,8 @@
 
 #define EXPAND_TIMEOUT 45  /* set expansion timeout value - seconds */
 #define MIRROR_TIMEOUT 600 /* 10 minutes */
+#define WRITE_TIMEOUT 60   /* seconds a client may leave an answer unread */
+#define MIRROR_BATCH 1000  /* mirrored objects applied per writer lock */
 #define DEF_FTP_URL "ftp://ftp.radb.net/radb/dbase"
 
 extern char *obj_template[];
@@ -56,7 +58,7 @@ enum RIPE_FLAGS_T {
   RECURS_OFF  = 02, 	/* no recurse lookup */
   LESS_ONE    = 04,	/* one level less route search */
   LESS_ALL    = 010,	/* all levels less route search */
-  MORE_ONE    = 020,    /* ** TODO ** one level more route search */
+  MORE_ONE    = 020,    /* one level more route search */
   MORE_ALL    = 040,    /* all levels more route search */
   EXACT_MATCH = 0100,	/* exact match for route search */
   SOURCES_ALL = 0200,   /* set sources to all */
@@ -82,15 +84,121 @@ typedef struct _irr_prefix_object_t {
   struct _irr_prefix_object_t *next;	/* linked_list -- multiple prefixes for a node */
   enum IRR_OBJECTS type;	/* type of object: route, inetnum, route6, inet6num */
   uint32_t	origin;		/* origin AS for route and route6 objects */
+  u_char	maxlen;		/* ROA max length (roa-status m=), 0 if none */
   u_long	offset;
   u_long	len;
 } irr_prefix_object_t;
 
+/* read-only mapping of a <db>.db file, which answers copy objects from */
+typedef struct _irr_db_map_t {
+  char			*addr;
+  size_t		len;
+  dev_t			dev;		/* file the mapping was taken from */
+  ino_t			ino;
+} irr_db_map_t;
+
+/* a malloc'd block of answer queued by several connections, eg a cached
+ * mirror response; it is freed on the last release */
+typedef struct _irr_shared_block_t {
+  char			*addr;
+  size_t		len;
+  gint			ref_count;
+} irr_shared_block_t;
+
+/* compact index of object keys, see key_index.c */
+typedef struct _irr_key_entry_t {
+  u_long		offset;		/* object offset into database */
+  u_int			len;		/* object length in database */
+  u_char		type;		/* enum IRR_OBJECTS */
+  u_char		p_or_s;		/* PRIMARY or SECONDARY key */
+} irr_key_entry_t;
+
+typedef struct _irr_key_slot_t {
+  char			*key;		/* interned in the arena, NULL if empty */
+  u_int			hash;
+  u_int			count;		/* records in use */
+  u_int			size;		/* records allocated, 1 is inline */
+  union {
+    irr_key_entry_t	one;
+    irr_key_entry_t	*many;
+  } e;
+} irr_key_slot_t;
+
+typedef struct _irr_key_arena_t {
+  struct _irr_key_arena_t *next;
+  u_int			used;		/* key bytes follow the header */
+  u_int			size;
+} irr_key_arena_t;
+
+typedef struct _irr_key_index_t {
+  irr_key_slot_t	*slots;
+  u_int			mask;		/* number of slots - 1 */
+  u_int			keys;
+  u_int			tombstones;	/* slots of removed keys */
+  u_long		entries;
+  irr_key_arena_t	*arena;
+  u_long		arena_bytes;
+  u_long		dead_bytes;	/* arena space of removed keys */
+  u_long		posting_bytes;	/* out of line record arrays */
+} irr_key_index_t;
+
+/* members of a !i set expansion, see member_set.c */
+typedef struct _irr_member_prefix_t {
+  u_char		family;		/* AF_INET or AF_INET6 */
+  u_char		bitlen;
+  u_char		lo, hi;		/* prefix range, bitlen-bitlen if none */
+  u_char		addr[16];
+} irr_member_prefix_t;
+
+typedef struct _irr_member_set_t {
+  irr_member_prefix_t	*prefixes;
+  u_int			count;
+  u_int			size;		/* prefixes allocated */
+  u_int			*slots;		/* index into prefixes + 1, 0 if empty */
+  u_int			mask;		/* number of slots - 1 */
+  GHashTable		*names;		/* members that are not prefixes */
+  int			incomplete;	/* members may be missing, see below */
+  int			failed;		/* out of memory, members were dropped */
+} irr_member_set_t;
+
+/* a unit of work for the task pool, see task_pool.c */
+typedef struct _irr_task_t {
+  void			(*fn) (void *arg);
+  void			*arg;
+  int			state;		/* under the pool's lock */
+} irr_task_t;
+
+/* the expanded members of a set, shared through expand_cache.c */
+typedef struct _irr_expansion_t {
+  irr_member_prefix_t	*prefixes;
+  u_int			nprefixes;
+  char			**names;	/* members that are not prefixes */
+  u_int			nnames;
+  char			**deps;		/* spec hash keys the members came from */
+  u_int			ndeps;
+  char			*answer;	/* "A<len>\n...C\n", once sent */
+  u_int			answer_len;
+  u_long		bytes;
+  int			ref_count;	/* under the cache's lock */
+  int			cached;
+  int			incomplete;	/* read from a damaged entry, never cached */
+} irr_expansion_t;
+
+/* a sparse serial -> offset index of a journal file, see journal.c */
+typedef struct _irr_journal_index_t {
+  int			loaded;
+  u_int			n, size;
+  uint32_t		*serial;
+  off_t			*offset;	/* of the "% SERIAL" line */
+} irr_journal_index_t;
+
 typedef struct _irr_database_t {
   struct _irr_database_t	*next, *prev;	/* for linked_list */
   char			*name;		/* radb, mci, whatever */  
   FILE			*db_fp;		/* database.db file pointer */
   int			journal_fd;	/* database.JOURNAL file descriptor */
+  pthread_mutex_t	mutex_journal_index;
+  irr_journal_index_t	journal_index[2];	/* JOURNAL_NEW, JOURNAL_OLD */
   int			bytes;		/* bytes read so far */
   u_long		max_journal_bytes;  /* number of bytes in journal log */
   u_long		obj_filter;	/* object bit-fields of 1 are filtered out */
@@ -98,7 +206,9 @@ typedef struct _irr_database_t {
 
   /* mirroring stuff */
   int			mirror_fd;	/* the temporary fd for remote mirroring */
-  FILE			*mirror_disk_fp; 
+  char			*mirror_buf;	/* mirror stream read, not yet applied */
+  u_int			mirror_buf_len, mirror_buf_size;
+  int			mirror_header;	/* the %START line was read */
   int			mirror_update_size;
   long			time_last_successful_mirror;
   uint32_t		serial_number;	/* serial number for mirroring */
@@ -124,6 +234,7 @@ typedef struct _irr_database_t {
 #define IRR_NODEFAULT		4	/* Do not include by default in queries */
 #define IRR_ROUTING_TABLE_DUMP  8	/* Routing Table Dump flag */
 #define IRR_ROA_DATA		16	/* ROA flag */
+#define IRR_MIRROR_KEEPALIVE	32	/* keep the mirror connection open */
 
   u_long		access_list;		/* restrict access */
   u_long		write_access_list;	/* restrict writes -- refines access */
@@ -131,14 +242,18 @@ typedef struct _irr_database_t {
   u_long		cryptpw_access_list;	/* restrict access to CRYPTPW's */
   char			*compress_script;  /* script to compress and hide passwords in exported db's */
 
-  pthread_mutex_t	mutex_lock;
+  pthread_rwlock_t	rwlock;			/* queries read, updates write */
   pthread_mutex_t	mutex_clean_lock;	/* a special lock for cleaning */
-  /*rwlock_t		rwlock;*/
+  gint			read_locks;		/* lock statistics */
+  gint			read_locks_contended;
+  gint			write_locks;
+  gint			write_locks_contended;
   radix_tree_t		*radix_v4;		/* a v4 radix tree */
   radix_tree_t		*radix_v6;		/* a v6 radix tree */
-  GHashTable		*hash;		
+  irr_key_index_t	*key_index;	/* primary and secondary keys */
   GHashTable		*hash_spec;	/* hash for special queries */
   GHashTable		*hash_spec_tmp;	/* memory hash */
+  irr_db_map_t		*db_map;	/* mapping of db_fp for queries */
 
   int			no_dbclean;	/* flag to disable dbcleaning. By default, we clean */
   mtimer_t		*mirror_timer;
@@ -151,12 +266,14 @@ typedef struct _irr_database_t {
 
   /* mirror status and statistics */
   time_t		time_loaded;		/* when the db was loaded (or reloaded) */
+  u_long		load_msecs;		/* how long that took */
   time_t		last_update;		/* last email/TCP update */
   time_t		last_mirrored;		/* when we last mirrored successfully! */
   enum REMOTE_MIRROR_STATUS_T  remote_mirrorstatus;
   char			*mirror_host;		/* host to connect for mirroring */
   int			mirror_port;
   int                   mirror_protocol;        /* mirroring protocol version */
+  int			mirror_batch;		/* objects per lock, 0 for all */
 #define MAX_MIRROR_ERROR_LEN 255
   char			mirror_error_message[MAX_MIRROR_ERROR_LEN + 1];
   time_t		mirror_started;		/* hook for us to timeout on */
@@ -179,9 +296,9 @@ typedef struct _irr_answer_t {
   u_long	len;
   char 		*blob;
   irr_prefix_object_t	*prefix_obj;
-  irr_prefix_object_t	*roa_obj;
-  u_short	prefix_bitlen;
-  u_short	roa_bitlen;
+  irr_prefix_object_t	*roa_obj;	/* the ROA deciding roa_status, if any */
+  enum OBJ_ROASTATUS	roa_status;
+  int		roa_maxlen;	/* of roa_obj, -1 if it has none */
 } irr_answer_t;
 
 /* a generic object so we don't have to write new code every time a new
@@ -199,6 +316,7 @@ typedef struct _irr_object_t {
   /* convenience stuff */
   char		 origin_found;	/* flag if origin attribute found */
   uint32_t	 origin;	/* use in route object */
+  u_char	 roa_maxlen;	/* roa-status m= in the ROA database */
   char		*nic_hdl;	/* secondary key */
   LINKED_LIST	*ll_mbrs;	/* members list for as-set/route-set */
   LINKED_LIST	*ll_prefix;	/* prefix (as ascii string) for IPv6 site objects */
@@ -215,6 +333,11 @@ typedef struct _hash_spec_t {
   u_long	len1, len2;	/* keep track of gas char length */
   u_long	items1, items2;	/* number of gas prefixes in answer */
   char *gas_answer;		/* just a pointer into unpacked_value */
+  int		incomplete;	/* UNPACK found a list cut short */
+  /* an update's changes to a stored entry, see memory_hash_spec_open () */
+  int		delta;		/* ll_1/ll_2 only hold what was added */
+  GHashTable	*del_1;		/* name -> count deleted from the stored entry */
+  GHashTable	*del_2;		/* offset -> count deleted from the stored entry */
 } hash_spec_t;
 
 /* struct for collecting a key and key type
@@ -258,6 +381,17 @@ typedef struct _irr_t {
   int			mirror_interval;  /* Default seconds between getting mirrors */
   int			expansion_timeout;  /* the max number of seconds a set expansion is allowed to take */
   int			max_connections;  /* the max num of simultaneous RAWhoisd conn */
+  int			worker_threads;	/* size of the reactor worker pool */
+  int			reactor_workers; /* workers actually running, 0 if no reactor */
+  int			load_threads;	/* DB's loaded at once on bootstrap and reload all */
+  int			scan_threads;	/* threads parsing one big .db file on a load */
+  int			expand_threads;	/* task pool threads for !i expansions */
+  u_long		gas_cache_size;	/* bytes of cached !gas answers, 0 is off */
+  u_long		expand_cache_size; /* bytes of cached !i expansions, 0 is off */
+  u_long		more_specifics_limit; /* most objects a -M/-m search returns, 0 is any */
+  u_long		answer_buffer_size; /* bytes of an answer queued before it
+					     * is streamed out, 0 queues it all */
+  int			index_snapshot;	/* keep <db>.idx files for fast restarts */
   int			connections;	/* current number of connections */
   u_long		export_interval; /* when should we export database */
   pthread_mutex_t	lock_all_mutex_lock;
@@ -281,9 +415,13 @@ typedef struct _irr_t {
 
 extern irr_t IRR;
 
+#define IRR_ANSWER_BLOCK_SIZE	(16 * 1024)	/* size of a final_answer_t buffer */
+#define IRR_MAX_IOV		64	/* segments handed to one writev () */
+
 typedef struct _final_answer_t {
   u_char *ptr;
   u_char *buf;
+  irr_shared_block_t *shared;	/* buf points into this block, not our own */
 } final_answer_t;
 
 typedef struct _irr_connection_t {
@@ -296,6 +434,13 @@ typedef struct _irr_connection_t {
   LINKED_LIST		*ll_database;
   LINKED_LIST           *ll_answer;
   LINKED_LIST		*ll_final_answer;
+  u_long		final_answer_bytes; /* queued in ll_final_answer */
+  int			stream_answer;	/* write the answer out as it grows */
+  FILE			*spill_fp;	/* answer queued on disk, see irr_write_spill () */
+  LINKED_LIST		*ll_batch;	/* queries of a !ps...!pe batch */
+  u_int			batch_dropped;	/* queries past IRR_BATCH_MAX_QUERIES */
+  int			batch_query;	/* runs in a batch, output is kept */
+  int			batch_locked;	/* the batch holds the sources' locks */
   char buffer[BUFSIZE];
   char			*answer;
   int			answer_len;
@@ -315,6 +460,9 @@ typedef struct _irr_connection_t {
   char			update_file_name[256];
   irr_database_t	*database;
   u_long		timeout;	/* seconds before idle connection times out */	
+  int			reactor;	/* served by the reactor worker pool */
+  int			busy;		/* reactor: a worker owns the connection */
+  time_t		last_active;	/* reactor: when it was last re-armed */
 
   char tmp[BUFSIZE];            
   char *cp;		/* pointer to cursor in line */
@@ -382,6 +530,14 @@ typedef struct _objlist_t {
 #define IRR_EXIT		2
 #define IRR_MAXCMDLEN		384	/* max size for commands and queries */
 #define MAX_TOTAL_CONNECTIONS	128	/* default maximum total connections */
+#define IRR_DEFAULT_WORKERS	16	/* default reactor worker threads */
+#define IRR_DEFAULT_LOAD_THREADS 4	/* default DB's loaded at once */
+#define IRR_DEFAULT_SCAN_THREADS 1	/* default .db parser threads, 1 is serial */
+#define IRR_DEFAULT_EXPAND_THREADS	0	/* !i expansions run in the query's thread */
+#define IRR_DEFAULT_GAS_CACHE	32	/* default !gas answer cache, megabytes */
+#define IRR_DEFAULT_EXPAND_CACHE	64	/* default !i expansion cache, megabytes */
+#define IRR_DEFAULT_ANSWER_BUFFER	4096	/* default answer kilobytes queued */
+#define IRR_MAX_ANSWER_SPILL	(1024L * 1024 * 1024) /* most bytes of an answer on disk */
 #define MAX_PER_IP_CONNECTIONS	5	/* max connections per IP address */
 
 #define	MIRROR_BUFFER		1024*4
@@ -390,6 +546,10 @@ typedef struct _objlist_t {
 #define IRR_NOMODE		4	/* serial xtrans with no ADD or DEL header */
 #define IRR_ERRMODE		5	/* illegible serial */
 #define IRR_MODE_LOAD_UPDATE    1
+#define IRR_MODE_BATCH		2	/* collecting a !ps...!pe batch */
+#define IRR_BATCH_MAX_QUERIES	100000	/* queries held for one batch */
+#define IRR_BATCH_WINDOW	64	/* batch queries in flight at once */
+#define IRR_BATCH_LOCKED	256	/* batch queries run under one read lock */
 
 /* search types */
 #define SEARCH_ONE_LEVEL	0	/* e.g. !rxx.xx.xx,l */
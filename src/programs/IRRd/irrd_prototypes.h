@@ -10,6 +10,8 @@ int add_irr_object (irr_database_t *database, irr_object_t *irr_object);
 irr_object_t *load_irr_object (irr_database_t *database, irr_object_t *irr_object);
 int delete_irr_object (irr_database_t *database, irr_object_t *irr_object,
                        u_long *db_offset);
+int unindex_irr_object (irr_database_t *database,
+			irr_object_t *stored_irr_object);
 void mark_deleted_irr_object (irr_database_t *database, u_long offset);
 
 /* configuration */
@@ -50,12 +52,24 @@ int config_irr_database_authoritative (uii_connection_t *uii, char *name);
 int no_config_irr_database_authoritative (uii_connection_t *uii, char *name);
 int no_config_irr_database (uii_connection_t *uii, char *name);
 int config_irr_expansion_timeout (uii_connection_t *uii, int timeout);
+int config_irr_worker_threads (uii_connection_t *uii, int num);
+int config_irr_load_threads (uii_connection_t *uii, int num);
+int config_irr_scan_threads (uii_connection_t *uii, int num);
+int config_irr_expand_threads (uii_connection_t *uii, int num);
+int config_irr_gas_cache (uii_connection_t *uii, int megabytes);
+int config_irr_expand_cache (uii_connection_t *uii, int megabytes);
+int config_irr_answer_buffer (uii_connection_t *uii, int kilobytes);
+int config_irr_more_specifics_limit (uii_connection_t *uii, int limit);
+int config_irr_index_snapshot (uii_connection_t *uii);
+int no_config_irr_index_snapshot (uii_connection_t *uii);
 int config_irr_max_con (uii_connection_t *uii, int max);
 void config_create_default ();
 void get_config_irr_directory ();
 int config_irr_database_access_write (uii_connection_t *uii, char *name, int num);
 int config_irr_database_access_cryptpw (uii_connection_t *uii, char *name, int num);
 int config_irr_database_mirror_protocol (uii_connection_t *uii, char *name, int num);
+int config_irr_database_mirror_batch (uii_connection_t *uii, char *name, int num);
+int config_irr_database_mirror_keepalive (uii_connection_t *uii, char *name);
 int config_irr_database_mirror_access (uii_connection_t *uii, char *name, int num);
 int config_irr_database_compress_script (uii_connection_t *uii, char *name,  char *script);
 int config_irr_database_access (uii_connection_t *uii, char *name, int num);
@@ -101,7 +115,10 @@ int uii_read_update_file (uii_connection_t *uii, char *file, char *name);
 
 /* telnet */
 void irr_write  (irr_connection_t *irr, char *buf, int len);
+void irr_write_shared (irr_connection_t *irr, irr_shared_block_t *block);
+void irr_shared_block_release (irr_shared_block_t *block);
 void irr_write_buffer_flush (irr_connection_t *irr);
+void irr_write_spill (irr_connection_t *irr);
 void irr_write_nobuffer (irr_connection_t *irr, char *buf);
 void irr_send_answer (irr_connection_t * irr);
 int irr_add_answer (irr_connection_t *irr, char *format, ...);
@@ -112,24 +129,38 @@ void irr_mode_send_error (irr_connection_t * irr, int mode, char *);
 void irr_build_memory_answer (irr_connection_t *irr, u_long len, char * blob);
 void irr_build_answer (irr_connection_t *irr, irr_database_t *database, enum IRR_OBJECTS type, u_long offset, u_long len);
 void irr_build_prefix_answer (irr_connection_t *irr, irr_database_t *database, irr_prefix_object_t *prefix_object);
-void irr_build_roa_answer (irr_connection_t *irr, irr_database_t *database, irr_prefix_object_t *prefix_object, u_short bitlen, radix_node_t *roa_node);
+void irr_build_roa_answer (irr_connection_t *irr, irr_database_t *database, irr_prefix_object_t *prefix_object, prefix_t *prefix);
 void send_dbobjs_answer (irr_connection_t * irr, enum INDEX_T index, int mode);
 int listen_telnet (u_short port);
 int irr_destroy_connection (irr_connection_t * connection);
+int irr_read_command (irr_connection_t * irr);
 void show_connections (uii_connection_t *uii);
 
+/* reactor */
+int irr_reactor_init (void);
+int irr_reactor_add (irr_connection_t *irr);
+
+/* index snapshots */
+int irr_snapshot_write (irr_database_t *database);
+int irr_snapshot_load (irr_database_t *database);
+void irr_snapshot_remove (irr_database_t *database);
+
 /* database */
 int irr_load_data (int, int);
 int irr_copy_file (char *infile, char *outfile, int add_eof_flag);
-void database_clear (irr_database_t *db);
 int irr_reload_database (char *names, uii_connection_t *uii, char *tmp_dir);
+int irr_reload_all (uii_connection_t *uii);
 int irr_database_clean (irr_database_t *database);
 int irr_database_export (irr_database_t *database);
 void irr_export_timer (mtimer_t *timer, irr_database_t *db);
 
 /* journaling */
+void journal_open (irr_database_t *database);
 void journal_maybe_rollover (irr_database_t *database);
-void journal_log_serial_number (irr_database_t *database);
+int journal_log_serial_number (irr_database_t *database);
+int journal_index_find (irr_database_t *database, int journal_ext,
+			uint32_t serial, off_t *offset);
+void journal_index_reset (irr_database_t *database);
 void journal_irr_update (irr_database_t *db, irr_object_t *object,
                          int mode, int skip_obj);
 int find_oldest_serial (char *dbname, int journal_ext, uint32_t *oldestserial);
@@ -143,12 +174,19 @@ void nice_time (long seconds, char *buf);
 long copy_irr_object ( irr_database_t *database, irr_object_t *object);
 void irr_unlock_all (irr_connection_t *irr);
 void irr_lock_all (irr_connection_t *irr);
+int irr_roa_read_lock (irr_connection_t *irr);
 void irr_update_unlock (irr_database_t *database);
 void irr_update_lock (irr_database_t *database);
 void irr_clean_unlock (irr_database_t *database);
 void irr_clean_lock (irr_database_t *database);
 void irr_unlock (irr_database_t *database);
 void irr_lock (irr_database_t *database);
+void irr_read_unlock (irr_database_t *database);
+void irr_read_lock (irr_database_t *database);
+void irr_db_map (irr_database_t *database);
+void irr_db_unmap (irr_database_t *database);
+int irr_db_read (irr_database_t *database, u_long offset, void *buf, int len);
+char *irr_db_gets (char *buf, int size, irr_database_t *database, u_long *offset);
 irr_database_t *find_database (char *name);
 irr_database_t *new_database (char *name);
 irr_object_t *New_IRR_Object (char *buffer, u_long position, u_long mode);
@@ -158,6 +196,7 @@ void lookup_object_references (irr_connection_t *irr);
 void lookup_prefix_exact (irr_connection_t *irr, char *key, enum IRR_OBJECTS type);
 int convert_to_32 (char *strval, uint32_t *uval);
 irr_hash_string_t *new_irr_hash_string (char *str);
+irr_hash_string_t *new_irr_hash_string_len (char *str, int len);
 void delete_irr_hash_string (irr_hash_string_t *str);
 int parse_ripe_flags (irr_connection_t *irr, char **cp);
 int ripe_set_source (irr_connection_t *irr, char **cp);
@@ -188,6 +227,7 @@ void *scan_irr_file_main (FILE *fp, irr_database_t *database,
 int write_irr_serial (irr_database_t *database);
 void write_irr_serial_export (uint32_t serial, irr_database_t *database);
 int scan_irr_serial (irr_database_t *database);
+int populate_keyhash (irr_database_t *database);
 int get_state (char *buf, u_long len, enum STATES state, enum STATES *p_save_state);
 int pick_off_mirror_hdr (FILE *fp, char *buf, int buf_size, 
                          enum STATES state, enum STATES *p_save_state,
@@ -199,6 +239,70 @@ int get_roamaxlen (char *buf, int *maxlen);
 /* RPSL */
 void irr_set_expand(irr_connection_t *irr, char *name);
 void irr_set_expand6(irr_connection_t *irr, char *name);
+void irr_set_aggregate(irr_connection_t *irr, char *name);
+
+/* member_set */
+irr_member_set_t *irr_member_set_new ();
+void irr_member_set_destroy (irr_member_set_t *set);
+void irr_member_set_add_prefix (irr_member_set_t *set,
+				irr_member_prefix_t *p);
+void irr_member_set_add_name (irr_member_set_t *set, char *name);
+int irr_member_prefix_parse (char *text, int len, irr_member_prefix_t *p);
+int irr_member_prefix_toa (irr_member_prefix_t *p, char *buf);
+irr_expansion_t *irr_member_set_freeze (irr_member_set_t *set,
+					GHashTable *deps);
+void irr_expansion_free (irr_expansion_t *e);
+char *irr_expansion_answer (irr_expansion_t *e, u_int *len);
+char *irr_expansion_aggregate (irr_expansion_t **e, int n, u_short family,
+			       u_int *len);
+
+/* task pool */
+void irr_task_pool_init ();
+void irr_task_submit (irr_task_t *task);
+void irr_task_wait (irr_task_t *task);
+
+/* !ps...!pe query batches */
+void irr_batch_start (irr_connection_t *irr);
+void irr_batch_add (irr_connection_t *irr, char *query);
+void irr_batch_run (irr_connection_t *irr);
+
+/* !i expansion cache */
+void irr_expand_cache_init ();
+irr_expansion_t *irr_expand_cache_lookup (char *key);
+u_long irr_expand_cache_epoch ();
+void irr_expand_cache_store (char *key, irr_expansion_t *e, u_long epoch);
+void irr_expansion_hold (irr_expansion_t *e);
+void irr_expansion_release (irr_expansion_t *e);
+void irr_expansion_send (irr_connection_t *irr, irr_expansion_t *e);
+void irr_expand_cache_invalidate (char *key);
+void irr_expand_cache_flush ();
+
+/* mirror response cache */
+int dump_serial_updates (irr_connection_t *irr, irr_database_t *database,
+			 int journal_ext, uint32_t protocol_num,
+			 uint32_t from, uint32_t to);
+void irr_mirror_cache_init ();
+irr_shared_block_t *irr_mirror_response (irr_connection_t *irr,
+				   irr_database_t *database,
+				   uint32_t protocol_num, uint32_t from,
+				   uint32_t to, uint32_t first_in_new,
+				   int old_journal_exists);
+void irr_mirror_cache_flush ();
+void show_mirror_cache (uii_connection_t *uii);
+void show_expand_cache (uii_connection_t *uii);
+
+/* key_index */
+irr_key_index_t *irr_key_index_new (u_int nkeys);
+void irr_key_index_destroy (irr_key_index_t *index);
+void irr_key_index_reserve (irr_key_index_t *index, u_int nkeys);
+irr_key_entry_t *irr_key_index_lookup (irr_key_index_t *index, char *key,
+				       u_int *count);
+int irr_key_index_add (irr_key_index_t *index, char *key, u_char type,
+		       u_char p_or_s, u_long offset, u_long len);
+int irr_key_index_remove (irr_key_index_t *index, char *key, u_long offset);
+char *irr_key_index_next (irr_key_index_t *index, u_int *pos,
+			  irr_key_entry_t **entries, u_int *count);
+u_long irr_key_index_bytes (irr_key_index_t *index);
 
 /* indicies */
 int irr_database_find_matches (irr_connection_t *irr, char *key, 
@@ -216,17 +320,30 @@ void make_gas_key (char *gas_key, char *origin);
 void make_setobj_key (char *new_key, char *obj_name);
 void irr_hash_destroy (hash_item_t *hash_item);
 void store_hash_spec (irr_database_t *database, hash_spec_t *hash_item);
+void remove_hash_spec (irr_database_t *db, char *key);
 hash_spec_t *fetch_hash_spec (irr_database_t *database, char *key,
                               enum FETCH_T mode); 
+char *fetch_gas_answer (irr_database_t *database, char *key, u_int *len);
 int find_object_offset_len (irr_database_t *db, char *key,
 			enum IRR_OBJECTS type, u_long *offset, u_long *len);
 void Delete_hash_spec (hash_spec_t *hash_item); 
 void commit_spec_hash (irr_database_t *db);
+u_int hash_spec_value_len (char *value);
+int irr_spec_hash_store (irr_database_t *database, char *key, char *value);
 int memory_hash_spec_remove (irr_database_t *db, char *key, enum SPEC_KEYS id,
 				irr_object_t *object); 
 int memory_hash_spec_store (irr_database_t *db, char *key, enum SPEC_KEYS id,
 				irr_object_t *object);
 
+/* !gas/!6as answer cache */
+void irr_gas_cache_init ();
+int irr_gas_cache_send (irr_connection_t *irr, char *key);
+void irr_gas_cache_store (irr_connection_t *irr, char *key,
+			  char *answer, u_int len);
+void irr_gas_cache_invalidate (char *key);
+void irr_gas_cache_flush ();
+void show_gas_cache (uii_connection_t *uii);
+
 /* routines handle prefixes */
 void add_irr_prefix (irr_database_t *database, prefix_t *prefix, irr_object_t *object);
 int delete_irr_prefix (irr_database_t *database, prefix_t *prefix, irr_object_t *object);
@@ -234,6 +351,8 @@ int seek_prefix_object (irr_database_t *database, enum IRR_OBJECTS type, char *k
 		       uint32_t origin, u_long *offset, u_long *len);
 radix_node_t *prefix_search_exact (irr_database_t *database, prefix_t *prefix);
 radix_node_t *prefix_search_best (irr_database_t *database, prefix_t *prefix);
+enum OBJ_ROASTATUS irr_roa_validate (prefix_t *prefix, uint32_t origin,
+				     irr_prefix_object_t **roa);
 
 /* other */
 void convert_toupper(char *p);
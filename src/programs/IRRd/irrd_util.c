@@ -3,8 +3,13 @@
  * originally Id: util.c,v 1.51 1998/08/07 19:48:58 gerald Exp 
  */
 
+#if defined (__linux__) && !defined (_GNU_SOURCE)
+#define _GNU_SOURCE	/* pthread_rwlockattr_setkind_np () */
+#endif
+
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <stdio.h>
@@ -24,6 +29,24 @@
 
 static int find_token (char **, char **);
 
+/* irr_rwlock_init
+ * Database locks prefer writers: with a steady stream of queries the
+ * default (reader preferring) lock would hold off updates and mirroring
+ * for good.  The price is that a thread may not read lock a database it
+ * already has read locked, see irr_roa_read_lock ().
+ */
+static void irr_rwlock_init (pthread_rwlock_t *rwlock) {
+  pthread_rwlockattr_t attr;
+
+  pthread_rwlockattr_init (&attr);
+#ifdef __GLIBC__
+  pthread_rwlockattr_setkind_np (&attr,
+				 PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#endif
+  pthread_rwlock_init (rwlock, &attr);
+  pthread_rwlockattr_destroy (&attr);
+}
+
 irr_database_t *new_database (char *name) {
   irr_database_t *database;
 
@@ -32,7 +55,7 @@ irr_database_t *new_database (char *name) {
 
   database->radix_v4 = New_Radix (32); 
   database->radix_v6 = New_Radix (128);
-  database->hash = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, (GDestroyNotify)irr_hash_destroy);
+  database->key_index = irr_key_index_new (0);
   database->hash_spec = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, (GDestroyNotify)irr_hash_destroy);
 
   database->name = strdup (name);
@@ -40,9 +63,10 @@ irr_database_t *new_database (char *name) {
   database->mirror_fd  = -1;
   database->journal_fd = -1;
   database->max_journal_bytes = IRR_MAX_JOURNAL_SIZE;
-  pthread_mutex_init (&database->mutex_lock, NULL);
+  database->mirror_batch = MIRROR_BATCH;
+  irr_rwlock_init (&database->rwlock);
   pthread_mutex_init (&database->mutex_clean_lock, NULL);
-  /*rwl_init (&database->rwlock);*/
+  pthread_mutex_init (&database->mutex_journal_index, NULL);
   return(database);
 }
 
@@ -65,19 +89,41 @@ irr_database_t *find_database (char *name) {
   return (NULL);
 }
 
+/* irr_roa_read_lock
+ * Read lock the ROA database for a query of (irr), unless it is one of
+ * the connection's sources and so locked already by irr_lock_all ()
+ * (perhaps by the batch).  Taking a second read lock would wait behind
+ * any queued writer, which in turn waits for the first: a deadlock.
+ * Returns 1 if the lock was taken, to be released with irr_read_unlock ().
+ */
+int irr_roa_read_lock (irr_connection_t *irr) {
+  irr_database_t *database;
+
+  LL_Iterate (irr->ll_database, database) {
+    if (database == IRR.roa_database)
+      return (0);
+  }
+  irr_read_lock (IRR.roa_database);
+  return (1);
+}
+
 /* irr_lock_all
- * Lock down all IRR databases used by this IRR connection
+ * Lock down all IRR databases used by this IRR connection.  The queries
+ * of a batch run under the locks the batch took (see batch.c).
  */
 void irr_lock_all (irr_connection_t *irr) {
   irr_database_t *database;
 
+  if (irr->batch_locked)
+    return;
+
   /* Avoid deadlock, only 1 routine can get all locks at one time */
   if (pthread_mutex_lock (&IRR.lock_all_mutex_lock) != 0)
     trace (ERROR, default_trace, "Error locking --lock_all_mutex_lock--: %s\n", 
 	   strerror (errno));
 
   LL_ContIterate (irr->ll_database, database) {
-    irr_lock (database);
+    irr_read_lock (database);
   }
 
   if (pthread_mutex_unlock (&IRR.lock_all_mutex_lock) != 0)
@@ -92,8 +138,11 @@ void irr_lock_all (irr_connection_t *irr) {
 void irr_unlock_all (irr_connection_t *irr) {
   irr_database_t *database;
 
+  if (irr->batch_locked)
+    return;
+
   LL_ContIterate (irr->ll_database, database) {
-    irr_unlock (database);
+    irr_read_unlock (database);
   }
 }
 
@@ -119,18 +168,169 @@ void irr_clean_unlock (irr_database_t *database) {
 	   database->name, strerror (errno));
 }
 
+/* irr_lock
+ * Exclusive (writer) lock on a database, taken by the update, reload
+ * and clean paths.  Queries use irr_read_lock() and may run in parallel.
+ */
 void irr_lock (irr_database_t *database) {
-  /*if (rwl_writelock (&database->rwlock) != 0)*/
-  if (pthread_mutex_lock (&database->mutex_lock) != 0)
+  int ret;
+
+  if ((ret = pthread_rwlock_trywrlock (&database->rwlock)) == EBUSY) {
+    g_atomic_int_inc (&database->write_locks_contended);
+    ret = pthread_rwlock_wrlock (&database->rwlock);
+  }
+  if (ret != 0)
     trace (ERROR, default_trace, "Error locking database %s : %s\n", 
-	   database->name, strerror (errno));
+	   database->name, strerror (ret));
+  g_atomic_int_inc (&database->write_locks);
 }
 
 void irr_unlock (irr_database_t *database) {
-  if (pthread_mutex_unlock (&database->mutex_lock) != 0)
-  /*if (rwl_writeunlock (&database->rwlock) != 0) */
+  int ret;
+
+  /* pick up anything appended while we held the db exclusively */
+  irr_db_map (database);
+
+  if ((ret = pthread_rwlock_unlock (&database->rwlock)) != 0)
     trace (ERROR, default_trace, "Error unlocking database %s : %s\n", 
+	   database->name, strerror (ret));
+}
+
+/* irr_read_lock
+ * Shared (reader) lock on a database for queries
+ */
+void irr_read_lock (irr_database_t *database) {
+  int ret;
+
+  if ((ret = pthread_rwlock_tryrdlock (&database->rwlock)) == EBUSY) {
+    g_atomic_int_inc (&database->read_locks_contended);
+    ret = pthread_rwlock_rdlock (&database->rwlock);
+  }
+  if (ret != 0)
+    trace (ERROR, default_trace, "Error read locking database %s : %s\n", 
+	   database->name, strerror (ret));
+  g_atomic_int_inc (&database->read_locks);
+}
+
+void irr_read_unlock (irr_database_t *database) {
+  int ret;
+
+  if ((ret = pthread_rwlock_unlock (&database->rwlock)) != 0)
+    trace (ERROR, default_trace, "Error read unlocking database %s : %s\n", 
+	   database->name, strerror (ret));
+}
+
+/* irr_db_map
+ * (Re)map the database file read-only so queries can fetch objects by
+ * (offset, len) without sharing the db_fp file position.  Called with
+ * the writer lock held (or before the db is visible to queries).  If the
+ * file cannot be mapped the readers fall back to pread ().
+ */
+void irr_db_map (irr_database_t *database) {
+  irr_db_map_t *map;
+  struct stat sb;
+
+  if (database->db_fp == NULL) {
+    irr_db_unmap (database);
+    return;
+  }
+
+  fflush (database->db_fp);
+  if (fstat (fileno (database->db_fp), &sb) < 0) {
+    trace (ERROR, default_trace, "irr_db_map (): fstat %s : %s\n",
 	   database->name, strerror (errno));
+    irr_db_unmap (database);
+    return;
+  }
+
+  /* same file, nothing appended */
+  map = database->db_map;
+  if (map != NULL &&
+      map->len == (size_t) sb.st_size &&
+      map->dev == sb.st_dev &&
+      map->ino == sb.st_ino)
+    return;
+
+  irr_db_unmap (database);
+  if (sb.st_size == 0)
+    return;
+
+  map = irrd_malloc(sizeof(irr_db_map_t));
+  map->addr = mmap (NULL, (size_t) sb.st_size, PROT_READ, MAP_SHARED,
+		    fileno (database->db_fp), 0);
+  if (map->addr == MAP_FAILED) {
+    trace (ERROR, default_trace, "irr_db_map (): mmap %s : %s\n",
+	   database->name, strerror (errno));
+    irrd_free(map);
+    return;
+  }
+  map->len = (size_t) sb.st_size;
+  map->dev = sb.st_dev;
+  map->ino = sb.st_ino;
+  database->db_map = map;
+}
+
+/* irr_db_unmap
+ * Drop the database's mapping.  Called with the writer lock held, the
+ * answers only copy from it under the readers' locks.
+ */
+void irr_db_unmap (irr_database_t *database) {
+
+  if (database->db_map != NULL) {
+    munmap (database->db_map->addr, database->db_map->len);
+    irrd_free (database->db_map);
+  }
+  database->db_map = NULL;
+}
+
+/* irr_db_read
+ * Copy (len) bytes of the db file at (offset) into (buf).  Served from the
+ * mapping when it covers the range, else with pread () so the shared
+ * db_fp position is never touched.  Returns the number of bytes copied.
+ */
+int irr_db_read (irr_database_t *database, u_long offset, void *buf, int len) {
+  irr_db_map_t *map = database->db_map;
+  ssize_t n;
+
+  if (map != NULL && offset < map->len) {
+    if ((size_t) len > map->len - offset)
+      len = map->len - offset;
+    memcpy (buf, map->addr + offset, len);
+    return (len);
+  }
+
+  if (database->db_fp == NULL ||
+      (n = pread (fileno (database->db_fp), buf, len, (off_t) offset)) < 0)
+    return (0);
+  return ((int) n);
+}
+
+/* irr_db_gets
+ * fgets () work-alike on the db file.  (offset) is advanced past the
+ * line returned.  From the mapping only the line itself is copied.
+ * Returns NULL at end of file.
+ */
+char *irr_db_gets (char *buf, int size, irr_database_t *database, u_long *offset) {
+  irr_db_map_t *map = database->db_map;
+  char *p;
+  int n = size - 1;
+
+  /* find the end of the line in place */
+  if (map != NULL && *offset < map->len) {
+    if ((size_t) n > map->len - *offset)
+      n = map->len - *offset;
+    if ((p = memchr (map->addr + *offset, '\n', n)) != NULL)
+      n = p - (map->addr + *offset) + 1;
+  }
+
+  if ((n = irr_db_read (database, *offset, buf, n)) <= 0)
+    return (NULL);
+
+  if ((p = memchr (buf, '\n', n)) != NULL)
+    n = p - buf + 1;
+  buf[n] = '\0';
+  *offset += n;
+  return (buf);
 }
 
 /* copy_irr_object
@@ -257,16 +457,17 @@ void pick_off_indirect_references (irr_answer_t *irr_answer, LINKED_LIST **ll) {
   char *cp, buf[BUFSIZE];
   enum STATES state  = BLANK_LINE, save_state;
   int curr_f = NO_FIELD;
+  u_long offset;
     
   if (irr_answer->type == ROUTE || irr_answer->type == ROUTE6 || irr_answer->type == PERSON || irr_answer->type == ROLE)
     return;
 
-  if (irr_answer->len == 0 ||
-      fseek (irr_answer->db->db_fp, irr_answer->offset, SEEK_SET) < 0)
+  if (irr_answer->len == 0)
     return;
 
+  offset = irr_answer->offset;
   do {
-    cp = fgets (buf, BUFSIZE, irr_answer->db->db_fp);
+    cp = irr_db_gets (buf, BUFSIZE, irr_answer->db, &offset);
 
     if ((state = get_state (cp, strlen(buf), state, &save_state)) == START_F) {
       curr_f = get_curr_f (buf);
@@ -402,6 +603,14 @@ irr_hash_string_t *new_irr_hash_string (char *str) {
   return (tmp);
 }
 
+/* a hash string of the (len) bytes at (str), which need not end there */
+irr_hash_string_t *new_irr_hash_string_len (char *str, int len) {
+  irr_hash_string_t *tmp;
+  tmp = irrd_malloc(sizeof(irr_hash_string_t));
+  tmp->string = strndup (str, len);
+  return (tmp);
+}
+
 void delete_irr_hash_string (irr_hash_string_t *str) {
   irrd_free(str->string);
   irrd_free(str);
@@ -590,7 +799,7 @@ int parse_ripe_flags (irr_connection_t *irr, char **cp) {
       case 'K': irr->ripe_flags |= KEYFIELDS_ONLY; break;
       case 'l': irr->ripe_flags |= LESS_ONE;    break;
       case 'L': irr->ripe_flags |= LESS_ALL;    break;
-/*    case 'm': irr->ripe_flags |= MORE_ONE;    break; */ /* unsupported */
+      case 'm': irr->ripe_flags |= MORE_ONE;    break;
       case 'M': irr->ripe_flags |= MORE_ALL;    break;
       case 'x': irr->ripe_flags |= EXACT_MATCH;    break;
      /* special mirror request command, e.g. -g RADB:1:232-LAST */
@@ -677,7 +886,7 @@ void delete_prefix_objs (irr_prefix_object_t *prefix_obj) {
 
 /* radix_flush
  * Delete a radix tree and all referenced prefix objects.
-   Called by database_clear.
+   Called when a database is cleaned, reloaded or deleted.
  */
 void radix_flush (radix_tree_t *radix_tree) {
 
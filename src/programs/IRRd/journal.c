@@ -20,6 +20,12 @@
 #include "irrd.h"
 
 void make_journal_name (char * dbname, int journal_ext, char * journal_name);
+static void journal_index_note (irr_database_t *db, uint32_t serial,
+				off_t offset);
+static void journal_index_rollover (irr_database_t *db);
+
+/* serials between the entries of a journal index */
+#define JOURNAL_INDEX_STEP	1000
 
 /* journal_irr_update
  * Record what we're doing to the database in the <DB>.journal file
@@ -83,16 +89,38 @@ void journal_irr_update (irr_database_t *db, irr_object_t *object,
   return;
 }
 
+/* journal_open
+ * Open the <DB>.JOURNAL file for appending if we have not yet.
+ */
+void journal_open (irr_database_t *database) {
+  char jfile[BUFSIZE];
+
+  if (database->journal_fd >= 0)
+    return;
+
+  make_journal_name (database->name, JOURNAL_NEW, jfile);
+    
+  if ((database->journal_fd = open (jfile, O_RDWR | O_APPEND| O_CREAT, 0664)) < 0)
+    trace (ERROR, default_trace, "journal_open () Could not open "
+	   "journal file %s: (%s)!\n", jfile, strerror (errno));
+}
+
 /* journal_log_serial_number
  * For crash recovery and when we act as a mirror server,
  * stamp the <DB>.journal file with the current serial 
  * number for the database
  */
-void journal_log_serial_number (irr_database_t *database) {
+int journal_log_serial_number (irr_database_t *database) {
   char buffer[512];
+  off_t offset;
+
+  offset = lseek (database->journal_fd, 0L, SEEK_END);
   sprintf (buffer, "%s SERIAL %u\n", "%", database->serial_number);
-  write (database->journal_fd, buffer, strlen (buffer));
-  return;
+  if (write (database->journal_fd, buffer, strlen (buffer)) < 0)
+    return (-1);
+  if (offset >= 0)
+    journal_index_note (database, database->serial_number, offset);
+  return (1);
 }
 
 
@@ -125,6 +153,7 @@ void journal_maybe_rollover (irr_database_t *database) {
 
     close (database->journal_fd);
     rename(file_new, file_old);
+    journal_index_rollover (database);
 
     if ((database->journal_fd = open (file_new, O_RDWR | O_CREAT, 0664)) < 0) 
       trace (NORM, default_trace, "**** ERROR **** Could not open %s (%s)!\n", 
@@ -271,3 +300,242 @@ FAIL:
 
   return (0);
 }
+
+/* The journal indexes.
+ *
+ * A mirror request for serials "from-to" used to read the journal from
+ * the top to find "from".  Each journal file now has a sparse index, an
+ * entry for every JOURNAL_INDEX_STEP serials giving the offset of the
+ * "% SERIAL" line, so dump_serial_updates () can seek close to "from"
+ * and read on from there.  The index of <db>.JOURNAL is kept in
+ * <db>.JOURNAL.idx as "serial offset" lines, appended to as serials are
+ * logged, and moves to <db>.JOURNAL.1.idx when the journal is rolled
+ * over.  A missing index file is rebuilt from its journal the first
+ * time it is needed.
+ *
+ * An entry is only a hint: dump_serial_updates () checks the line at
+ * the offset and reads from the top if it does not match, so an index
+ * left behind by eg a rollback does no harm.
+ */
+
+static void journal_index_name (char *dbname, int journal_ext, char *name) {
+
+  make_journal_name (dbname, journal_ext, name);
+  strcat (name, ".idx");
+}
+
+static void journal_index_free (irr_journal_index_t *idx) {
+
+  if (idx->serial != NULL)
+    irrd_free (idx->serial);
+  if (idx->offset != NULL)
+    irrd_free (idx->offset);
+  memset (idx, 0, sizeof (irr_journal_index_t));
+}
+
+/* journal_index_add
+ * Append (serial) at (offset) to (idx).  Out of memory we drop the
+ * index, readers then go through the journal from the top.
+ * Returns 1 on success, -1 if the index was dropped.
+ */
+static int journal_index_add (irr_journal_index_t *idx, uint32_t serial,
+			      off_t offset) {
+  uint32_t *serials;
+  off_t *offsets;
+  u_int size;
+
+  if (idx->n == idx->size) {
+    size = idx->size ? 2 * idx->size : 64;
+    serials = irrd_malloc (size * sizeof (uint32_t));
+    offsets = irrd_malloc (size * sizeof (off_t));
+    if (serials == NULL || offsets == NULL) {
+      trace (ERROR, default_trace, "journal_index_add: out of memory, "
+	     "dropping the journal index\n");
+      if (serials != NULL)
+	irrd_free (serials);
+      if (offsets != NULL)
+	irrd_free (offsets);
+      journal_index_free (idx);
+      /* don't try to load it again */
+      idx->loaded = 1;
+      return (-1);
+    }
+    if (idx->n > 0) {
+      memcpy (serials, idx->serial, idx->n * sizeof (uint32_t));
+      memcpy (offsets, idx->offset, idx->n * sizeof (off_t));
+    }
+    if (idx->serial != NULL)
+      irrd_free (idx->serial);
+    if (idx->offset != NULL)
+      irrd_free (idx->offset);
+    idx->serial = serials;
+    idx->offset = offsets;
+    idx->size = size;
+  }
+  idx->serial[idx->n] = serial;
+  idx->offset[idx->n] = offset;
+  idx->n++;
+  return (1);
+}
+
+/* does (idx) want an entry for (serial)? */
+static int journal_index_wants (irr_journal_index_t *idx, uint32_t serial) {
+
+  return (idx->n == 0 ||
+	  serial >= idx->serial[idx->n - 1] + JOURNAL_INDEX_STEP);
+}
+
+/* journal_index_build
+ * Index journal file (journal_ext) of (db) from scratch, and save the
+ * index for next time.  Caller holds the index lock.
+ */
+static void journal_index_build (irr_database_t *db, int journal_ext) {
+  irr_journal_index_t *idx = &db->journal_index[journal_ext];
+  char file[BUFSIZE], buf[BUFSIZE];
+  uint32_t serial;
+  off_t offset;
+  FILE *fp;
+  u_int i;
+
+  make_journal_name (db->name, journal_ext, file);
+  if ((fp = fopen (file, "r")) == NULL)
+    return;
+
+  for (offset = 0; fgets (buf, BUFSIZE, fp) != NULL; offset = ftello (fp)) {
+    if (!strncmp (buf, "% SERIAL", 8) &&
+	convert_to_32 (buf + 9, &serial) > 0 &&
+	journal_index_wants (idx, serial) &&
+	journal_index_add (idx, serial, offset) < 0) {
+      fclose (fp);
+      return;
+    }
+  }
+  fclose (fp);
+
+  journal_index_name (db->name, journal_ext, file);
+  if ((fp = fopen (file, "w")) == NULL)
+    return;
+  for (i = 0; i < idx->n; i++)
+    fprintf (fp, "%u %lld\n", idx->serial[i], (long long) idx->offset[i]);
+  fclose (fp);
+}
+
+/* journal_index_load
+ * Read the index of journal file (journal_ext) of (db) if we have not
+ * yet.  Caller holds the index lock.
+ */
+static void journal_index_load (irr_database_t *db, int journal_ext) {
+  irr_journal_index_t *idx = &db->journal_index[journal_ext];
+  char file[BUFSIZE];
+  uint32_t serial;
+  long long offset;
+  FILE *fp;
+
+  if (idx->loaded)
+    return;
+  idx->loaded = 1;
+
+  journal_index_name (db->name, journal_ext, file);
+  if ((fp = fopen (file, "r")) == NULL) {
+    journal_index_build (db, journal_ext);
+    return;
+  }
+  while (fscanf (fp, "%u %lld\n", &serial, &offset) == 2)
+    if (journal_index_add (idx, serial, (off_t) offset) < 0)
+      break;
+  fclose (fp);
+}
+
+/* journal_index_note
+ * (serial) was just logged at (offset) of the journal
+ */
+static void journal_index_note (irr_database_t *db, uint32_t serial,
+				off_t offset) {
+  irr_journal_index_t *idx = &db->journal_index[JOURNAL_NEW];
+  char file[BUFSIZE];
+  FILE *fp;
+
+  pthread_mutex_lock (&db->mutex_journal_index);
+  journal_index_load (db, JOURNAL_NEW);
+  if (journal_index_wants (idx, serial) &&
+      journal_index_add (idx, serial, offset) > 0) {
+    journal_index_name (db->name, JOURNAL_NEW, file);
+    if ((fp = fopen (file, "a")) != NULL) {
+      fprintf (fp, "%u %lld\n", serial, (long long) offset);
+      fclose (fp);
+    }
+  }
+  pthread_mutex_unlock (&db->mutex_journal_index);
+}
+
+/* the journal of (db) was just rolled over, the index goes with it */
+static void journal_index_rollover (irr_database_t *db) {
+  char file_old[BUFSIZE], file_new[BUFSIZE];
+
+  pthread_mutex_lock (&db->mutex_journal_index);
+  journal_index_name (db->name, JOURNAL_NEW, file_new);
+  journal_index_name (db->name, JOURNAL_OLD, file_old);
+  if (rename (file_new, file_old) < 0)
+    unlink (file_old);
+
+  journal_index_free (&db->journal_index[JOURNAL_OLD]);
+  db->journal_index[JOURNAL_OLD] = db->journal_index[JOURNAL_NEW];
+  memset (&db->journal_index[JOURNAL_NEW], 0, sizeof (irr_journal_index_t));
+  /* the new journal is empty */
+  db->journal_index[JOURNAL_NEW].loaded = 1;
+  pthread_mutex_unlock (&db->mutex_journal_index);
+}
+
+/* journal_index_reset
+ * Forget the journal indexes of (db), eg once its journals are removed
+ * or truncated.  They are rebuilt when next needed.  The cached mirror
+ * responses may be out of date too.
+ */
+void journal_index_reset (irr_database_t *db) {
+  char file[BUFSIZE];
+  int i;
+
+  pthread_mutex_lock (&db->mutex_journal_index);
+  for (i = JOURNAL_NEW; i <= JOURNAL_OLD; i++) {
+    journal_index_free (&db->journal_index[i]);
+    journal_index_name (db->name, i, file);
+    unlink (file);
+  }
+  pthread_mutex_unlock (&db->mutex_journal_index);
+  irr_mirror_cache_flush ();
+}
+
+/* journal_index_find
+ * Look up where to start reading journal file (journal_ext) of (db) for
+ * (serial).
+ *
+ * Return:
+ *  1 and the offset of a "% SERIAL" line at or before (serial) in
+ *    (*offset), 0 if we have none
+ */
+int journal_index_find (irr_database_t *db, int journal_ext,
+			uint32_t serial, off_t *offset) {
+  irr_journal_index_t *idx = &db->journal_index[journal_ext];
+  u_int lo, hi, mid;
+  int found = 0;
+
+  pthread_mutex_lock (&db->mutex_journal_index);
+  journal_index_load (db, journal_ext);
+
+  /* the last entry at or before (serial) */
+  lo = 0;
+  hi = idx->n;
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (idx->serial[mid] <= serial)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  if (lo > 0) {
+    *offset = idx->offset[lo - 1];
+    found = 1;
+  }
+  pthread_mutex_unlock (&db->mutex_journal_index);
+  return (found);
+}
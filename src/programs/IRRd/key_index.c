@@ -0,0 +1,330 @@
+/* A compact index from object keys (primary and secondary) to the
+ * objects that carry them, replacing a GHashTable of hash_item_t's.
+ *
+ * The table is open addressed with linear probing.  Key strings are
+ * interned in a chunked arena rather than strdup'd one by one, and the
+ * (type, p_or_s, offset, len) records for a key sit in one contiguous
+ * array.  Most keys reference a single object, so the first record is
+ * kept inline in the slot and an array is only allocated for the second.
+ *
+ * Arena space of a removed key is not reused; it is counted in
+ * dead_bytes and given back when the next dbclean or reload builds a
+ * fresh index.  All callers hold the database lock.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <glib.h>
+
+#include "mrt.h"
+#include "trace.h"
+#include "config_file.h"
+#include "irrd.h"
+
+#define KEY_INDEX_MIN_SLOTS	1024
+#define KEY_ARENA_CHUNK		(64*1024)
+
+/* a removed key; probing continues past it */
+static char key_tombstone[1];
+
+#define SLOT_EMPTY(s)	((s)->key == NULL)
+#define SLOT_DEAD(s)	((s)->key == key_tombstone)
+#define SLOT_ENTRIES(s)	(((s)->size > 1) ? (s)->e.many : &(s)->e.one)
+
+/* 32 bit FNV-1a */
+static u_int key_hash (char *key) {
+  u_int h = 2166136261U;
+
+  while (*key) {
+    h ^= (u_char) *key++;
+    h *= 16777619U;
+  }
+  return (h);
+}
+
+static char *key_intern (irr_key_index_t *index, char *key) {
+  irr_key_arena_t *chunk = index->arena;
+  u_int len = strlen (key) + 1;
+  u_int size;
+  char *p;
+
+  if (chunk == NULL || chunk->size - chunk->used < len) {
+    size = (len > KEY_ARENA_CHUNK) ? len : KEY_ARENA_CHUNK;
+    if ((chunk = irrd_malloc (sizeof (irr_key_arena_t) + size)) == NULL)
+      return (NULL);
+    chunk->size = size;
+    chunk->next = index->arena;
+    index->arena = chunk;
+    index->arena_bytes += sizeof (irr_key_arena_t) + size;
+  }
+
+  p = (char *) (chunk + 1) + chunk->used;
+  memcpy (p, key, len);
+  chunk->used += len;
+  return (p);
+}
+
+/* key_find
+ * Return the slot holding (key), or NULL.  If (insert) is non-NULL it is
+ * set to the slot (key) should go into: the first tombstone on its probe
+ * path, else the empty slot that ended it.
+ */
+static irr_key_slot_t *key_find (irr_key_index_t *index, char *key, u_int h,
+				 irr_key_slot_t **insert) {
+  irr_key_slot_t *s, *dead = NULL;
+  u_int i;
+
+  for (i = h & index->mask; ; i = (i + 1) & index->mask) {
+    s = &index->slots[i];
+    if (SLOT_EMPTY (s))
+      break;
+    if (SLOT_DEAD (s)) {
+      if (dead == NULL)
+	dead = s;
+      continue;
+    }
+    if (s->hash == h && !strcmp (s->key, key))
+      return (s);
+  }
+
+  if (insert != NULL)
+    *insert = (dead != NULL) ? dead : s;
+  return (NULL);
+}
+
+/* key_rehash
+ * Move every live key into a table of (nslots) slots, a power of two.
+ * Tombstones are dropped along the way.
+ */
+static int key_rehash (irr_key_index_t *index, u_int nslots) {
+  irr_key_slot_t *old = index->slots, *s, *t;
+  u_int i, j, old_n = index->mask + 1;
+
+  if ((index->slots = irrd_malloc (nslots * sizeof (irr_key_slot_t))) == NULL) {
+    index->slots = old;
+    trace (ERROR, default_trace, "key_rehash (): out of memory for %u slots\n",
+	   nslots);
+    return (-1);
+  }
+  index->mask = nslots - 1;
+  index->tombstones = 0;
+
+  for (i = 0; i < old_n; i++) {
+    s = &old[i];
+    if (SLOT_EMPTY (s) || SLOT_DEAD (s))
+      continue;
+    for (j = s->hash & index->mask; !SLOT_EMPTY (&index->slots[j]);
+	 j = (j + 1) & index->mask);
+    t = &index->slots[j];
+    *t = *s;
+  }
+
+  irrd_free (old);
+  return (1);
+}
+
+/* smallest power of two number of slots that keeps (nkeys) under 70% */
+static u_int key_slots_for (u_int nkeys) {
+  u_int n = KEY_INDEX_MIN_SLOTS;
+
+  while (n < nkeys + nkeys / 2 + nkeys / 8)
+    n <<= 1;
+  return (n);
+}
+
+irr_key_index_t *irr_key_index_new (u_int nkeys) {
+  irr_key_index_t *index;
+  u_int n = key_slots_for (nkeys);
+
+  if ((index = irrd_malloc (sizeof (irr_key_index_t))) == NULL)
+    return (NULL);
+  if ((index->slots = irrd_malloc (n * sizeof (irr_key_slot_t))) == NULL) {
+    irrd_free (index);
+    return (NULL);
+  }
+  index->mask = n - 1;
+  return (index);
+}
+
+void irr_key_index_destroy (irr_key_index_t *index) {
+  irr_key_arena_t *chunk, *next;
+  irr_key_slot_t *s;
+  u_int i;
+
+  if (index == NULL)
+    return;
+
+  for (i = 0; i <= index->mask; i++) {
+    s = &index->slots[i];
+    if (!SLOT_EMPTY (s) && !SLOT_DEAD (s) && s->size > 1)
+      irrd_free (s->e.many);
+  }
+  for (chunk = index->arena; chunk != NULL; chunk = next) {
+    next = chunk->next;
+    irrd_free (chunk);
+  }
+  irrd_free (index->slots);
+  irrd_free (index);
+}
+
+/* irr_key_index_reserve
+ * Size the table for (nkeys) keys up front so a bulk load does not
+ * rehash its way up from the minimum.
+ */
+void irr_key_index_reserve (irr_key_index_t *index, u_int nkeys) {
+  u_int n = key_slots_for (index->keys > nkeys ? index->keys : nkeys);
+
+  if (n > index->mask + 1)
+    key_rehash (index, n);
+}
+
+/* irr_key_index_lookup
+ * Return the records for (key) and set (*count), or NULL if the key is
+ * not in the index.  The array is only good while the database lock is
+ * held.
+ */
+irr_key_entry_t *irr_key_index_lookup (irr_key_index_t *index, char *key,
+				       u_int *count) {
+  irr_key_slot_t *s;
+
+  if ((s = key_find (index, key, key_hash (key), NULL)) == NULL) {
+    *count = 0;
+    return (NULL);
+  }
+  *count = s->count;
+  return (SLOT_ENTRIES (s));
+}
+
+/* irr_key_index_add
+ * Append a record for (key).  Return the number of records the key now
+ * has, or -1 if we ran out of memory.
+ */
+int irr_key_index_add (irr_key_index_t *index, char *key, u_char type,
+		       u_char p_or_s, u_long offset, u_long len) {
+  irr_key_slot_t *s, *insert;
+  irr_key_entry_t *e;
+  u_int h = key_hash (key);
+
+  if ((s = key_find (index, key, h, &insert)) == NULL) {
+    /* keep the load, tombstones included, under 70% */
+    if ((index->keys + index->tombstones + 1) * 10 > (index->mask + 1) * 7) {
+      if (key_rehash (index, key_slots_for (index->keys + 1)) < 0)
+	return (-1);
+      key_find (index, key, h, &insert);
+    }
+    if ((key = key_intern (index, key)) == NULL)
+      return (-1);
+    s = insert;
+    if (SLOT_DEAD (s))
+      index->tombstones--;
+    s->key = key;
+    s->hash = h;
+    s->count = 0;
+    s->size = 1;
+    index->keys++;
+  }
+  else if (s->count == s->size) {
+    u_int size = s->size * 2;
+
+    if (s->size == 1) {
+      size = 4;
+      if ((e = irrd_malloc (size * sizeof (irr_key_entry_t))) == NULL)
+	return (-1);
+      e[0] = s->e.one;
+    }
+    else if ((e = realloc (s->e.many, size * sizeof (irr_key_entry_t))) == NULL)
+      return (-1);
+    index->posting_bytes += (size - (s->size > 1 ? s->size : 0)) *
+      sizeof (irr_key_entry_t);
+    s->e.many = e;
+    s->size = size;
+  }
+
+  e = &SLOT_ENTRIES (s)[s->count++];
+  e->type = type;
+  e->p_or_s = p_or_s;
+  e->offset = offset;
+  e->len = len;
+  index->entries++;
+  return (s->count);
+}
+
+/* irr_key_index_remove
+ * Drop the record for the object at (offset) from (key).  The key goes
+ * when its last record does; as before, a key with a single record is
+ * dropped without looking at its offset.
+ *
+ * Return:
+ *  1 if a record was removed
+ *  0 if (key) is not in the index
+ *  -1 if (key) has no record for (offset)
+ */
+int irr_key_index_remove (irr_key_index_t *index, char *key, u_long offset) {
+  irr_key_slot_t *s;
+  irr_key_entry_t *e;
+  u_int i;
+
+  if ((s = key_find (index, key, key_hash (key), NULL)) == NULL)
+    return (0);
+
+  if (s->count > 1) {
+    e = SLOT_ENTRIES (s);
+    for (i = 0; i < s->count && e[i].offset != offset; i++);
+    if (i == s->count)
+      return (-1);
+    memmove (&e[i], &e[i + 1], (s->count - i - 1) * sizeof (irr_key_entry_t));
+    s->count--;
+    index->entries--;
+
+    /* back to a single inline record */
+    if (s->count == 1) {
+      e = s->e.many;
+      s->e.one = e[0];
+      index->posting_bytes -= s->size * sizeof (irr_key_entry_t);
+      s->size = 1;
+      irrd_free (e);
+    }
+    return (1);
+  }
+
+  if (s->size > 1) {
+    index->posting_bytes -= s->size * sizeof (irr_key_entry_t);
+    irrd_free (s->e.many);
+  }
+  index->entries -= s->count;
+  index->dead_bytes += strlen (s->key) + 1;
+  index->keys--;
+  index->tombstones++;
+  s->key = key_tombstone;
+  return (1);
+}
+
+/* irr_key_index_next
+ * Walk the keys in the index: start with (*pos) = 0 and call until NULL
+ * is returned.  The records for each key are returned in (*entries).
+ */
+char *irr_key_index_next (irr_key_index_t *index, u_int *pos,
+			  irr_key_entry_t **entries, u_int *count) {
+  irr_key_slot_t *s;
+
+  while (*pos <= index->mask) {
+    s = &index->slots[(*pos)++];
+    if (SLOT_EMPTY (s) || SLOT_DEAD (s))
+      continue;
+    *entries = SLOT_ENTRIES (s);
+    *count = s->count;
+    return (s->key);
+  }
+  return (NULL);
+}
+
+/* irr_key_index_bytes
+ * Memory held by the index: slots, key arena and record arrays.
+ */
+u_long irr_key_index_bytes (irr_key_index_t *index) {
+
+  return (sizeof (irr_key_index_t) +
+	  (u_long) (index->mask + 1) * sizeof (irr_key_slot_t) +
+	  index->arena_bytes + index->posting_bytes);
+}
@@ -89,6 +89,15 @@ int main (int argc, char *argv[])
      */
     IRR.expansion_timeout = 0;	/* timeout of zero means no timeout */
     IRR.max_connections = MAX_TOTAL_CONNECTIONS; /* default max connections */
+    IRR.worker_threads = IRR_DEFAULT_WORKERS;
+    IRR.load_threads = IRR_DEFAULT_LOAD_THREADS;
+    IRR.scan_threads = IRR_DEFAULT_SCAN_THREADS;
+    IRR.expand_threads = IRR_DEFAULT_EXPAND_THREADS;
+    IRR.gas_cache_size = IRR_DEFAULT_GAS_CACHE * 1024 * 1024;
+    IRR.expand_cache_size = IRR_DEFAULT_EXPAND_CACHE * 1024 * 1024;
+    IRR.answer_buffer_size = IRR_DEFAULT_ANSWER_BUFFER * 1024;
+    IRR.more_specifics_limit = 0;
+    IRR.index_snapshot = 0;
     IRR.mirror_interval = 60*10; /* mirror every ten minutes */
     IRR.irr_port = IRR_DEFAULT_PORT;
     IRR.tmp_dir = IRR_TMP_DIR;
@@ -204,6 +213,11 @@ int main (int argc, char *argv[])
     /* initialize the mutex */
     pthread_mutex_init (&IRR.connections_mutex_lock, NULL);
 
+    irr_gas_cache_init ();
+    irr_expand_cache_init ();
+    irr_mirror_cache_init ();
+    irr_task_pool_init ();
+
     /*
      * read configuration here
      */
@@ -348,6 +362,9 @@ int main (int argc, char *argv[])
       }
     }
 
+    /* serve whois connections from a worker pool if we can */
+    irr_reactor_init ();
+
     /* listen for whois queries */
     if ((IRR.sockfd = listen_telnet (IRR.irr_port)) < 0) {
       fprintf (stderr, 
@@ -473,7 +490,7 @@ void init_irrd_commands (int UNPRIV_FLAG) {
 		      "Save configuration to disk");
     uii_add_command2 (UII_NORMAL, COMMAND_NORM, "reload %s", 
 		      (int (*)()) uii_irr_reload, 
-		      "Reload an IRR database file");
+		      "Reload an IRR database file, or all of them");
 
     uii_add_command2 (UII_NORMAL, COMMAND_NORM, "irrdcacher %s", 
 		      (int (*)()) uii_irr_irrdcacher, 
@@ -632,6 +649,14 @@ void init_irrd_commands (int UNPRIV_FLAG) {
                     (int (*)()) config_irr_database_mirror_protocol,
                     "IRR mirroring protocol");
 
+  uii_add_command2 (UII_CONFIG, COMMAND_NORM, "irr_database %s mirror_batch %d",
+                    (int (*)()) config_irr_database_mirror_batch,
+                    "Mirrored objects applied per database lock");
+
+  uii_add_command2 (UII_CONFIG, COMMAND_NORM, "irr_database %s mirror_keepalive",
+                    (int (*)()) config_irr_database_mirror_keepalive,
+                    "Keep the mirror connection open for new updates");
+
   uii_add_command2 (UII_CONFIG, COMMAND_NORM, "irr_database %s authoritative", 
 		    (int (*)()) config_irr_database_authoritative,
 		    "Allow write updates for IRR database");
@@ -693,6 +718,36 @@ void init_irrd_commands (int UNPRIV_FLAG) {
   uii_add_command2 (UII_CONFIG, COMMAND_NORM, "irr_max_connections %d", 
 		    (int (*)()) config_irr_max_con,
 		    "The maximum number of simultaneous connections");
+  uii_add_command2 (UII_CONFIG, COMMAND_NORM, "irr_worker_threads %d", 
+		    (int (*)()) config_irr_worker_threads,
+		    "The number of threads answering whois queries");
+  uii_add_command2 (UII_CONFIG, COMMAND_NORM, "irr_load_threads %d", 
+		    (int (*)()) config_irr_load_threads,
+		    "The number of databases loaded at once");
+  uii_add_command2 (UII_CONFIG, COMMAND_NORM, "irr_scan_threads %d", 
+		    (int (*)()) config_irr_scan_threads,
+		    "The number of threads parsing a database file");
+  uii_add_command2 (UII_CONFIG, COMMAND_NORM, "irr_expand_threads %d", 
+		    (int (*)()) config_irr_expand_threads,
+		    "The number of threads expanding nested sets");
+  uii_add_command2 (UII_CONFIG, COMMAND_NORM, "irr_gas_cache %d", 
+		    (int (*)()) config_irr_gas_cache,
+		    "Megabytes of !gas answers to cache, 0 to disable");
+  uii_add_command2 (UII_CONFIG, COMMAND_NORM, "irr_expand_cache %d", 
+		    (int (*)()) config_irr_expand_cache,
+		    "Megabytes of !i set expansions to cache, 0 to disable");
+  uii_add_command2 (UII_CONFIG, COMMAND_NORM, "irr_answer_buffer %d", 
+		    (int (*)()) config_irr_answer_buffer,
+		    "Kilobytes of an answer queued before it is streamed, 0 to disable");
+  uii_add_command2 (UII_CONFIG, COMMAND_NORM, "irr_more_specifics_limit %d", 
+		    (int (*)()) config_irr_more_specifics_limit,
+		    "Most objects a more specific search returns, 0 for no limit");
+  uii_add_command2 (UII_CONFIG, COMMAND_NORM, "irr_index_snapshot", 
+		    (int (*)()) config_irr_index_snapshot,
+		    "Keep index snapshots for fast restarts");
+  uii_add_command2 (UII_CONFIG, COMMAND_NORM, "no irr_index_snapshot", 
+		    (int (*)()) no_config_irr_index_snapshot,
+		    "Do not keep index snapshots");
 
   uii_add_command2 (UII_CONFIG, COMMAND_NORM, "no debug server", 
 		    no_config_debug_server, "Turn off server logging");
@@ -0,0 +1,588 @@
+/* The members gathered by a !i set expansion.
+ *
+ * Route-set expansions can run to a million prefixes, so prefixes are
+ * kept as packed (family, address, length, range) records rather than
+ * strings.  Duplicates are dropped on insert through an open addressed
+ * table of indexes into the record array, and the records are only
+ * turned into text once, when the answer is sent.  Anything that is not
+ * a prefix (AS numbers, set names, members we could not parse) is kept
+ * verbatim in a string hash.
+ *
+ * A set belongs to the one connection expanding it, so there is no
+ * locking here.  Once expanded it is frozen into an irr_expansion_t,
+ * which expand_cache.c shares between queries.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <glib.h>
+
+#include "mrt.h"
+#include "trace.h"
+#include "config_file.h"
+#include "irrd.h"
+
+#define MEMBER_SET_MIN_SLOTS	1024
+#define MEMBER_TEXT_CHUNK	(64*1024)
+/* address, "/128" and "^128-128" */
+#define MEMBER_TEXT_MAX		(INET6_ADDRSTRLEN + 16)
+
+#define MEMBER_BIGGEST(p)	(((p)->family == AF_INET) ? 32 : 128)
+
+/* 32 bit FNV-1a over the whole record */
+static u_int member_hash (irr_member_prefix_t *p) {
+  u_char *cp = (u_char *) p;
+  u_int i, h = 2166136261U;
+
+  for (i = 0; i < sizeof (irr_member_prefix_t); i++) {
+    h ^= cp[i];
+    h *= 16777619U;
+  }
+  return (h);
+}
+
+static int member_equal (irr_member_prefix_t *a, irr_member_prefix_t *b) {
+  return (!memcmp (a, b, sizeof (irr_member_prefix_t)));
+}
+
+irr_member_set_t *irr_member_set_new () {
+  irr_member_set_t *set;
+
+  set = irrd_malloc (sizeof (irr_member_set_t));
+  set->size = MEMBER_SET_MIN_SLOTS / 2;
+  set->prefixes = irrd_malloc (set->size * sizeof (irr_member_prefix_t));
+  set->count = 0;
+  set->mask = MEMBER_SET_MIN_SLOTS - 1;
+  set->slots = irrd_malloc (MEMBER_SET_MIN_SLOTS * sizeof (u_int));
+  memset (set->slots, 0, MEMBER_SET_MIN_SLOTS * sizeof (u_int));
+  set->names = g_hash_table_new_full (g_str_hash, g_str_equal, free, NULL);
+  return (set);
+}
+
+void irr_member_set_destroy (irr_member_set_t *set) {
+
+  if (set == NULL)
+    return;
+  g_hash_table_destroy (set->names);
+  irrd_free (set->slots);
+  irrd_free (set->prefixes);
+  irrd_free (set);
+}
+
+/* double the table and the record array, keeping the load under 1/2.
+ * Return -1, with (set) as it was, if we ran out of memory */
+static int member_set_grow (irr_member_set_t *set) {
+  irr_member_prefix_t *prefixes;
+  u_int i, j, mask, size, *slots;
+
+  mask = (set->mask << 1) | 1;
+  size = (mask + 1) / 2;
+  if ((prefixes = realloc (set->prefixes,
+			   size * sizeof (irr_member_prefix_t))) == NULL) {
+    trace (ERROR, default_trace, "member_set_grow (): out of memory for %u "
+	   "prefixes\n", size);
+    return (-1);
+  }
+  /* a bigger array is harmless until set->size says so */
+  set->prefixes = prefixes;
+
+  if ((slots = irrd_malloc ((mask + 1) * sizeof (u_int))) == NULL) {
+    trace (ERROR, default_trace, "member_set_grow (): out of memory for %u "
+	   "slots\n", mask + 1);
+    return (-1);
+  }
+  memset (slots, 0, (mask + 1) * sizeof (u_int));
+  for (i = 0; i < set->count; i++) {
+    j = member_hash (&set->prefixes[i]) & mask;
+    while (slots[j] != 0)
+      j = (j + 1) & mask;
+    slots[j] = i + 1;
+  }
+  irrd_free (set->slots);
+  set->slots = slots;
+  set->mask = mask;
+  set->size = size;
+  return (1);
+}
+
+/* irr_member_set_add_prefix
+ * Add (p) to (set) unless it is there already.  The unused tail of
+ * p->addr must be zero.  If there is no memory for it, set->failed is
+ * set and the expansion must not be used.
+ */
+void irr_member_set_add_prefix (irr_member_set_t *set,
+				irr_member_prefix_t *p) {
+  u_int i;
+
+  if (set->count >= set->size && member_set_grow (set) < 0) {
+    set->failed = 1;
+    return;
+  }
+
+  i = member_hash (p) & set->mask;
+  while (set->slots[i] != 0) {
+    if (member_equal (&set->prefixes[set->slots[i] - 1], p))
+      return;
+    i = (i + 1) & set->mask;
+  }
+  set->prefixes[set->count++] = *p;
+  set->slots[i] = set->count;
+}
+
+void irr_member_set_add_name (irr_member_set_t *set, char *name) {
+
+  if (g_hash_table_lookup (set->names, name) == NULL) {
+    name = strdup (name);
+    g_hash_table_insert (set->names, name, name);
+  }
+}
+
+/* read a decimal of at most three digits from (*cp) */
+static int member_number (char **cp, char *end, u_int *n) {
+  char *p = *cp;
+
+  *n = 0;
+  while (p < end && p - *cp < 3 && *p >= '0' && *p <= '9')
+    *n = *n * 10 + (*p++ - '0');
+  if (p == *cp || (p < end && *p >= '0' && *p <= '9'))
+    return (0);
+  *cp = p;
+  return (1);
+}
+
+/* irr_member_prefix_parse
+ * Parse the (len) characters of (text), a prefix with an optional range
+ * such as "10.0.0.0/8^16-24", into (p).
+ *
+ * Return:
+ *  1 if (text) is a prefix, 0 otherwise
+ */
+int irr_member_prefix_parse (char *text, int len, irr_member_prefix_t *p) {
+  char addr[INET6_ADDRSTRLEN], *cp, *end = text + len;
+  u_int n, lo, hi;
+
+  if ((cp = memchr (text, '/', len)) == NULL || cp - text >= sizeof (addr))
+    return (0);
+  memcpy (addr, text, cp - text);
+  addr[cp - text] = '\0';
+
+  memset (p, 0, sizeof (irr_member_prefix_t));
+  p->family = (strchr (addr, ':') != NULL) ? AF_INET6 : AF_INET;
+  if (inet_pton (p->family, addr, p->addr) != 1)
+    return (0);
+
+  cp++;
+  if (!member_number (&cp, end, &n) || n > MEMBER_BIGGEST (p))
+    return (0);
+  p->bitlen = p->lo = p->hi = n;
+  if (cp == end)
+    return (1);
+
+  if (*cp++ != '^' || cp == end)
+    return (0);
+  if (*cp == '+' || *cp == '-') {
+    p->lo = (*cp == '+') ? n : n + 1;
+    p->hi = MEMBER_BIGGEST (p);
+    return (cp + 1 == end);
+  }
+  if (!member_number (&cp, end, &lo) || lo > 255)
+    return (0);
+  hi = lo;
+  if (cp < end && *cp == '-') {
+    cp++;
+    if (!member_number (&cp, end, &hi) || hi > 255)
+      return (0);
+  }
+  p->lo = lo;
+  p->hi = hi;
+  return (cp == end);
+}
+
+/* irr_member_prefix_toa
+ * Write (p) into (buf), which holds MEMBER_TEXT_MAX characters.  The
+ * range is written in its shortest form.
+ *
+ * Return:
+ *  the length of the text
+ */
+int irr_member_prefix_toa (irr_member_prefix_t *p, char *buf) {
+  u_int biggest = MEMBER_BIGGEST (p);
+  int len;
+
+  inet_ntop (p->family, p->addr, buf, INET6_ADDRSTRLEN);
+  len = strlen (buf);
+  len += sprintf (buf + len, "/%u", p->bitlen);
+
+  if (p->lo == p->bitlen && p->hi == p->bitlen)
+    ;
+  else if (p->lo == p->hi)
+    len += sprintf (buf + len, "^%u", p->lo);
+  else if (p->hi == biggest && p->lo == p->bitlen)
+    len += sprintf (buf + len, "^+");
+  else if (p->hi == biggest && p->lo == p->bitlen + 1)
+    len += sprintf (buf + len, "^-");
+  else
+    len += sprintf (buf + len, "^%u-%u", p->lo, p->hi);
+  return (len);
+}
+
+typedef struct _member_text_t {
+  struct _member_text_t	*next;
+  u_int			used;
+} member_text_t;
+
+static void member_string_count (char *name, char *value, u_long *len) {
+  *len += strlen (name) + 1;
+}
+
+typedef struct _member_copy_t {
+  char			**list;
+  char			*text;
+} member_copy_t;
+
+static void member_string_copy (char *name, char *value, member_copy_t *to) {
+
+  strcpy (to->text, name);
+  *to->list++ = to->text;
+  to->text += strlen (name) + 1;
+}
+
+/* irr_member_set_freeze
+ * Copy the members of (set), and the names of the spec hash entries
+ * they came from (deps, a hash of strings), into an expansion that can
+ * be shared between queries.  The caller holds the one reference.
+ */
+irr_expansion_t *irr_member_set_freeze (irr_member_set_t *set,
+					GHashTable *deps) {
+  irr_expansion_t *e;
+  member_copy_t to;
+  u_long len = 0;
+
+  e = irrd_malloc (sizeof (irr_expansion_t));
+  memset (e, 0, sizeof (irr_expansion_t));
+  e->ref_count = 1;
+  e->incomplete = set->incomplete;
+  e->nprefixes = set->count;
+  e->nnames = g_hash_table_size (set->names);
+  e->ndeps = g_hash_table_size (deps);
+
+  if (e->nprefixes > 0) {
+    e->prefixes = irrd_malloc (e->nprefixes * sizeof (irr_member_prefix_t));
+    memcpy (e->prefixes, set->prefixes,
+	    e->nprefixes * sizeof (irr_member_prefix_t));
+  }
+
+  g_hash_table_foreach (set->names, (GHFunc) member_string_count, &len);
+  g_hash_table_foreach (deps, (GHFunc) member_string_count, &len);
+  e->names = irrd_malloc ((e->nnames + e->ndeps) * sizeof (char *) + len + 1);
+  e->deps = e->names + e->nnames;
+  to.list = e->names;
+  to.text = (char *) (e->names + e->nnames + e->ndeps);
+  g_hash_table_foreach (set->names, (GHFunc) member_string_copy, &to);
+  g_hash_table_foreach (deps, (GHFunc) member_string_copy, &to);
+
+  e->bytes = sizeof (irr_expansion_t) +
+    e->nprefixes * sizeof (irr_member_prefix_t) +
+    (e->nnames + e->ndeps) * sizeof (char *) + len;
+  return (e);
+}
+
+void irr_expansion_free (irr_expansion_t *e) {
+
+  if (e->prefixes != NULL)
+    irrd_free (e->prefixes);
+  irrd_free (e->names);
+  if (e->answer != NULL)
+    irrd_free (e->answer);
+  irrd_free (e);
+}
+
+static int member_strcmp (const void *a, const void *b) {
+  return (strcmp (*(char **) a, *(char **) b));
+}
+
+/* irr_expansion_answer
+ * Build the "A<len>\n...\nC\n" response listing the members of (e),
+ * sorted and separated by spaces.
+ *
+ * Return:
+ *  the response and its length in (*len), or NULL if (e) is empty
+ */
+char *irr_expansion_answer (irr_expansion_t *e, u_int *len) {
+  member_text_t *chunk = NULL, *next;
+  char **list, *text, *answer, *cp;
+  u_int i, n;
+  u_long size = 0;
+
+  if ((n = e->nprefixes + e->nnames) == 0)
+    return (NULL);
+
+  list = irrd_malloc (n * sizeof (char *));
+  memcpy (list, e->names, e->nnames * sizeof (char *));
+
+  /* the text of the prefixes goes into chunks freed at the end */
+  for (i = 0; i < e->nprefixes; i++) {
+    if (chunk == NULL ||
+	chunk->used + MEMBER_TEXT_MAX > MEMBER_TEXT_CHUNK - sizeof (*chunk)) {
+      next = irrd_malloc (MEMBER_TEXT_CHUNK);
+      next->next = chunk;
+      next->used = 0;
+      chunk = next;
+    }
+    text = (char *) (chunk + 1) + chunk->used;
+    chunk->used += irr_member_prefix_toa (&e->prefixes[i], text) + 1;
+    list[e->nnames + i] = text;
+  }
+
+  qsort (list, n, sizeof (char *), member_strcmp);
+  for (i = 0; i < n; i++)
+    size += strlen (list[i]) + 1;
+
+  /* the last separator becomes the terminating newline */
+  answer = irrd_malloc (size + 32);
+  cp = answer + sprintf (answer, "A%lu\n", size);
+  for (i = 0; i < n; i++) {
+    if (i > 0)
+      *cp++ = ' ';
+    strcpy (cp, list[i]);
+    cp += strlen (list[i]);
+  }
+  cp += sprintf (cp, "\nC\n");
+  *len = cp - answer;
+
+  for (; chunk != NULL; chunk = next) {
+    next = chunk->next;
+    irrd_free (chunk);
+  }
+  irrd_free (list);
+  return (answer);
+}
+
+/* bit (i) of the address of (p), counting from the top */
+#define MEMBER_BIT(p, i)	(((p)->addr[(i) >> 3] >> (7 - ((i) & 7))) & 1)
+
+/* order by family, address, length and then range */
+static int member_prefix_cmp (const void *a, const void *b) {
+  irr_member_prefix_t *p = (irr_member_prefix_t *) a;
+  irr_member_prefix_t *q = (irr_member_prefix_t *) b;
+  int n;
+
+  if (p->family != q->family)
+    return (p->family - q->family);
+  if ((n = memcmp (p->addr, q->addr, sizeof (p->addr))) != 0)
+    return (n);
+  if (p->bitlen != q->bitlen)
+    return (p->bitlen - q->bitlen);
+  if (p->lo != q->lo)
+    return (p->lo - q->lo);
+  return (p->hi - q->hi);
+}
+
+/* does the prefix (a) hold the prefix (b)? */
+static int member_prefix_holds (irr_member_prefix_t *a,
+				irr_member_prefix_t *b) {
+  u_int n = a->bitlen;
+
+  if (a->family != b->family || n > b->bitlen ||
+      memcmp (a->addr, b->addr, n >> 3))
+    return (0);
+  return ((n & 7) == 0 ||
+	  ((a->addr[n >> 3] ^ b->addr[n >> 3]) & (0xff << (8 - (n & 7)))) == 0);
+}
+
+/* drop the prefixes of (p), sorted, that another one covers with its
+ * range, and return how many are left */
+static u_int member_drop_covered (irr_member_prefix_t *p, u_int n) {
+  irr_member_prefix_t *stack[130 * 2];
+  u_int i, out = 0;
+  int j, top = -1, covered;
+
+  for (i = 0; i < n; i++) {
+    /* the stack holds the kept prefixes that hold each other */
+    while (top >= 0 && !member_prefix_holds (stack[top], &p[i]))
+      top--;
+    covered = 0;
+    for (j = 0; j <= top && !covered; j++)
+      covered = (stack[j]->lo <= p[i].lo && p[i].hi <= stack[j]->hi);
+    if (covered)
+      continue;
+    p[out] = p[i];
+    if (top < (int) (sizeof (stack) / sizeof (stack[0])) - 1)
+      stack[++top] = &p[out];
+    out++;
+  }
+  return (out);
+}
+
+/* aggregate the (n) prefixes of one family in (p), sorted, and return
+ * how many are left */
+static u_int member_aggregate_family (irr_member_prefix_t *p, u_int n) {
+  irr_member_prefix_t *level, *carry, *out, parent;
+  u_char *taken;
+  u_int len, i, j, k, a, b, nlevel, ncarry = 0, nout = 0;
+
+  if (n == 0)
+    return (0);
+  n = member_drop_covered (p, n);
+  level = irrd_malloc (3 * n * sizeof (irr_member_prefix_t) + n);
+  carry = level + n;
+  out = carry + n;
+  taken = (u_char *) (out + n);
+
+  /* a length at a time, longest first, with the parents merged from the
+   * length below */
+  for (len = MEMBER_BIGGEST (p) + 1; len-- > 0; ) {
+    nlevel = 0;
+    for (i = 0; i < n; i++)
+      if (p[i].bitlen == len)
+	level[nlevel++] = p[i];
+    memcpy (level + nlevel, carry, ncarry * sizeof (irr_member_prefix_t));
+    nlevel += ncarry;
+    ncarry = 0;
+    if (nlevel == 0)
+      continue;
+    qsort (level, nlevel, sizeof (irr_member_prefix_t), member_prefix_cmp);
+
+    /* join the overlapping and adjacent ranges of a prefix */
+    for (i = 0, j = 1; j < nlevel; j++) {
+      if (!memcmp (level[i].addr, level[j].addr, sizeof (level[i].addr)) &&
+	  level[j].lo <= level[i].hi + 1) {
+	if (level[j].hi > level[i].hi)
+	  level[i].hi = level[j].hi;
+      } else
+	level[++i] = level[j];
+    }
+    nlevel = i + 1;
+    memset (taken, 0, nlevel);
+
+    /* the two halves of a prefix with the same range become the prefix
+     * with that range; the halves sort next to each other */
+    for (i = 0; len > 0 && i < nlevel; i = j) {
+      for (j = i + 1; j < nlevel &&
+	     !memcmp (level[i].addr, level[j].addr, sizeof (level[i].addr)); j++)
+	;
+      if (MEMBER_BIT (&level[i], len - 1) || j == nlevel)
+	continue;
+      parent = level[i];
+      parent.bitlen = len - 1;
+      if (!MEMBER_BIT (&level[j], len - 1) ||
+	  !member_prefix_holds (&parent, &level[j]))
+	continue;
+      for (k = j + 1; k < nlevel &&
+	     !memcmp (level[j].addr, level[k].addr, sizeof (level[j].addr)); k++)
+	;
+      /* both halves have their ranges in order */
+      for (a = i, b = j; a < j && b < k; ) {
+	if (level[a].lo < level[b].lo)
+	  a++;
+	else if (level[a].lo > level[b].lo)
+	  b++;
+	else {
+	  if (level[a].hi == level[b].hi) {
+	    taken[a] = taken[b] = 1;
+	    parent.lo = level[a].lo;
+	    parent.hi = level[a].hi;
+	    carry[ncarry++] = parent;
+	  }
+	  a++;
+	  b++;
+	}
+      }
+      j = k;
+    }
+
+    for (i = 0; i < nlevel; i++)
+      if (!taken[i])
+	out[nout++] = level[i];
+  }
+
+  /* a merged prefix can cover what is left of a longer one */
+  qsort (out, nout, sizeof (irr_member_prefix_t), member_prefix_cmp);
+  nout = member_drop_covered (out, nout);
+  memcpy (p, out, nout * sizeof (irr_member_prefix_t));
+  irrd_free (level);
+  return (nout);
+}
+
+/* irr_expansion_aggregate
+ * Build the "A<len>\n...\nC\n" response listing the fewest prefixes with
+ * ranges that match exactly the prefixes of the (n) expansions (e), of
+ * address (family) only unless it is 0.  Members that are not prefixes
+ * are left out.
+ *
+ * Return:
+ *  the response and its length in (*len), or NULL if there is nothing
+ *  to list
+ */
+char *irr_expansion_aggregate (irr_expansion_t **e, int n, u_short family,
+			       u_int *len) {
+  irr_member_prefix_t *p, *q;
+  char *answer, *cp, text[MEMBER_TEXT_MAX];
+  u_int biggest, bits, count = 0, v4, i;
+  int j;
+
+  for (j = 0; j < n; j++)
+    count += e[j]->nprefixes;
+  if (count == 0)
+    return (NULL);
+
+  /* keep the prefixes asked for with a sensible range, host bits cleared */
+  p = irrd_malloc (count * sizeof (irr_member_prefix_t));
+  count = 0;
+  for (j = 0; j < n; j++) {
+    for (i = 0; i < e[j]->nprefixes; i++) {
+      q = &p[count];
+      *q = e[j]->prefixes[i];
+      if (family != 0 && q->family != family)
+	continue;
+      biggest = MEMBER_BIGGEST (q);
+      if (q->hi > biggest)
+	q->hi = biggest;
+      if (q->lo < q->bitlen || q->lo > q->hi)
+	continue;
+      bits = q->bitlen;
+      if (bits & 7)
+	q->addr[bits >> 3] &= 0xff << (8 - (bits & 7));
+      for (bits = (bits + 7) >> 3; bits < sizeof (q->addr); bits++)
+	q->addr[bits] = 0;
+      count++;
+    }
+  }
+
+  /* AF_INET sorts first */
+  qsort (p, count, sizeof (irr_member_prefix_t), member_prefix_cmp);
+  for (v4 = 0; v4 < count && p[v4].family == AF_INET; v4++)
+    ;
+  i = member_aggregate_family (p, v4);
+  if (i < v4)
+    memmove (p + i, p + v4, (count - v4) * sizeof (irr_member_prefix_t));
+  count = i + member_aggregate_family (p + i, count - v4);
+
+  if (count == 0) {
+    irrd_free (p);
+    return (NULL);
+  }
+
+  answer = irrd_malloc (count * MEMBER_TEXT_MAX + 32);
+  cp = answer + 32;
+  for (i = 0; i < count; i++) {
+    if (i > 0)
+      *cp++ = ' ';
+    cp += irr_member_prefix_toa (&p[i], cp);
+  }
+  irrd_free (p);
+
+  /* slide the members up behind their "A<len>" */
+  j = sprintf (text, "A%lu\n", (u_long) (cp - answer - 32 + 1));
+  memmove (answer + j, answer + 32, cp - answer - 32);
+  cp -= 32 - j;
+  memcpy (answer, text, j);
+  cp += sprintf (cp, "\nC\n");
+  *len = cp - answer;
+  return (answer);
+}
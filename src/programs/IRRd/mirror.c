@@ -20,11 +20,11 @@
 #include "irrd_prototypes.h"
 
 static int mirror_read_data ();
-int dump_serial_updates (irr_connection_t *irr, irr_database_t *database, int journal_ext, uint32_t protocol_num, uint32_t from, uint32_t to);
+static void mirror_close (irr_database_t *database);
 int valid_start_line (irr_database_t *db, FILE *fp, uint32_t *serial_num);
 
 int request_mirror (irr_database_t *db, uii_connection_t *uii, uint32_t last) {
-  char tmp[BUFSIZE], name[BUFSIZE], logfile[BUFSIZE];
+  char tmp[BUFSIZE], name[BUFSIZE];
   struct timeval	tv;
   fd_set		write_fds;
   int			n, i, ret;
@@ -50,6 +50,11 @@ int request_mirror (irr_database_t *db, uii_connection_t *uii, uint32_t last) {
    * If so, check if we want to time out old attempt 
    */
   if (db->mirror_fd != -1) {
+    /* a kept open connection is fine as long as the updates come in */
+    if ((db->flags & IRR_MIRROR_KEEPALIVE) &&
+	(time (NULL) - db->last_mirrored) < MIRROR_TIMEOUT)
+      return (0);
+
     if ( (time (NULL) - db->mirror_started) < MIRROR_TIMEOUT) {
       trace (ERROR, default_trace, "(%s) already mirroring...!\n",
 	     db->name);
@@ -58,10 +63,7 @@ int request_mirror (irr_database_t *db, uii_connection_t *uii, uint32_t last) {
 
     trace (ERROR, default_trace, "*** TIMING OUT old mirror attempt to %s\n",
 	   db->name);
-    select_delete_fd (db->mirror_fd);
-    fclose (db->mirror_disk_fp);
-    db->mirror_disk_fp = NULL;
-    db->mirror_fd = -1;
+    mirror_close (db);
     strcpy (db->mirror_error_message, "Mirroring timed out...");
     return (-1);
   }
@@ -99,25 +101,15 @@ int request_mirror (irr_database_t *db, uii_connection_t *uii, uint32_t last) {
   strcpy (name, db->name);
   convert_toupper(name);
   if (last == 0)
-    sprintf (tmp, "-g %s:%d:%u-LAST\n", name, db->mirror_protocol, db->serial_number+1);
+    sprintf (tmp, "%s-g %s:%d:%u-LAST\n",
+	     (db->flags & IRR_MIRROR_KEEPALIVE) ? "-k " : "",
+	     name, db->mirror_protocol, db->serial_number+1);
   else
     sprintf (tmp, "-g %s:%d:%u-%u\n", name, db->mirror_protocol, db->serial_number+1, last);
 
   trace (NORM, default_trace, "(%s) Requesting mirror: %s", 
 	 db->name, tmp);
 
-  sprintf (logfile, "%s/.%s.mirror", IRR.database_dir, db->name);
-  trace (NORM, default_trace, "(%s) Saving updates to %s\n", 
-         db->name, logfile);
-  if ((db->mirror_disk_fp = fopen (logfile, "w+")) == NULL) {
-    trace (ERROR, default_trace, "(%s) Error opening %s (%s)\n",
-           db->name, logfile, strerror (errno));
-    close (db->mirror_fd);
-    db->mirror_fd = -1;
-    irrd_free(mirror_prefix);
-    return(0);
-  }
-
   /* JMH - I think this section of code is redundant.  nonblock_connect
      already checks to see if the connection is ready to be written to */
   /* check if mirror server is ready for writing */
@@ -130,7 +122,6 @@ int request_mirror (irr_database_t *db, uii_connection_t *uii, uint32_t last) {
     trace (ERROR, default_trace, "(%s) Error writing request (timeout) to %s (%s):%d\n", 
 	   db->name, db->mirror_host, prefix_toa (mirror_prefix), db->mirror_port);
     close (db->mirror_fd);
-    fclose (db->mirror_disk_fp); /* and delete tmp file??? */
     db->mirror_fd = -1;	   
     irrd_free(mirror_prefix);
     return 0;
@@ -141,7 +132,6 @@ int request_mirror (irr_database_t *db, uii_connection_t *uii, uint32_t last) {
     trace (ERROR, default_trace, "(%s) Error writing request (write failed) to %s (%s):%d\n", 
 	   db->name, db->mirror_host, prefix_toa (mirror_prefix), db->mirror_port);
     close (db->mirror_fd);
-    fclose (db->mirror_disk_fp); /* and delete tmp file??? */
     db->mirror_fd = -1;	   
     irrd_free(mirror_prefix);
     return 0;
@@ -155,6 +145,7 @@ int request_mirror (irr_database_t *db, uii_connection_t *uii, uint32_t last) {
     db->num_objects_notfound[i] = 0;
   }
   db->mirror_update_size = 0;
+  db->mirror_header = 0;
 
   /* save when we started, so we can check for a timeout */
   db->mirror_started = time (NULL);
@@ -165,11 +156,173 @@ int request_mirror (irr_database_t *db, uii_connection_t *uii, uint32_t last) {
   return (1);
 }
 
+/* The mirror stream is parsed as it comes in.  The data read from the
+ * socket is kept in database->mirror_buf until it holds the %START line
+ * and then each complete ADD/DEL record, which is applied to the
+ * database right away; scan_irr_file () reads the records straight from
+ * the buffer.  With mirror_keepalive set the request asks the server
+ * (eg RIPE's NRTM v3) to keep the connection open and send each new
+ * serial as it happens, so the database follows it without polling.
+ */
+
+/* mirror_close
+ * Done with the mirror connection, for good or bad
+ */
+static void mirror_close (irr_database_t *database) {
+
+  select_delete_fd (database->mirror_fd);
+  database->mirror_fd = -1;
+  if (database->mirror_buf != NULL)
+    irrd_free (database->mirror_buf);
+  database->mirror_buf = NULL;
+  database->mirror_buf_len = database->mirror_buf_size = 0;
+}
+
+/* is the complete line (cp) a blank line? */
+static int mirror_blank_line (char *cp) {
+  return (*cp == '\n' || (cp[0] == '\r' && cp[1] == '\n'));
+}
+
+/* mirror_header_ready
+ * Does (buf) hold a complete line for valid_start_line () to decide on,
+ * ie the %START line, an error or warning, or junk?
+ */
+static int mirror_header_ready (char *buf, u_int len) {
+  char *cp, *nl;
+
+  for (cp = buf; (nl = memchr (cp, '\n', len - (cp - buf))) != NULL;
+       cp = nl + 1) {
+    if (mirror_blank_line (cp) || *cp == '#')
+      continue;
+    if (*cp != '%' ||
+	!strncmp (cp, "%START", 6) ||
+	!strncmp (cp, "% ERROR", 7) ||
+	!strncmp (cp, "% Warning", 9))
+      return 1;
+  }
+  return 0;
+}
+
+/* mirror_records_end
+ * Find where the complete records in (buf) end: an ADD or DEL line, a
+ * blank line, then the object up to the next blank line.  Sets (*end) if
+ * the %END line is among them.
+ *
+ * Return:
+ *  the number of bytes of complete records
+ */
+static u_int mirror_records_end (char *buf, u_int len, int *end) {
+  enum { REC_NONE, REC_HDR, REC_OBJ } state = REC_NONE;
+  char *cp, *nl;
+  u_int complete = 0;
+  int lines = 0;
+
+  for (cp = buf; (nl = memchr (cp, '\n', len - (cp - buf))) != NULL;
+       cp = nl + 1) {
+    switch (state) {
+    case REC_NONE:
+      if (!strncmp (cp, "%END", 4)) {
+	*end = 1;
+	return (nl + 1 - buf);
+      }
+      if (mirror_blank_line (cp) || *cp == '%' || *cp == '#')
+	complete = nl + 1 - buf;
+      else
+	state = REC_HDR;
+      break;
+    case REC_HDR:		/* the blank line after ADD or DEL */
+      state = REC_OBJ;
+      lines = 0;
+      break;
+    case REC_OBJ:
+      if (!mirror_blank_line (cp))
+	lines++;
+      else if (lines > 0) {
+	complete = nl + 1 - buf;
+	state = REC_NONE;
+      }
+      break;
+    }
+  }
+  return (complete);
+}
+
+/* mirror_apply
+ * Apply what (database) has read of the mirror stream so far, all of it
+ * if the server is done (eof).
+ *
+ * Return:
+ *  1 to read on, 0 if the mirror is over, -1 on error
+ */
+static int mirror_apply (irr_database_t *database, int eof) {
+  FILE *fp;
+  u_int len;
+  int ret, end = 0;
+  char *p;
+
+  if (!database->mirror_header) {
+    if (!eof && !mirror_header_ready (database->mirror_buf,
+				      database->mirror_buf_len))
+      return (1);
+    if ((fp = fmemopen (database->mirror_buf, database->mirror_buf_len,
+			"r")) == NULL) {
+      trace (ERROR, default_trace, "(%s) fmemopen: %s\n", database->name,
+	     strerror (errno));
+      return (-1);
+    }
+    ret = valid_start_line (database, fp, &database->new_serial_number);
+    len = (u_int) ftell (fp);
+    fclose (fp);
+    if (ret <= 0) {
+      if (ret < 0)
+	trace (ERROR, default_trace, "(%s) Mirroring failed... no valid START line\n", database->name);
+      return (ret);
+    }
+    database->mirror_header = 1;
+    database->mirror_buf_len -= len;
+    memmove (database->mirror_buf, database->mirror_buf + len,
+	     database->mirror_buf_len);
+  }
+
+  if (eof)
+    len = database->mirror_buf_len;
+  else
+    len = mirror_records_end (database->mirror_buf, database->mirror_buf_len,
+			      &end);
+  if (len == 0)
+    return (!eof);
+
+  if ((fp = fmemopen (database->mirror_buf, len, "r")) == NULL) {
+    trace (ERROR, default_trace, "(%s) fmemopen: %s\n", database->name,
+	   strerror (errno));
+    return (-1);
+  }
+  irr_update_lock (database);
+  p = scan_irr_file (database, "mirror", 2, fp);
+  irr_update_unlock (database);
+  fclose (fp);
+
+  if (p != NULL) {
+    trace (ERROR, default_trace, 
+	   "(%s) Mirroring Error: Serial number unchanged: %d\n",
+	   database->name, database->serial_number);
+    return (-1);
+  }
+
+  database->mirror_buf_len -= len;
+  memmove (database->mirror_buf, database->mirror_buf + len,
+	   database->mirror_buf_len);
+  database->mirror_error_message[0] = '\0';
+  database->last_mirrored = time (NULL);
+  trace (TRACE, default_trace, "(%s) Serial number now %d\n",
+	 database->name, database->serial_number);
+  return ((eof || end) ? 0 : 1);
+}
+
 static int mirror_read_data (irr_database_t *database) {
   struct timeval	tv;
   fd_set		read_fds;
-  char			tmp[MIRROR_BUFFER];
-  int			ret, n, valid_start_line_ret;
+  int			ret, n, eof = 0;
 
   tv.tv_sec = 0;
   tv.tv_usec = 0;
@@ -179,72 +332,63 @@ static int mirror_read_data (irr_database_t *database) {
 
   while (1) {
     ret = select (FD_SETSIZE, &read_fds, NULL, NULL, &tv);
-    if (ret <= 0) {
-      select_enable_fd (database->mirror_fd);
-      return 0;
+    if (ret <= 0)
+      break;
+
+    if (database->mirror_buf_size - database->mirror_buf_len < MIRROR_BUFFER) {
+      u_int size = 2 * database->mirror_buf_size + MIRROR_BUFFER;
+      char *buf;
+
+      if ((buf = irrd_malloc (size)) == NULL) {
+	trace (ERROR, default_trace, "(%s) Out of memory for the mirror "
+	       "stream (%u bytes)\n", database->name, size);
+	mirror_close (database);
+	return (-1);
+      }
+      if (database->mirror_buf != NULL) {
+	memcpy (buf, database->mirror_buf, database->mirror_buf_len);
+	irrd_free (database->mirror_buf);
+      }
+      database->mirror_buf = buf;
+      database->mirror_buf_size = size;
     }
 
     /* If read = 0, connection is close and we are done */
-    if ((n = read (database->mirror_fd, tmp, MIRROR_BUFFER)) <= 0) break;
+    if ((n = read (database->mirror_fd,
+		   database->mirror_buf + database->mirror_buf_len,
+		   database->mirror_buf_size - database->mirror_buf_len)) <= 0) {
+      eof = 1;
+      break;
+    }
 
     database->mirror_update_size += n;
-    if (fwrite (tmp, 1, n, database->mirror_disk_fp) != n) {
-      trace (ERROR, default_trace, "(%s): Failed on writing mirroring data to disk.\n", database->name);
-      fclose (database->mirror_disk_fp);
-      select_delete_fd (database->mirror_fd);
-      database->mirror_fd = -1;
+    database->mirror_buf_len += n;
+  }
 
-      return (-1);
-    }
+  if ((ret = mirror_apply (database, eof)) > 0) {
     select_enable_fd (database->mirror_fd);
+    return (0);
   }
 
+  mirror_close (database);
+  if (ret < 0 || !database->mirror_header)
+    return (-1);
+
   trace (NORM, default_trace, "(%s) Read %d bytes\n", 
          database->name, database->mirror_update_size);
-
-  if ((valid_start_line_ret = valid_start_line (database,
-       database->mirror_disk_fp, 
-       &database->new_serial_number)) > 0) {
-    irr_update_lock (database);
-
-    if (scan_irr_file (database, "mirror", 2, database->mirror_disk_fp) != NULL) {
-      trace (ERROR, default_trace, 
-	     "(%s) Mirroring Error: Serial number unchanged: %d\n",
-	     database->name, database->serial_number);
-      irr_update_unlock (database);
-      fclose (database->mirror_disk_fp);
-      select_delete_fd (database->mirror_fd);
-      database->mirror_fd = -1;
-      return (-1);
-    }
-    
-    irr_update_unlock (database);
-    fclose (database->mirror_disk_fp);
-    select_delete_fd (database->mirror_fd);
-    database->mirror_fd = -1;
-    database->mirror_error_message[0] = '\0';
-    database->last_mirrored = time (NULL);
-    trace (NORM, default_trace, 
-	   "(%s) Serial number now %d, Mirroring header said: %d\n", 
-	   database->name, database->serial_number, database->new_serial_number);
-
-    trace (NORM, default_trace, "(%s) Route Objects    %4d changed, %4d deleted\n",
-	   database->name,
-	   database->num_objects_changed[ROUTE], 
-	   database->num_objects_deleted[ROUTE]);
-    trace (NORM, default_trace, "(%s) AutNum Objects   %4d changed, %4d deleted\n",
-	   database->name,
-	   database->num_objects_changed[AUT_NUM], 
-	   database->num_objects_deleted[AUT_NUM]);
-    return (1);
-  }
-  fclose (database->mirror_disk_fp);
-  select_delete_fd (database->mirror_fd);
-  database->mirror_fd = -1;
-  if (valid_start_line_ret < 0) {
-     trace (ERROR, default_trace, "(%s) Mirroring failed... no valid START line\n", database->name);
-  }
-  return (-1);
+  trace (NORM, default_trace, 
+	 "(%s) Serial number now %d, Mirroring header said: %d\n", 
+	 database->name, database->serial_number, database->new_serial_number);
+
+  trace (NORM, default_trace, "(%s) Route Objects    %4d changed, %4d deleted\n",
+	 database->name,
+	 database->num_objects_changed[ROUTE], 
+	 database->num_objects_deleted[ROUTE]);
+  trace (NORM, default_trace, "(%s) AutNum Objects   %4d changed, %4d deleted\n",
+	 database->name,
+	 database->num_objects_changed[AUT_NUM], 
+	 database->num_objects_deleted[AUT_NUM]);
+  return (1);
 }
 
 /*
@@ -411,7 +555,7 @@ int irr_service_mirror_request (irr_connection_t *irr, char *command) {
   uint32_t oldestserial, currentserial, first_in_new;
   uint32_t from, to, protocol_num;
   int old_journal_exists, new_journal_exists;
-  int ret_code = 1;
+  irr_shared_block_t *response;
   char name[BUFSIZE], version[2], buffer1[BUFSIZE];
 
   /* Parse a valid -g mirror request line and set request "from" - "to" */
@@ -495,7 +639,7 @@ int irr_service_mirror_request (irr_connection_t *irr, char *command) {
     return (-1);
   }
 
-  irr_lock (database);  /* lock to build buffer with mirror data */
+  irr_read_lock (database);  /* lock to build buffer with mirror data */
 
   /* find the oldest serial we have in *.JOURNAL.1 */
   old_journal_exists = find_oldest_serial (database->name, JOURNAL_OLD, &oldestserial);
@@ -503,7 +647,7 @@ int irr_service_mirror_request (irr_connection_t *irr, char *command) {
   /* now find the first value in the *.JOURNAL file */
   if ((new_journal_exists = 
       find_oldest_serial (database->name, JOURNAL_NEW, &first_in_new)) == 0) {
-    irr_unlock (database);
+    irr_read_unlock (database);
     sprintf (buffer, "\n\n%% Warning: No serials to mirror yet or the first serial is corrupted!\n" );
     irr_write_nobuffer (irr, buffer);
     return (-1);
@@ -515,45 +659,35 @@ int irr_service_mirror_request (irr_connection_t *irr, char *command) {
 
   /* check and see if there are any "from-to" range errors in the request */
   if (from > to) {
-    irr_unlock (database);
+    irr_read_unlock (database);
     sprintf (buffer, "\n\n%% ERROR: range error 'from > to' (%u > %u)\n", from, to);
     irr_write_nobuffer (irr, buffer);
     return (-1);
   }
   
   if (from < oldestserial) {
-    irr_unlock (database);
+    irr_read_unlock (database);
     sprintf (buffer, "\n\n%% ERROR: serials (%u - %u) don't exist!\n", from, oldestserial - 1);
     irr_write_nobuffer (irr, buffer);
     return (-1);
   }
   
   if (to > currentserial) {
-    irr_unlock (database);
+    irr_read_unlock (database);
     sprintf (buffer, "\n\n%% ERROR: serials (%u - %u) don't exist!\n", currentserial + 1, to);
     irr_write_nobuffer (irr, buffer);
     return (-1);
   }
 
-  if (old_journal_exists && from < first_in_new) {
-    ret_code = dump_serial_updates (irr, database, JOURNAL_OLD, protocol_num, from, to);
-  }
-
-  if (ret_code < 0) {
-    irr_unlock (database);
-    return (-1);
-  }
-  
-  if (to >= first_in_new) {
-    ret_code = dump_serial_updates (irr, database, JOURNAL_NEW, protocol_num, from, to);
-  }
-
-  if (ret_code < 0) {
-    irr_unlock (database);
+  /* the same range is likely asked for by other mirrors, see mirror_cache.c */
+  if ((response = irr_mirror_response (irr, database, protocol_num, from, to,
+				       first_in_new, old_journal_exists)) == NULL) {
+    irr_read_unlock (database);
     return (-1);
   }
 
-  irr_unlock (database);
+  irr_read_unlock (database);
+  irr_write_shared (irr, response);
 
   sprintf (buffer, "%%START Version: %d %s %u-%u\n\n", protocol_num, database->name, from, to);
 
@@ -592,12 +726,25 @@ int dump_serial_updates (irr_connection_t *irr, irr_database_t *database, int jo
   uint32_t serial = 0, chk_serial = 0;
   int overflownow, overflowlast = 0;
   FILE *journal_fp;
+  off_t offset;
 
   make_journal_name (database->name, journal_ext, file);
   
   if ((journal_fp = fopen (file, "r")) == NULL) 
     return (-1);
 
+  /* skip ahead to an indexed serial near (from), if the index still
+   * matches the journal; see journal_index_find () */
+  if (journal_index_find (database, journal_ext, from, &offset)) {
+    if (fseeko (journal_fp, offset, SEEK_SET) < 0 ||
+	fgets (buf, BUFSIZE, journal_fp) == NULL ||
+	strncmp (buf, "% SERIAL", 8) ||
+	convert_to_32 (buf + 9, &serial) < 0 || serial > from)
+      offset = 0;
+    fseeko (journal_fp, offset, SEEK_SET);
+    serial = 0;
+  }
+
   /* find the correct spot in the journal file, then pump the updates onto the socket */
   for (buf[BUFSIZE - 1] = 0xff; fgets(buf, BUFSIZE, journal_fp) != NULL; buf[BUFSIZE - 1] = 0xff) {
     if (buf[BUFSIZE - 1] == 0 && buf[BUFSIZE - 2] != '\n') /* need to check for long lines */
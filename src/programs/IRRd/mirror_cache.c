@@ -0,0 +1,244 @@
+/* A cache of mirror responses, shared by all connections.
+ *
+ * Downstream mirrors tend to poll at the same times and ask for the same
+ * "-g DB:3:N-LAST".  The journal lines for a request are rendered once,
+ * as dump_serial_updates () would write them, into one irr_shared_block_t
+ * which is never changed afterwards.  Every connection asking
+ * for the same range queues a reference to the block instead of a copy
+ * of its own (see irr_write_shared ()), so a mirror client costs the
+ * same however many others are being served.  A request that finds the
+ * range being rendered waits for it rather than rendering it again.
+ *
+ * The key is the database, protocol, serial range and whether auth:
+ * lines are scrubbed for the client.  The journal lines for a serial do
+ * not change once written, so the entries stay good until the journal
+ * is rolled back or replaced, which empties the cache (see
+ * journal_index_reset ()).  The least recently used responses are
+ * dropped beyond MIRROR_CACHE_ENTRIES or MIRROR_CACHE_BYTES; clients
+ * still sending one keep it until they are done.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <glib.h>
+
+#include "mrt.h"
+#include "trace.h"
+#include "config_file.h"
+#include "irrd.h"
+
+#define MIRROR_CACHE_ENTRIES	16
+#define MIRROR_CACHE_BYTES	(256 * 1024 * 1024)
+
+typedef struct _mirror_response_t {
+  irr_shared_block_t	*block;		/* NULL while it is being rendered */
+  int		stale;		/* the cache was flushed while rendering */
+  u_long	last_used;
+} mirror_response_t;
+
+static struct {
+  pthread_mutex_t	mutex_lock;
+  pthread_cond_t	cond;		/* a response was rendered */
+  GHashTable		*hash;		/* key -> mirror_response_t */
+  u_long		bytes;
+  u_long		tick;
+  u_long		hits;
+  u_long		misses;
+} mirror_cache;
+
+static void mirror_response_free (mirror_response_t *r) {
+
+  if (r->block != NULL)
+    irr_shared_block_release (r->block);
+  irrd_free (r);
+}
+
+void irr_mirror_cache_init () {
+
+  pthread_mutex_init (&mirror_cache.mutex_lock, NULL);
+  pthread_cond_init (&mirror_cache.cond, NULL);
+  mirror_cache.hash = g_hash_table_new_full (g_str_hash, g_str_equal, free,
+				    (GDestroyNotify) mirror_response_free);
+}
+
+/* mirror_response_render
+ * Render the journal lines for (from)-(to) as (irr) would get them.
+ *
+ * Return:
+ *  the response, with one reference for the caller, or NULL on error
+ */
+static irr_shared_block_t *mirror_response_render (irr_connection_t *irr,
+					     irr_database_t *database,
+					     uint32_t protocol_num,
+					     uint32_t from, uint32_t to,
+					     uint32_t first_in_new,
+					     int old_journal_exists) {
+  irr_connection_t scratch;
+  final_answer_t *final_answer;
+  irr_shared_block_t *block;
+  char *cp;
+  int ret = 1;
+
+  /* the lines pile up in the scratch connection's answer buffers */
+  memset (&scratch, 0, sizeof (irr_connection_t));
+  scratch.sockfd = -1;
+  scratch.from = irr->from;
+
+  if (old_journal_exists && from < first_in_new)
+    ret = dump_serial_updates (&scratch, database, JOURNAL_OLD, protocol_num,
+			       from, to);
+  if (ret >= 0 && to >= first_in_new)
+    ret = dump_serial_updates (&scratch, database, JOURNAL_NEW, protocol_num,
+			       from, to);
+
+  block = NULL;
+  if (ret >= 0 && (block = irrd_malloc (sizeof (irr_shared_block_t))) != NULL &&
+      (block->addr = irrd_malloc (scratch.final_answer_bytes + 1)) == NULL) {
+    irrd_free (block);
+    block = NULL;
+  }
+  if (ret >= 0 && block == NULL)
+    trace (ERROR, default_trace, "mirror_response_render: out of memory "
+	   "for %lu bytes\n", scratch.final_answer_bytes);
+
+  if (block != NULL) {
+    block->ref_count = 1;
+    block->len = scratch.final_answer_bytes;
+    cp = block->addr;
+    if (scratch.ll_final_answer != NULL) {
+      LL_Iterate (scratch.ll_final_answer, final_answer) {
+	memcpy (cp, final_answer->buf, final_answer->ptr - final_answer->buf);
+	cp += final_answer->ptr - final_answer->buf;
+      }
+    }
+  }
+
+  if (scratch.ll_final_answer != NULL)
+    LL_Destroy (scratch.ll_final_answer);
+  return (block);
+}
+
+/* the least recently used response which is not being rendered */
+static void mirror_cache_lru (gpointer key, mirror_response_t *r,
+			      gpointer *lru) {
+
+  if (r->block != NULL &&
+      (lru[1] == NULL ||
+       r->last_used < ((mirror_response_t *) lru[1])->last_used)) {
+    lru[0] = key;
+    lru[1] = r;
+  }
+}
+
+/* caller holds the cache lock */
+static void mirror_cache_trim () {
+  gpointer lru[2];
+
+  while (g_hash_table_size (mirror_cache.hash) > MIRROR_CACHE_ENTRIES ||
+	 mirror_cache.bytes > MIRROR_CACHE_BYTES) {
+    lru[0] = lru[1] = NULL;
+    g_hash_table_foreach (mirror_cache.hash, (GHFunc) mirror_cache_lru, lru);
+    if (lru[1] == NULL)
+      break;
+    mirror_cache.bytes -= ((mirror_response_t *) lru[1])->block->len;
+    g_hash_table_remove (mirror_cache.hash, lru[0]);
+  }
+}
+
+/* irr_mirror_response
+ * Find or render the response to (irr)'s mirror request for serials
+ * (from)-(to) of (database).  Caller holds the read lock of (database)
+ * and queues the response with irr_write_shared ().
+ *
+ * Return:
+ *  the response, with one reference for the caller, or NULL on error
+ */
+irr_shared_block_t *irr_mirror_response (irr_connection_t *irr,
+				   irr_database_t *database,
+				   uint32_t protocol_num, uint32_t from,
+				   uint32_t to, uint32_t first_in_new,
+				   int old_journal_exists) {
+  char key[BUFSIZE];
+  mirror_response_t *r;
+  irr_shared_block_t *block;
+  int scrub;
+
+  scrub = (database->cryptpw_access_list != 0 &&
+	   !apply_access_list (database->cryptpw_access_list, irr->from));
+  snprintf (key, sizeof (key), "%s:%u:%u-%u:%d", database->name,
+	    protocol_num, from, to, scrub);
+
+  pthread_mutex_lock (&mirror_cache.mutex_lock);
+  while ((r = g_hash_table_lookup (mirror_cache.hash, key)) != NULL &&
+	 r->block == NULL)
+    pthread_cond_wait (&mirror_cache.cond, &mirror_cache.mutex_lock);
+
+  if (r != NULL) {
+    mirror_cache.hits++;
+    r->last_used = ++mirror_cache.tick;
+    block = r->block;
+    g_atomic_int_inc (&block->ref_count);
+    pthread_mutex_unlock (&mirror_cache.mutex_lock);
+    return (block);
+  }
+
+  /* ours to render; others asking meanwhile wait for it */
+  mirror_cache.misses++;
+  if ((r = irrd_malloc (sizeof (mirror_response_t))) == NULL) {
+    pthread_mutex_unlock (&mirror_cache.mutex_lock);
+    return (NULL);
+  }
+  g_hash_table_insert (mirror_cache.hash, strdup (key), r);
+  pthread_mutex_unlock (&mirror_cache.mutex_lock);
+
+  block = mirror_response_render (irr, database, protocol_num, from, to,
+				first_in_new, old_journal_exists);
+
+  pthread_mutex_lock (&mirror_cache.mutex_lock);
+  if (block == NULL || r->stale)
+    g_hash_table_remove (mirror_cache.hash, key);
+  else {
+    g_atomic_int_inc (&block->ref_count);
+    r->block = block;
+    r->last_used = ++mirror_cache.tick;
+    mirror_cache.bytes += block->len;
+    mirror_cache_trim ();
+  }
+  pthread_cond_broadcast (&mirror_cache.cond);
+  pthread_mutex_unlock (&mirror_cache.mutex_lock);
+  return (block);
+}
+
+/* drop (r), or have its renderer drop it when done */
+static gboolean mirror_cache_flush_one (gpointer key, mirror_response_t *r,
+					gpointer unused) {
+
+  if (r->block == NULL) {
+    r->stale = 1;
+    return (FALSE);
+  }
+  return (TRUE);
+}
+
+/* irr_mirror_cache_flush
+ * Drop every cached response, eg when a journal is rolled back.
+ */
+void irr_mirror_cache_flush () {
+
+  pthread_mutex_lock (&mirror_cache.mutex_lock);
+  g_hash_table_foreach_remove (mirror_cache.hash,
+			       (GHRFunc) mirror_cache_flush_one, NULL);
+  mirror_cache.bytes = 0;
+  pthread_mutex_unlock (&mirror_cache.mutex_lock);
+}
+
+void show_mirror_cache (uii_connection_t *uii) {
+
+  pthread_mutex_lock (&mirror_cache.mutex_lock);
+  uii_add_bulk_output (uii, "Mirror response cache: %u responses, %lu bytes\r\n",
+		       g_hash_table_size (mirror_cache.hash), mirror_cache.bytes);
+  uii_add_bulk_output (uii, "   %lu hits, %lu misses\r\n",
+		       mirror_cache.hits, mirror_cache.misses);
+  pthread_mutex_unlock (&mirror_cache.mutex_lock);
+}
@@ -0,0 +1,275 @@
+/* An epoll reactor for RAWhoisd connections.  Rather than one thread
+ * blocked in select () per connection, a single reactor thread waits on
+ * all idle connections and hands the readable ones to a fixed pool of
+ * worker threads which run irr_read_command ().  An idle connection
+ * costs its irr_connection_t and nothing else.
+ *
+ * Each connection is registered EPOLLONESHOT, so at most one worker
+ * owns it at a time; the worker re-arms it when the command(s) it read
+ * have been answered.  The worker writes the answer out itself, so a
+ * client that stops reading would hold it; such a client is dropped
+ * after WRITE_TIMEOUT seconds (see irr_accept_connection ()).  Without
+ * epoll (or threads) irr_reactor_add () fails and telnet.c falls back to
+ * a thread per connection.
+ */
+
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <signal.h>
+#include <glib.h>
+
+#include "mrt.h"
+#include "trace.h"
+#include "config_file.h"
+#include "irrd.h"
+
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif /* HAVE_SYS_EPOLL_H */
+
+#if defined(HAVE_LIBPTHREAD) && defined(HAVE_SYS_EPOLL_H)
+
+#define REACTOR_MAX_EVENTS	256
+
+static int		epoll_fd = -1;
+static GQueue		*work_queue;	/* readable connections for the workers */
+static pthread_mutex_t	work_mutex_lock;
+static pthread_cond_t	work_cond;
+
+static void *irr_reactor_loop (void *arg);
+static void *irr_reactor_worker (void *arg);
+static void irr_reactor_timeout (void);
+
+/* irr_reactor_init
+ * Create the epoll set, the reactor thread and IRR.worker_threads workers.
+ * Called once at startup, before we listen for whois connections.
+ *
+ * Return:
+ *  1 if the reactor is running
+ *  -1 otherwise (connections then get a thread each)
+ */
+int irr_reactor_init (void) {
+  int i;
+
+  if ((epoll_fd = epoll_create (MAX_TOTAL_CONNECTIONS)) < 0) {
+    trace (ERROR, default_trace, "irr_reactor_init (): epoll_create (%s)\n",
+	   strerror (errno));
+    return (-1);
+  }
+
+  work_queue = g_queue_new ();
+  pthread_mutex_init (&work_mutex_lock, NULL);
+  pthread_cond_init (&work_cond, NULL);
+
+  for (i = 0; i < IRR.worker_threads; i++) {
+    if (mrt_thread_create ("IRR worker", NULL,
+			   (thread_fn_t) irr_reactor_worker, NULL) == NULL) {
+      trace (ERROR, default_trace, "irr_reactor_init (): could not start "
+	     "worker %d\n", i);
+      if (i == 0) {
+	close (epoll_fd);
+	epoll_fd = -1;
+	return (-1);
+      }
+      break;
+    }
+  }
+
+  if (mrt_thread_create ("IRR reactor", NULL,
+			 (thread_fn_t) irr_reactor_loop, NULL) == NULL) {
+    trace (ERROR, default_trace, "irr_reactor_init (): could not start reactor\n");
+    close (epoll_fd);
+    epoll_fd = -1;
+    return (-1);
+  }
+
+  IRR.reactor_workers = i;
+  trace (NORM, default_trace, "whois reactor started with %d workers\n", i);
+  return (1);
+}
+
+/* irr_reactor_add
+ * Hand a newly accepted connection to the reactor.
+ * Return 1 if it was added, -1 if the caller needs to serve it itself.
+ */
+int irr_reactor_add (irr_connection_t *irr) {
+  struct epoll_event ev;
+
+  if (epoll_fd < 0)
+    return (-1);
+
+  irr->cp = irr->buffer;
+  irr->end = irr->buffer;
+  irr->end[0] = '\0';
+  irr->reactor = 1;
+  irr->last_active = time (NULL);
+
+  trace (NORM, default_trace, "connection from %s (fd %d)\n",
+	 prefix_toa (irr->from), irr->sockfd);
+
+  memset (&ev, 0, sizeof (ev));
+  ev.events = EPOLLIN | EPOLLONESHOT;
+  ev.data.ptr = irr;
+  if (epoll_ctl (epoll_fd, EPOLL_CTL_ADD, irr->sockfd, &ev) < 0) {
+    trace (ERROR, default_trace, "irr_reactor_add (): epoll_ctl (%s)\n",
+	   strerror (errno));
+    irr->reactor = 0;
+    return (-1);
+  }
+  return (1);
+}
+
+/* irr_reactor_rearm
+ * A worker is done with (irr); let the reactor watch it again.  Done under
+ * the connections lock so the idle sweep never sees it half way.
+ */
+static void irr_reactor_rearm (irr_connection_t *irr) {
+  struct epoll_event ev;
+
+  memset (&ev, 0, sizeof (ev));
+  ev.events = EPOLLIN | EPOLLONESHOT;
+  ev.data.ptr = irr;
+
+  pthread_mutex_lock (&IRR.connections_mutex_lock);
+  irr->busy = 0;
+  irr->last_active = time (NULL);
+  if (epoll_ctl (epoll_fd, EPOLL_CTL_MOD, irr->sockfd, &ev) < 0)
+    trace (ERROR, default_trace, "irr_reactor_rearm (): epoll_ctl (%s)\n",
+	   strerror (errno));
+  pthread_mutex_unlock (&IRR.connections_mutex_lock);
+}
+
+static void *irr_reactor_loop (void *arg) {
+  struct epoll_event events[REACTOR_MAX_EVENTS];
+  irr_connection_t *irr;
+  time_t last_sweep = 0;
+  sigset_t set;
+  int i, n;
+
+  sigemptyset (&set);
+  sigaddset (&set, SIGALRM);
+  sigaddset (&set, SIGHUP);
+  pthread_sigmask (SIG_BLOCK, &set, NULL);
+
+  while (1) {
+    if ((n = epoll_wait (epoll_fd, events, REACTOR_MAX_EVENTS, 1000)) < 0) {
+      if (errno != EINTR)
+	trace (ERROR, default_trace, "irr_reactor_loop (): epoll_wait (%s)\n",
+	       strerror (errno));
+      n = 0;
+    }
+
+    if (n > 0) {
+      pthread_mutex_lock (&IRR.connections_mutex_lock);
+      for (i = 0; i < n; i++) {
+	irr = (irr_connection_t *) events[i].data.ptr;
+	irr->busy = 1;
+      }
+      pthread_mutex_unlock (&IRR.connections_mutex_lock);
+
+      pthread_mutex_lock (&work_mutex_lock);
+      for (i = 0; i < n; i++)
+	g_queue_push_tail (work_queue, events[i].data.ptr);
+      pthread_cond_broadcast (&work_cond);
+      pthread_mutex_unlock (&work_mutex_lock);
+    }
+
+    if (time (NULL) != last_sweep) {
+      last_sweep = time (NULL);
+      irr_reactor_timeout ();
+    }
+  }
+  /* NOTREACHED */
+  return (NULL);
+}
+
+/* irr_reactor_timeout
+ * Close connections that have been idle longer than their timeout.
+ * Only connections the reactor is watching are looked at; one owned by
+ * a worker is not idle.
+ */
+static void irr_reactor_timeout (void) {
+  irr_connection_t *irr;
+  LINKED_LIST *ll_idle = NULL;
+  time_t now = time (NULL);
+
+  pthread_mutex_lock (&IRR.connections_mutex_lock);
+  LL_Iterate (IRR.ll_connections, irr) {
+    if (irr->reactor && !irr->busy &&
+	(u_long) (now - irr->last_active) > irr->timeout) {
+      if (ll_idle == NULL)
+	ll_idle = LL_Create (0);
+      irr->busy = 1;
+      epoll_ctl (epoll_fd, EPOLL_CTL_DEL, irr->sockfd, NULL);
+      LL_Add (ll_idle, irr);
+    }
+  }
+  pthread_mutex_unlock (&IRR.connections_mutex_lock);
+
+  if (ll_idle == NULL)
+    return;
+
+  LL_Iterate (ll_idle, irr) {
+    trace (NORM, default_trace, "select timeout on read\n");
+    irr_destroy_connection (irr);
+  }
+  LL_Destroy (ll_idle);
+}
+
+static void *irr_reactor_worker (void *arg) {
+  irr_connection_t *irr;
+  sigset_t set;
+  int ret;
+
+  sigemptyset (&set);
+  sigaddset (&set, SIGALRM);
+  sigaddset (&set, SIGHUP);
+  pthread_sigmask (SIG_BLOCK, &set, NULL);
+
+  while (1) {
+    pthread_mutex_lock (&work_mutex_lock);
+    while (g_queue_is_empty (work_queue))
+      pthread_cond_wait (&work_cond, &work_mutex_lock);
+    irr = g_queue_pop_head (work_queue);
+    pthread_mutex_unlock (&work_mutex_lock);
+
+    if (irr->scheduled_for_deletion == 1) {
+      trace (ERROR, default_trace, "Unexpected scheduled for deletion\n");
+      irr_destroy_connection (irr);
+      continue;
+    }
+
+    /* a failed read has already destroyed the connection */
+    if ((ret = irr_read_command (irr)) < 0) {
+      trace (NORM, default_trace, "Connection Aborted\n");
+      continue;
+    }
+
+    if (((ret == 1) && (irr->stay_open == 0)) ||
+	(irr->scheduled_for_deletion == 1)) {
+      irr_destroy_connection (irr);
+      continue;
+    }
+
+    irr_reactor_rearm (irr);
+  }
+  /* NOTREACHED */
+  return (NULL);
+}
+
+#else /* HAVE_LIBPTHREAD && HAVE_SYS_EPOLL_H */
+
+int irr_reactor_init (void) {
+  return (-1);
+}
+
+int irr_reactor_add (irr_connection_t *irr) {
+  return (-1);
+}
+
+#endif /* HAVE_LIBPTHREAD && HAVE_SYS_EPOLL_H */
@@ -46,6 +46,7 @@ void add_irr_prefix (irr_database_t *database, prefix_t *prefix,
   prefix_object->offset  = object->offset;
   prefix_object->len     = object->len;
   prefix_object->origin  = object->origin;
+  prefix_object->maxlen  = object->roa_maxlen;
   prefix_object->type    = object->type;
   if (node->data != NULL) {
     prefix_object->next = (irr_prefix_object_t *) node->data;
@@ -152,3 +153,48 @@ radix_node_t *prefix_search_best (irr_database_t *database, prefix_t *prefix) {
   
   return (radix_search_best (radix, prefix, 0));
 }
+
+/* irr_roa_validate
+ * Check the origin (origin) of a route for (prefix) against the ROAs
+ * of the ROA database, which are kept in its radix trees with their
+ * max length.  A ROA covering the route makes it valid if it is for
+ * the same origin and the route is no longer than its max length (its
+ * own length if it has none).  Otherwise any covering ROA makes it
+ * invalid.  (*roa) is set to the valid ROA, or else the most specific
+ * covering one.  Caller holds the ROA database's read lock.
+ */
+enum OBJ_ROASTATUS irr_roa_validate (prefix_t *prefix, uint32_t origin,
+				     irr_prefix_object_t **roa) {
+  radix_node_t *stack[RADIX_MAXBITS + 1];
+  irr_prefix_object_t *roa_object;
+  radix_tree_t *radix;
+  int i, n, maxlen;
+
+  *roa = NULL;
+  if (IRR.roa_database == NULL)
+    return (ROA_UNKNOWN);
+
+  if (prefix->family == AF_INET6)
+    radix = IRR.roa_database->radix_v6;
+  else
+    radix = IRR.roa_database->radix_v4;
+
+  if ((n = radix_search_covering (radix, prefix, stack)) == 0)
+    return (ROA_UNKNOWN);
+
+  for (i = n - 1; i >= 0; i--) {
+    for (roa_object = stack[i]->data; roa_object != NULL;
+	 roa_object = roa_object->next) {
+      if (*roa == NULL)
+	*roa = roa_object;
+      maxlen = roa_object->maxlen ? roa_object->maxlen : stack[i]->prefix->bitlen;
+      /* AS0 ROAs never validate a route */
+      if (origin != 0 && roa_object->origin == origin &&
+	  prefix->bitlen <= maxlen) {
+	*roa = roa_object;
+	return (ROA_VALID);
+      }
+    }
+  }
+  return (ROA_INVALID);
+}
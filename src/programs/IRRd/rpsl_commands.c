@@ -21,49 +21,103 @@
 
 /* a list of prefix range types */
 enum EXPAND_TYPE { NO_EXPAND, ROUTE_SET_EXPAND, OTHER_EXPAND };
-typedef struct _member_examined_hash_t {
+
+/* a list of prefix range types */
+enum PREFIX_RANGE_TYPE {
+    INVALID_RANGE, EXCLUSIVE_RANGE, INCLUSIVE_RANGE, VALUE_RANGE };
+
+/* the range operators of a set, eg "^+^24", parsed once per set */
+#define MAX_RANGE_OPS 256
+typedef struct _range_ops_t {
+    int valid;          /* 0 if an operator did not parse */
+    int n;
+    struct {
+        enum PREFIX_RANGE_TYPE type;
+        unsigned int start, end;
+    } op[MAX_RANGE_OPS];
+} range_ops_t;
+
+/* the state of one !i query, shared by the threads expanding it */
+typedef struct _expand_ctx_t {
+    irr_connection_t *irr;
+    u_short afi;
+    enum EXPAND_TYPE expand_flag;
+    time_t start_time;
+    int error;          /* an error has been sent, give up */
+    pthread_mutex_t mutex_lock;
+    GHashTable *done;   /* key -> expand_done_t of the sets expanded */
+} expand_ctx_t;
+
+typedef struct _expand_done_t {
+    irr_expansion_t *e;
+    int complete;       /* 0 if a set nested in itself was left out */
+} expand_done_t;
+
+/* a set being expanded, and the sets it is nested in */
+typedef struct _expand_frame_t {
     char *key;
-} member_examined_hash_t;
+    int depth;
+    struct _expand_frame_t *up;
+} expand_frame_t;
+
+/* a nested set, expanded on the task pool */
+typedef struct _expand_task_t {
+    irr_task_t task;
+    expand_ctx_t *ctx;
+    irr_connection_t *irr;  /* ctx->irr, or (view) on the task pool */
+    irr_connection_t view;  /* a private copy of the sources to iterate */
+    char *name;
+    char *range_op;     /* the '^' of the reference, or NULL */
+    char *dbname;
+    int depth;
+    expand_frame_t *up;
+    int low;
+    irr_expansion_t *e;
+} expand_task_t;
 
 /* local routines */
 
-int str_p_cmp(gconstpointer, gconstpointer);
-
-void update_members_list (irr_database_t *database, char *range_op, u_short,
-        enum EXPAND_TYPE expand_flag,
-        GHashTable  *hash_member_examined,
-        LINKED_LIST *ll_setlist, LINKED_LIST *ll_set_names,
-        GQueue *stack, irr_connection_t *irr);
-void mbrs_by_ref_set (irr_database_t *database, char *range_op, u_short,
-        enum EXPAND_TYPE expand_flag, LINKED_LIST *ll_setlist,
-        char *set_name, LINKED_LIST *ll_mbr_by_ref, irr_connection_t *irr);
+static void set_expand (irr_connection_t *irr, char *name, u_short afi);
+static irr_expansion_t *expand_query (irr_connection_t *irr, char *name,
+        u_short afi, enum EXPAND_TYPE expand_flag);
+static irr_expansion_t *expand_set (expand_ctx_t *ctx, irr_connection_t *irr,
+        char *name, char *dbname, int depth, expand_frame_t *up, int *low);
+void mbrs_by_ref_set (irr_database_t *database, u_short,
+        enum EXPAND_TYPE expand_flag, irr_member_set_t *set,
+        char *set_name, LINKED_LIST *ll_mbr_by_ref, GHashTable *deps,
+        irr_connection_t *irr);
 char *rpsl_macro_expand_add (char *range, char *name,
         irr_connection_t *irr, char *dbname);
-void SL_Add (LINKED_LIST *ll_setlist, char *member, char *range_op, u_short,
-        enum EXPAND_TYPE expand_flag, irr_connection_t *irr);
+range_ops_t *range_ops_parse (char *range_op, range_ops_t *ops);
+static int range_ops_apply (irr_member_prefix_t *p, range_ops_t *ops);
+void SL_Add (irr_member_set_t *set, char *member, u_short,
+        enum EXPAND_TYPE expand_flag, GHashTable *deps, irr_connection_t *irr);
 int chk_set_name (char *);
 
-void HashMemberExaminedDestroy(member_examined_hash_t *h) {
-    if (h == NULL) return;
-    if (h->key) irrd_free(h->key);
-    irrd_free(h);
-}
-
 /* as-set/route-set expansion !ias-bar */
 void irr_set_expand (irr_connection_t *irr, char *name)
 {
-    irr_database_t *database;
-    time_t start_time;
-    GArray *array;
-    GQueue *stack;
-    GHashTable *hash_member_examined;
-    member_examined_hash_t *member_examined_ptr;
-    LINKED_LIST *ll_setlist;
-    char *set_name, *last_set_name, *mstr, *db;
-    char *range_op, abuf[BUFSIZE];
+    set_expand (irr, name, AF_INET);
+}
+
+/* as-set/route-set expansion !i6as-bar */
+void irr_set_expand6 (irr_connection_t *irr, char *name)
+{
+    set_expand (irr, name, AF_INET6);
+}
+
+static void expand_done_free (expand_done_t *done)
+{
+    irr_expansion_release (done->e);
+    irrd_free (done);
+}
+
+static void set_expand (irr_connection_t *irr, char *name, u_short afi)
+{
+    irr_expansion_t *e;
+    enum EXPAND_TYPE expand_flag = NO_EXPAND;
+    char *set_name;
     char *lasts = NULL;
-    int i, first, dup, expand_flag = NO_EXPAND;
-    hash_spec_t *hash_spec;
 
     if (strchr(name, ',') != NULL) {
         strtok_r(name, ",", &lasts);
@@ -78,228 +132,373 @@ void irr_set_expand (irr_connection_t *irr, char *name)
             expand_flag = OTHER_EXPAND;
     }
 
-    start_time = time(NULL);
     convert_toupper (name);
-    stack = g_queue_new();
-    hash_member_examined = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, (GDestroyNotify)HashMemberExaminedDestroy);
-    ll_setlist = LL_Create (LL_DestroyFunction, free, NULL);
-    mstr = rpsl_macro_expand_add (" ", name, irr, NULL);
-    g_queue_push_head(stack, mstr);
-    member_examined_ptr = irrd_malloc(sizeof(member_examined_hash_t));
-    member_examined_ptr->key = strdup(name);
-    g_hash_table_insert(hash_member_examined, member_examined_ptr->key, member_examined_ptr);
-
-    while (!g_queue_is_empty(stack)) {
-        if ( IRR.expansion_timeout > 0 ) {
-            if ( (time(NULL) - start_time) > IRR.expansion_timeout ) {
-                trace (ERROR, default_trace, "irr_set_expand(): Set expansion timeout\n");
-                sprintf(abuf, "Expansion maximum CPU time exceeded: %d seconds", IRR.expansion_timeout);
-                irr_send_error(irr, abuf);
-                goto getout;
-            }
-        }
-        mstr = (char *) g_queue_pop_head(stack);
-        /* might want to check the examined list to see if this set name
-           has been examined already */
-        first = 1;
-        lasts = NULL;
-        range_op = strtok_r (mstr, ",", &lasts);
-        if (!strcmp (range_op, " ")) range_op = NULL;
-        set_name = strtok_r (NULL, ",", &lasts);
-
-        irr_lock_all(irr); /* lock db's while searching */
-        while ((db = strtok_r (NULL, ",", &lasts)) != NULL) {
-            if ((database = find_database (db)) == NULL) {
-                trace (ERROR, default_trace, "irr_set_expand(): Database not found %s\n", db);
-                sprintf(abuf, "Database not found: %s", db);
-                irr_send_error(irr, abuf);
-                goto getout;
-            }
-            make_setobj_key (abuf, set_name);
-            if ((hash_spec = fetch_hash_spec (database, abuf, UNPACK)) != NULL) {
-                first = 0;
-                update_members_list (database, range_op, AF_INET, expand_flag,
-                        hash_member_examined, ll_setlist, hash_spec->ll_1,
-                        stack, irr);
-                mbrs_by_ref_set (database, range_op, AF_INET, expand_flag, ll_setlist,
-                        set_name, hash_spec->ll_2, irr);
-                Delete_hash_spec (hash_spec);
-            }
-            if (first == 0)
+    if ((e = expand_query (irr, name, afi, expand_flag)) != NULL) {
+        irr_expansion_send (irr, e);
+        irr_expansion_release (e);
+    }
+}
+
+/* aggregated route-set/as-set/AS prefixes !aRS-BAR, !a4AS-BAR, !a6AS1234 */
+void irr_set_aggregate (irr_connection_t *irr, char *name)
+{
+    irr_member_set_t *set;
+    irr_expansion_t *e[2];
+    GHashTable *deps;
+    u_short family = 0, afi;
+    char *answer;
+    u_int len;
+    int i, n = 0;
+
+    if (*name == '4')
+        family = AF_INET;
+    else if (*name == '6')
+        family = AF_INET6;
+    if (family != 0)
+        name++;
+    convert_toupper (name);
+
+    for (afi = AF_INET; afi != 0; afi = (afi == AF_INET) ? AF_INET6 : 0) {
+        if (family != 0 && family != afi)
+            continue;
+        /* a set is expanded as a route-set, an AS gives its routes */
+        if (chk_set_name (name)) {
+            if ((e[n] = expand_query (irr, name, afi, ROUTE_SET_EXPAND)) == NULL)
                 break;
+        } else {
+            set = irr_member_set_new ();
+            deps = g_hash_table_new_full (g_str_hash, g_str_equal, free, NULL);
+            irr_lock_all (irr);
+            SL_Add (set, name, afi, ROUTE_SET_EXPAND, deps, irr);
+            irr_unlock_all (irr);
+            if (set->failed) {
+                irr_send_error (irr, "Out of memory");
+                irr_member_set_destroy (set);
+                g_hash_table_destroy (deps);
+                break;
+            }
+            e[n] = irr_member_set_freeze (set, deps);
+            irr_member_set_destroy (set);
+            g_hash_table_destroy (deps);
         }
-        irr_unlock_all(irr);
-        free (mstr);
+        n++;
     }
 
-    first = 1;
-    dup = 0;
-    i = 0;
-    last_set_name = "";
-    array = g_array_sized_new(FALSE, TRUE, sizeof(char*), ll_setlist->count);
-    LL_ContIterate (ll_setlist, set_name) {
-        g_array_append_val(array, set_name);
+    /* an error has been sent */
+    if (afi != 0) {
+        for (i = 0; i < n; i++)
+            irr_expansion_release (e[i]);
+        return;
     }
-    g_array_sort(array, (GCompareFunc)str_p_cmp);
-    i = 0;
-    while (i < ll_setlist->count) {
-        set_name = g_array_index(array, char*, i++);
-        if (!first) {
-            /* since list is sorted, any duplicates should be consecutive */
-            if (strcmp (last_set_name, set_name) == 0)
-                dup = 1;
-            else /* add a space before each item */
-                irr_add_answer (irr, " ");
-        }
-        if (!dup) { /* only print this if not a duplicate */
-            irr_add_answer (irr, "%s", set_name);
-            last_set_name = set_name;
-        } else
-            dup = 0;
-        first = 0;
-    }
-    g_array_free(array, TRUE);
-    irr_send_answer (irr);
-getout:
-    LL_Destroy (ll_setlist);
-    g_hash_table_destroy(hash_member_examined);
-    g_queue_free(stack);
+
+    answer = irr_expansion_aggregate (e, n, family, &len);
+    for (i = 0; i < n; i++)
+        irr_expansion_release (e[i]);
+    if (answer == NULL) {
+        irr_write_nobuffer (irr, "D\n");
+        trace (NORM, default_trace, "No entries found\n");
+        return;
+    }
+    irr_write (irr, answer, len);
+    irr_write_buffer_flush (irr);
+    trace (NORM, default_trace, "Sent %u bytes\n", len);
+    irrd_free (answer);
 }
 
-/*
- * Wrapper around strcmp for g_array_sort.
- * Takes two gconstpointers to strings (char pointers) and compares them
+/* expand set (name) for a query
+ *
+ * Returns the expansion, to be released by the caller, or NULL if an
+ * error was sent.
  */
-int str_p_cmp(gconstpointer g_aa, gconstpointer g_bb)
+static irr_expansion_t *expand_query (irr_connection_t *irr, char *name,
+        u_short afi, enum EXPAND_TYPE expand_flag)
 {
-    char* aa = *((char**)g_aa);
-    char* bb = *((char**)g_bb);
+    expand_ctx_t ctx;
+    irr_expansion_t *e;
+    int low = 0;
+
+    memset (&ctx, 0, sizeof (ctx));
+    ctx.irr = irr;
+    ctx.afi = afi;
+    ctx.expand_flag = expand_flag;
+    ctx.start_time = time(NULL);
+    pthread_mutex_init (&ctx.mutex_lock, NULL);
+    ctx.done = g_hash_table_new_full(g_str_hash, g_str_equal, free, (GDestroyNotify)expand_done_free);
+
+    e = expand_set (&ctx, irr, name, NULL, 0, NULL, &low);
+
+    g_hash_table_destroy(ctx.done);
+    pthread_mutex_destroy (&ctx.mutex_lock);
+    return e;
+}
 
-    return strcmp(aa, bb);
+/* send (msg) unless another thread of the query has sent an error */
+static void expand_error (expand_ctx_t *ctx, char *msg)
+{
+    pthread_mutex_lock (&ctx->mutex_lock);
+    if (!ctx->error) {
+        ctx->error = 1;
+        irr_send_error (ctx->irr, msg);
+    }
+    pthread_mutex_unlock (&ctx->mutex_lock);
 }
 
-/* as-set/route-set expansion !i6as-bar */
-void irr_set_expand6(irr_connection_t *irr, char *name)
+static void expand_task_run (expand_task_t *t)
+{
+    t->e = expand_set (t->ctx, t->irr, t->name, t->dbname, t->depth, t->up,
+            &t->low);
+}
+
+/* note that the members of a set depend on spec hash entry (key) */
+static void expand_dep (GHashTable *deps, char *key)
+{
+    if (deps != NULL && g_hash_table_lookup (deps, key) == NULL) {
+        key = strdup (key);
+        g_hash_table_insert (deps, key, key);
+    }
+}
+
+/* add the members of nested set (sub) to (set) */
+static void expand_merge (irr_member_set_t *set, GHashTable *deps,
+        irr_expansion_t *sub, range_ops_t *ops)
+{
+    irr_member_prefix_t p;
+    u_int i;
+
+    for (i = 0; i < sub->ndeps; i++)
+        expand_dep (deps, sub->deps[i]);
+    if (sub->incomplete)
+        set->incomplete = 1;
+    if (ops != NULL && !ops->valid)
+        return;
+    for (i = 0; i < sub->nprefixes; i++) {
+        p = sub->prefixes[i];
+        if (ops == NULL || range_ops_apply (&p, ops))
+            irr_member_set_add_prefix (set, &p);
+    }
+    /* a range operator only applies to prefixes, see SL_Add() */
+    if (ops == NULL)
+        for (i = 0; i < sub->nnames; i++)
+            irr_member_set_add_name (set, sub->names[i]);
+}
+
+/*
+ * Expand set (name), looking for it in (dbname) first and then in the
+ * other sources of the query.  Expansions are shared with other queries
+ * through expand_cache.c, so a nested set is expanded on its own and its
+ * range operator applied when it is merged into the set above.  With
+ * irr_expand_threads set, the nested sets of a set are expanded on the
+ * task pool at the same time.
+ *
+ * (depth) is how deeply (name) is nested, within the sets (up).  A set
+ * that refers back to one of those leaves that set's members out; (*low)
+ * is lowered to the depth of the set referred to, and only complete
+ * expansions are cached.  The one asked for is always complete, since
+ * everything left out further down is part of it.
+ *
+ * Returns the expansion, to be released by the caller, or NULL if (name)
+ * is being expanded already or an error was sent.
+ */
+static irr_expansion_t *expand_set (expand_ctx_t *ctx, irr_connection_t *irr,
+        char *name, char *dbname, int depth, expand_frame_t *up, int *low)
 {
     irr_database_t *database;
-    time_t start_time;
-    GArray *array;
-    GQueue *stack;
-    GHashTable *hash_member_examined;
-    member_examined_hash_t *member_examined_ptr;
-    LINKED_LIST *ll_setlist;
-    char *set_name, *last_set_name, *mstr, *db;
-    char *range_op, abuf[BUFSIZE];
-    char *lasts = NULL;
-    int i, first, dup, expand_flag = NO_EXPAND;
+    irr_member_set_t *set;
+    irr_expansion_t *e = NULL;
+    expand_done_t *done;
+    expand_frame_t frame, *f;
+    expand_task_t *tasks;
     hash_spec_t *hash_spec;
+    GHashTable *deps;
+    LINKED_LIST *ll_subsets;
+    range_ops_t *ops, ops_buf;
+    char *key, *dbs, *db, *member, *found = NULL;
+    char tag[16], abuf[BUFSIZE];
+    char *lasts = NULL;
+    u_long epoch;
+    int i, n, complete, sub_low = depth;
 
-    if (strchr(name, ',') != NULL) {
-        strtok_r(name, ",", &lasts);
-        /* check if we are expanding a route-set */
-        if ((set_name = strchr(name, ':')) != NULL)
-            set_name++;
-        else
-            set_name = name;
-        if (!strncasecmp(set_name, "rs-", 3))
-            expand_flag = ROUTE_SET_EXPAND;
-        else
-            expand_flag = OTHER_EXPAND;
+    if (ctx->error)
+        return NULL;
+
+    sprintf (tag, "%d/%d", ctx->expand_flag, (ctx->afi == AF_INET6) ? 6 : 4);
+    key = rpsl_macro_expand_add (tag, name, irr, dbname);
+
+    for (f = up; f != NULL; f = f->up) {
+        if (!strcmp (f->key, key)) {
+            if (f->depth < *low)
+                *low = f->depth;
+            free (key);
+            return NULL;
+        }
+    }
+    pthread_mutex_lock (&ctx->mutex_lock);
+    if ((done = g_hash_table_lookup (ctx->done, key)) != NULL) {
+        if (!done->complete)
+            *low = 0;
+        e = done->e;
+        irr_expansion_hold (e);
+    }
+    pthread_mutex_unlock (&ctx->mutex_lock);
+    if (e != NULL) {
+        free (key);
+        return e;
+    }
+    if ((e = irr_expand_cache_lookup (key)) != NULL) {
+        complete = 1;
+        goto remember;
     }
 
-    start_time = time(NULL);
-    convert_toupper(name);
-    stack = g_queue_new();
-    hash_member_examined = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, (GDestroyNotify)HashMemberExaminedDestroy);
-    ll_setlist = LL_Create(LL_DestroyFunction, free, NULL);
-    mstr = rpsl_macro_expand_add(" ", name, irr, NULL);
-    g_queue_push_head(stack, mstr);
-    member_examined_ptr = irrd_malloc(sizeof(member_examined_hash_t));
-    member_examined_ptr->key = strdup(name);
-    g_hash_table_insert(hash_member_examined, member_examined_ptr->key, member_examined_ptr);
-
-    while (!g_queue_is_empty(stack)) {
-        if (IRR.expansion_timeout > 0) {
-            if ((time(NULL) - start_time) > IRR.expansion_timeout) {
-                trace(ERROR, default_trace, "irr_set_expand6(): Set expansion timeout\n");
-                sprintf(abuf, "Expansion maximum CPU time exceeded: %d seconds",
-                        IRR.expansion_timeout);
-                irr_send_error(irr, abuf);
-                goto getout;
-            }
+    if ( IRR.expansion_timeout > 0 ) {
+        if ( (time(NULL) - ctx->start_time) > IRR.expansion_timeout ) {
+            trace (ERROR, default_trace, "irr_set_expand(): Set expansion timeout\n");
+            sprintf(abuf, "Expansion maximum CPU time exceeded: %d seconds", IRR.expansion_timeout);
+            expand_error (ctx, abuf);
+            free (key);
+            return NULL;
         }
-        mstr = (char *) g_queue_pop_head(stack);
-        /* might want to check the examined list to see if this set name
-           has been examined already */
-        first = 1;
-        lasts = NULL;
-        range_op = strtok_r(mstr, ",", &lasts);
-        if (!strcmp(range_op, " ")) range_op = NULL;
-        set_name = strtok_r(NULL, ",", &lasts);
-
-        irr_lock_all(irr); /* lock db's while searching */
-        while ((db = strtok_r(NULL, ",", &lasts)) != NULL) {
-            if ((database = find_database(db)) == NULL) {
-                trace(ERROR, default_trace, "irr_set_expand6(): Database not found %s\n",
-                        db);
-                sprintf(abuf, "Database not found: %s", db);
-                irr_send_error(irr, abuf);
-                goto getout;
-            }
-            make_setobj_key(abuf, set_name);
-            if ((hash_spec = fetch_hash_spec (database, abuf, UNPACK)) != NULL) {
-                first = 0;
-                update_members_list(database, range_op, AF_INET6, expand_flag,
-                        hash_member_examined, ll_setlist, hash_spec->ll_1,
-                        stack, irr);
-                mbrs_by_ref_set(database, range_op, AF_INET6, expand_flag, ll_setlist,
-                        set_name, hash_spec->ll_2, irr);
-                Delete_hash_spec (hash_spec);
+    }
+
+    epoch = irr_expand_cache_epoch ();
+    frame.key = key;
+    frame.depth = depth;
+    frame.up = up;
+    set = irr_member_set_new ();
+    deps = g_hash_table_new_full (g_str_hash, g_str_equal, free, NULL);
+    ll_subsets = LL_Create (LL_DestroyFunction, free, NULL);
+
+    make_setobj_key (abuf, name);
+    expand_dep (deps, abuf);
+
+    /* (key) lists the sources in the order to search them */
+    dbs = strdup (key);
+    strtok_r (dbs, ",", &lasts);
+    strtok_r (NULL, ",", &lasts);
+    irr_lock_all(irr); /* lock db's while searching */
+    while ((db = strtok_r (NULL, ",", &lasts)) != NULL) {
+        if ((database = find_database (db)) == NULL) {
+            trace (ERROR, default_trace, "irr_set_expand(): Database not found %s\n", db);
+            sprintf(abuf, "Database not found: %s", db);
+            expand_error (ctx, abuf);
+            break;
+        }
+        if ((hash_spec = fetch_hash_spec (database, abuf, UNPACK)) != NULL) {
+            if (hash_spec->incomplete)
+                set->incomplete = 1;
+            if (hash_spec->ll_1 != NULL) {
+                LL_ContIterate (hash_spec->ll_1, member) {
+                    convert_toupper(member);
+                    if ((ctx->expand_flag == NO_EXPAND) || !chk_set_name (member))
+                        SL_Add (set, member, 0, ctx->expand_flag, deps, irr);
+                    else /* we have a set name */
+                        LL_Add (ll_subsets, strdup (member));
+                }
             }
-            if (first == 0)
-                break;
+            mbrs_by_ref_set (database, ctx->afi, ctx->expand_flag, set,
+                    name, hash_spec->ll_2, deps, irr);
+            Delete_hash_spec (hash_spec);
+            found = strdup (database->name);
+            break;
         }
-        irr_unlock_all(irr);
-        free (mstr);
     }
-
-    first = 1;
-    dup = 0;
+    /* the nested sets are read under locks of their own, so an update
+     * may come in between: (epoch) keeps the result out of the cache then */
+    irr_unlock_all(irr);
+    free (dbs);
+
+    /* expand the nested sets, on the task pool if there are several */
+    n = ll_subsets->count;
+    tasks = irrd_malloc ((n + 1) * sizeof (expand_task_t));
     i = 0;
-    last_set_name = "";
-    array = g_array_sized_new(FALSE, TRUE, sizeof(char*), ll_setlist->count);
-    LL_ContIterate(ll_setlist, set_name) {
-        g_array_append_val(array, set_name);
+    LL_ContIterate (ll_subsets, member) {
+        tasks[i].task.fn = (void (*) (void *)) expand_task_run;
+        tasks[i].task.arg = &tasks[i];
+        tasks[i].ctx = ctx;
+        tasks[i].irr = irr;
+        tasks[i].name = member;
+        /* seperate the range op from the set name until it is merged */
+        if ((tasks[i].range_op = strchr (member, '^')) != NULL)
+            *tasks[i].range_op = '\0';
+        tasks[i].dbname = found;
+        tasks[i].depth = depth + 1;
+        tasks[i].up = &frame;
+        tasks[i].low = depth;
+        tasks[i].e = NULL;
+        i++;
     }
-    g_array_sort(array, (GCompareFunc)str_p_cmp);
-    i = 0;
-    while (i < ll_setlist->count) {
-        set_name = g_array_index(array, char*, i++);
-        if (!first) {
-            /* since list is sorted, any duplicates should be consecutive */
-            if (strcmp(last_set_name, set_name) == 0)
-                dup = 1;
-            else /* add a space before each item */
-                irr_add_answer(irr, " ");
+    if (n > 1 && IRR.expand_threads > 0) {
+        /* iterating a list moves its cursor, so each thread needs its own */
+        for (i = 0; i < n; i++) {
+            tasks[i].irr = &tasks[i].view;
+            tasks[i].view.ll_database = LL_Create (0);
+            tasks[i].view.batch_locked = irr->batch_locked;
+            LL_ContIterate (irr->ll_database, database)
+                LL_Add (tasks[i].view.ll_database, database);
+            irr_task_submit (&tasks[i].task);
+        }
+        for (i = 0; i < n; i++) {
+            irr_task_wait (&tasks[i].task);
+            LL_Destroy (tasks[i].view.ll_database);
+        }
+    } else {
+        for (i = 0; i < n; i++)
+            expand_task_run (&tasks[i]);
+    }
+
+    for (i = 0; i < n; i++) {
+        if (tasks[i].e != NULL) {
+            if (!ctx->error) {
+                ops = NULL;
+                if (tasks[i].range_op != NULL) {
+                    *tasks[i].range_op = '^';
+                    ops = range_ops_parse (tasks[i].range_op, &ops_buf);
+                }
+                expand_merge (set, deps, tasks[i].e, ops);
+            }
+            irr_expansion_release (tasks[i].e);
         }
-        if (!dup) { /* only print this if not a duplicate */
-            irr_add_answer(irr, "%s", set_name);
-            last_set_name = set_name;
-        } else
-            dup = 0;
-        first = 0;
-    }
-    g_array_free(array, TRUE);
-    irr_send_answer(irr);
-getout:
-    LL_Destroy(ll_setlist);
-    g_hash_table_destroy(hash_member_examined);
-    g_queue_free(stack);
+        if (tasks[i].low < sub_low)
+            sub_low = tasks[i].low;
+    }
+    irrd_free (tasks);
+
+    if (set->failed) {
+        sprintf (abuf, "Out of memory expanding %s", name);
+        expand_error (ctx, abuf);
+    }
+    if (!ctx->error) {
+        e = irr_member_set_freeze (set, deps);
+        if (sub_low < *low)
+            *low = sub_low;
+        if (sub_low >= depth)   /* complete */
+            irr_expand_cache_store (key, e, epoch);
+    }
+    irr_member_set_destroy (set);
+    g_hash_table_destroy (deps);
+    LL_Destroy (ll_subsets);
+    if (found != NULL)
+        free (found);
+    if (e == NULL) {
+        free (key);
+        return NULL;
+    }
+    complete = (sub_low >= depth);
+
+remember:
+    done = irrd_malloc (sizeof (expand_done_t));
+    done->e = e;
+    done->complete = complete;
+    irr_expansion_hold (e);
+    pthread_mutex_lock (&ctx->mutex_lock);
+    g_hash_table_replace (ctx->done, key, done);
+    pthread_mutex_unlock (&ctx->mutex_lock);
+    return e;
 }
 
-void mbrs_by_ref_set (irr_database_t *database, char *range_op, u_short afi,
-        enum EXPAND_TYPE expand_flag, LINKED_LIST *ll_setlist,
-        char *set_name, LINKED_LIST *ll_mbr_by_ref, irr_connection_t *irr)
+void mbrs_by_ref_set (irr_database_t *database, u_short afi,
+        enum EXPAND_TYPE expand_flag, irr_member_set_t *set,
+        char *set_name, LINKED_LIST *ll_mbr_by_ref, GHashTable *deps,
+        irr_connection_t *irr)
 {
     char *member, *maint, key[BUFSIZE];
     hash_spec_t *hash_spec;
@@ -308,7 +507,7 @@ void mbrs_by_ref_set (irr_database_t *database, char *range_op, u_short afi,
 
     if (expand_flag == NO_EXPAND) {
         LL_ContIterate (ll_mbr_by_ref, member) {
-            LL_Add(ll_setlist, strdup (member));
+            irr_member_set_add_name (set, member);
         }
         return;
     }
@@ -319,69 +518,18 @@ void mbrs_by_ref_set (irr_database_t *database, char *range_op, u_short afi,
 
     LL_ContIterate (ll_mbr_by_ref, maint) {
         make_spec_key (key, maint, set_name);
+        expand_dep (deps, key);
         if ((hash_spec = fetch_hash_spec (database, key, UNPACK)) != NULL) {
+            if (hash_spec->incomplete)
+                set->incomplete = 1;
             LL_ContIterate (hash_spec->ll_1, member) {
-                SL_Add (ll_setlist, member, range_op, afi, expand_flag, irr);
+                SL_Add (set, member, afi, expand_flag, deps, irr);
             }
             Delete_hash_spec (hash_spec);
         }
     }
 }
 
-void update_members_list (irr_database_t *database, char *range_op,
-        u_short afi,
-        enum EXPAND_TYPE expand_flag,
-        GHashTable *hash_member_examined,
-        LINKED_LIST *ll_setlist, LINKED_LIST *ll_set_names,
-        GQueue *stack, irr_connection_t *irr) {
-    char *member, *p, *r;
-    char buffer[BUFSIZE], range_buf[512];
-    int len = 0;
-    member_examined_hash_t *member_examined_ptr;
-
-    if (ll_set_names == NULL)
-        return;
-
-    LL_ContIterate (ll_set_names, member) {
-        convert_toupper(member);
-        /* #FIXME The following logic block is a inscrutable and needs documentation */
-        if ((expand_flag == NO_EXPAND) || !chk_set_name (member)) {
-                      SL_Add (ll_setlist, member, range_op, 0, expand_flag, irr);
-        } else { /* we have a set name */
-            if (!g_hash_table_lookup(hash_member_examined, member)) {
-                strcpy(range_buf, " "); /* initialize to empty range */
-                r = member;
-                /* Need to seperate the range op from the set
-                   name for rpsl_macro_expand_add() */
-                if ((p = strchr (member, '^')) != NULL) {
-                    strncpy (buffer, member, p - member);
-                    buffer[p - member] = '\0';
-                    len = strlen(p);
-                    if (len < 512) /* don't overflow buffer */
-                        strcpy(range_buf,p);
-                    r = buffer; /* this is the set name without the range op */
-                }
-                if (range_op != NULL) {   /* append existing range_op */
-                    if ( (len + strlen(range_op)) < 512 ) {
-                        if (p == NULL)
-                            range_buf[0] = '\0';
-                        strcat(range_buf, range_op);
-                    }
-                }
-                p = rpsl_macro_expand_add (range_buf, r, irr, database->name);
-                g_queue_push_head(stack, p);
-                member_examined_ptr = irrd_malloc(sizeof(member_examined_hash_t));
-                member_examined_ptr->key = strdup(r);
-                g_hash_table_insert(hash_member_examined, member_examined_ptr->key, member_examined_ptr);
-            }
-        }
-    }
-} /* void update_members_list() */
-
-/* a list of prefix range types */
-enum PREFIX_RANGE_TYPE {
-    INVALID_RANGE, EXCLUSIVE_RANGE, INCLUSIVE_RANGE, VALUE_RANGE };
-
 enum PREFIX_RANGE_TYPE prefix_range_parse( char *range, unsigned int *start, unsigned int *end ) {
     char *p;
 
@@ -405,55 +553,126 @@ enum PREFIX_RANGE_TYPE prefix_range_parse( char *range, unsigned int *start, uns
 }
 
 /*
- * Sorted and unique linked list add.  *p is the potential item to be added.
- * Also appends a range operator to *p.
- *
+ * Parse (range_op), eg "^+^24", into (ops).  Returns NULL if members
+ * are to be added as they are.
  */
-void SL_Add (LINKED_LIST *ll_setlist, char *member, char *range_op,
-        u_short afi, enum EXPAND_TYPE expand_flag, irr_connection_t *irr)
+range_ops_t *range_ops_parse (char *range_op, range_ops_t *ops)
 {
-    char buffer[BUFSIZE], buf2[BUFSIZE], rangestr[32];
-    char *q, *temp_ptr, *range_ptr;
-    char *last = NULL;
-    unsigned int biggest_range;
-    hash_spec_t *hash_spec;
+    char buffer[BUFSIZE];
+    char *q, *last = NULL;
+
+    if (range_op == NULL)
+        return NULL;
+    if (*range_op != '^') {   /* should start with a '^' */
+        trace (ERROR, default_trace, "SL_Add(): range_op does not start with a '^' : %s\n", range_op);
+        return NULL;
+    }
+    ops->valid = 1;
+    ops->n = 0;
+    strncpy(buffer, range_op + 1, BUFSIZE - 1);
+    buffer[BUFSIZE - 1] = '\0';
+    q = strtok_r(buffer, "^", &last);
+    while (q != NULL && *q != '\0' && ops->n < MAX_RANGE_OPS) {
+        ops->op[ops->n].type = prefix_range_parse(q, &ops->op[ops->n].start,
+                &ops->op[ops->n].end);
+        if (ops->op[ops->n].type == INVALID_RANGE) {
+            trace (ERROR, default_trace, "SL_Add(): range_op is invalid : %s\n", range_op);
+            ops->valid = 0;
+            break;
+        }
+        ops->n++;
+        q = strtok_r(NULL, "^", &last);
+    }
+    if (ops->valid && ops->n == 0)
+        return NULL;
+    return ops;
+}
+
+/*
+ * Apply (ops) to the range of (p), each operator to the result of the
+ * one before.  Returns 0 if the prefix falls out of the range.
+ */
+static int range_ops_apply (irr_member_prefix_t *p, range_ops_t *ops)
+{
+    unsigned int biggest_range, start, end;
+    int i;
+
+    biggest_range = (p->family == AF_INET) ? 32 : 128;
+    for (i = 0; i < ops->n; i++) {
+        if (ops->op[i].type == INCLUSIVE_RANGE) {
+            start = p->lo;
+            end = biggest_range;
+        } else if (ops->op[i].type == EXCLUSIVE_RANGE) {
+            start = p->lo + 1;
+            end = biggest_range;
+        } else {
+            start = ops->op[i].start;
+            end = ops->op[i].end;
+            if (end < p->lo)
+                return 0;  /* apply an less specific range to a more specific one */
+            if (p->lo > start)
+                start = p->lo;
+        }
+        if (start > end || end > 255)
+            return 0; /* specific range exceeds maximum, toss prefix */
+        p->lo = start;
+        p->hi = end;
+    }
+    return 1;
+}
+
+/*
+ * Add the (len) characters of (member) to (set).
+ */
+static void SL_Add_member (irr_member_set_t *set, char *member, int len)
+{
+    irr_member_prefix_t p;
+    char buffer[BUFSIZE];
+
+    if (irr_member_prefix_parse(member, len, &p)) {
+        irr_member_set_add_prefix(set, &p);
+        return;
+    }
+    if (len >= BUFSIZE)
+        len = BUFSIZE - 1;
+    memcpy(buffer, member, len);
+    buffer[len] = '\0';
+    irr_member_set_add_name(set, buffer);
+}
+
+/*
+ * Add (member) to (set), which drops duplicates.  AS numbers in a
+ * route-set expansion are replaced by the route prefixes which list the
+ * AS as their origin.  The spec hash entries read are noted in (deps).
+ */
+void SL_Add (irr_member_set_t *set, char *member, u_short afi,
+        enum EXPAND_TYPE expand_flag, GHashTable *deps, irr_connection_t *irr)
+{
+    char key[BUFSIZE];
+    char *cp, *end, *q;
     irr_database_t *db;
-    unsigned int bitlen;
-    enum  PREFIX_RANGE_TYPE range_op_type, prefix_range_type;
-    unsigned int range_op_start, range_op_end, prefix_range_start, prefix_range_end;
+    u_int len;
 
     /* if performing a route-set expansion, check for AS numbers and lookup
      * route prefixes which list the AS as their origin
      */
     if ( expand_flag == ROUTE_SET_EXPAND && !strncasecmp(member, "AS", 2)) {
-        make_gas_key(buffer, member + 2);
-        make_6as_key(buf2, member + 2);
+        if (afi == AF_INET)
+            make_gas_key(key, member + 2);
+        else if (afi == AF_INET6)
+            make_6as_key(key, member + 2);
+        else
+            return;
+        expand_dep(deps, key);
         LL_ContIterate (irr->ll_database, db) { /* search over all databases */
-            /* first check for IPv4 prefixes */
-            if ((afi == AF_INET) && (hash_spec = fetch_hash_spec(db, buffer, FAST)) != NULL) {
-                if (hash_spec->len1 > 0) {
-                    q = strdup(hash_spec->gas_answer);
-                    temp_ptr = strtok_r(q, " ", &last);
-                    while (temp_ptr != NULL && *temp_ptr != '\0') {
-                        SL_Add(ll_setlist, temp_ptr, range_op, afi, expand_flag, irr);
-                        temp_ptr = strtok_r(NULL, " ", &last);
-                    }
-                    free(q);
-                    Delete_hash_spec(hash_spec);
-                }
-            }
-            /* now check for IPv6 prefixes */
-            if ((afi == AF_INET6) && (hash_spec = fetch_hash_spec(db, buf2, FAST)) != NULL) {
-                if (hash_spec->len1 > 0) {
-                    q = strdup(hash_spec->gas_answer);
-                    temp_ptr = strtok_r(q, " ", &last);
-                    while (temp_ptr != NULL && *temp_ptr != '\0') {
-                        SL_Add(ll_setlist, temp_ptr, range_op, afi, expand_flag, irr);
-                        temp_ptr = strtok_r(NULL, " ", &last);
-                    }
-                    free(q);
-                    Delete_hash_spec(hash_spec);
-                }
+            if ((cp = fetch_gas_answer(db, key, &len)) == NULL)
+                continue;
+            /* the answer is a space separated list of prefixes */
+            for (end = cp + len; cp < end; cp = q + 1) {
+                if ((q = memchr(cp, ' ', end - cp)) == NULL)
+                    q = end;
+                if (q > cp)
+                    SL_Add_member(set, cp, q - cp);
             }
         }
         return;
@@ -466,90 +685,7 @@ void SL_Add (LINKED_LIST *ll_setlist, char *member, char *range_op,
         } else if (strchr(member, ':'))
             return;
     }
-    strcpy (buffer, member);
-    if (range_op == NULL)
-        goto add_member;
-    if (*range_op != '^') {   /* should start with a '^' */
-        trace (ERROR, default_trace, "SL_Add(): range_op does not start with a '^' : %s\n", range_op);
-        goto add_member;
-    }
-    range_ptr = strdup(range_op + 1);
-    q = strtok_r(range_ptr, "^", &last);
-    while (q != NULL && *q != '\0') {
-        range_op_type = prefix_range_parse(q, &range_op_start, &range_op_end);
-        if (range_op_type == INVALID_RANGE) {
-            trace (ERROR, default_trace, "SL_Add(): range_op is invalid : %s\n", range_op);
-            free(range_ptr);
-            return;
-        }
-        /* should have a prefix length to be legal */
-        if ( (temp_ptr = strchr(member, '/')) != NULL )
-            bitlen = atoi(temp_ptr + 1);
-        else {
-            trace (ERROR, default_trace, "SL_Add(): prefix missing: %s\n", member);
-            free(range_ptr);
-            return;
-        }
-
-        if ( *buffer >= '0' && *buffer <= '9' && (strchr(buffer, ':') == NULL) ) /* check if IPv4 addr or IPv6 addr */
-            biggest_range = 32;
-        else
-            biggest_range = 128;
-        if ( (temp_ptr = strchr(buffer, '^')) == NULL ) /* check for range on prefix */
-            prefix_range_start = (prefix_range_end = bitlen);
-        else {
-            prefix_range_type = prefix_range_parse(temp_ptr + 1, &prefix_range_start, &prefix_range_end);
-            if (prefix_range_type == INVALID_RANGE) {
-                trace (ERROR, default_trace, "SL_Add(): prefix range is invalid : %s\n", buffer);
-                free(range_ptr);
-                return;
-            }
-            *temp_ptr = 0;    /* terminate string at range */
-            if (prefix_range_type == EXCLUSIVE_RANGE) {
-                prefix_range_start = bitlen + 1;
-                prefix_range_end = biggest_range;
-            } else if (prefix_range_type == INCLUSIVE_RANGE) {
-                prefix_range_start = bitlen;
-                prefix_range_end = biggest_range;
-            }
-        }
-
-        if (range_op_type == INCLUSIVE_RANGE) {
-            range_op_start = prefix_range_start;
-            range_op_end = biggest_range;
-        } else if (range_op_type == EXCLUSIVE_RANGE) {
-            range_op_start = prefix_range_start + 1;
-            range_op_end = biggest_range;
-        } else if (range_op_type == VALUE_RANGE) {
-            if (range_op_end < prefix_range_start) {
-                free(range_ptr);
-                return;  /* apply an less specific range to a more specific one */
-            }
-            if (prefix_range_start > range_op_start)
-                range_op_start = prefix_range_start;
-        }
-
-        if (range_op_start > range_op_end) {
-            free(range_ptr);
-            return; /* specific range exceeds maximum, toss prefix */
-        }
-        if ( (bitlen == range_op_start) && (bitlen == range_op_end) )
-            strcpy(rangestr,"");
-        else if (range_op_end == range_op_start)
-            sprintf(rangestr,"^%d", range_op_start);
-        else if (range_op_end == biggest_range && range_op_start == bitlen)
-            strcpy(rangestr,"^+");
-        else if (range_op_end == biggest_range && range_op_start == (bitlen + 1))
-            strcpy(rangestr,"^-");
-        else
-            sprintf(rangestr,"^%d-%d",range_op_start, range_op_end);
-        strcat(buffer, rangestr);
-        q = strtok_r(NULL, "^", &last);
-    }
-    free(range_ptr);
-
-add_member:
-    LL_Add(ll_setlist, strdup (buffer));
+    SL_Add_member(set, member, strlen(member));
 }
 
 char *rpsl_macro_expand_add (char *range, char *name, irr_connection_t *irr,
@@ -5,6 +5,8 @@
 
 /* The routines in this file scan/parse the datase.db files */
 
+#include <sys/types.h>
+#include <sys/stat.h>
 #include <stdio.h>
 #include <string.h>
 #include <ctype.h>
@@ -19,8 +21,12 @@
 #include "config_file.h"
 #include "irrd.h"
 
+/* rough size of the .db file per index key, to presize the key index */
+#define SCAN_BYTES_PER_KEY	512
+
 /* local functions */
-static int populate_keyhash (irr_database_t *database);
+static void scan_attribute (char *buffer, enum STATES state,
+			    enum IRR_OBJECTS curr_f, irr_object_t *irr_object);
 static void pick_off_secondary_fields (char *buffer, int curr_f, 
 				       irr_object_t *irr_object);
 void mark_deleted_irr_object (irr_database_t *database, u_long offset);
@@ -32,6 +38,10 @@ int find_blank_line (FILE *fp, char *buf, int buf_size,
 		  u_long *position, u_long *offset);
 int dump_object_check (irr_object_t *object, enum STATES state, u_long mode, 
 		       int update_flag, irr_database_t *db, FILE *fp);
+static void scan_mirror_batch (irr_database_t *database);
+#ifdef HAVE_LIBPTHREAD
+static int scan_irr_file_chunked (FILE *fp, irr_database_t *database);
+#endif /* HAVE_LIBPTHREAD */
 
 /* Note: it is not necessary to define every field, only
  * those fields which irrd needs to recognize.
@@ -80,7 +90,7 @@ key_label_t key_info [] = {
   {"prefix:",       SECONDARY_F, XXX_F},
   {"contact:",      NON_NAME_F, XXX_F},
   {"auth:",         NON_NAME_F, XXX_F},
-  {"roa-status:",   NON_NAME_F, XXX_F},
+  {"roa-status:",   SECONDARY_F, XXX_F},
   /* this should not change, add others before (ie, NO_FIELD row) */
   {"",      NON_NAME_F, XXX_F},
 };
@@ -199,6 +209,7 @@ char *scan_irr_file (irr_database_t *database, char *extension,
 		     int update_flag, FILE *update_fp) {
   FILE *fp = update_fp;
   char file[BUFSIZE], *p;
+  struct stat st;
 
   /* either an update or reading for the first time (a normal .db file) */
   if (update_flag)
@@ -236,20 +247,17 @@ char *scan_irr_file (irr_database_t *database, char *extension,
       return "scan_irr_file () rewind DB error.  Abort reload!";
     }
     database->time_loaded = time (NULL);
+
+    /* size the key index for the whole file before we fill it */
+    if (fstat (fileno (fp), &st) == 0)
+      irr_key_index_reserve (database->key_index,
+			     (u_int) (st.st_size / SCAN_BYTES_PER_KEY));
   }
 
   trace (NORM, default_trace, "Begin loading %s\n", file);
 
   /* open transaction journal */
-  if (database->journal_fd < 0) {
-    char jfile[BUFSIZE];
-
-    make_journal_name (database->name, JOURNAL_NEW, jfile);
-    
-    if ((database->journal_fd = open (jfile, O_RDWR | O_APPEND| O_CREAT, 0664)) < 0)
-      trace (ERROR, default_trace, "scan_irr_file () Could not open "
-	     "journal file %s: (%s)!\n", jfile, strerror (errno));
-  }
+  journal_open (database);
   
   /* if updating, log the serial number in the Journal file */
   if (update_flag)
@@ -281,12 +289,11 @@ void *scan_irr_file_main (FILE *fp, irr_database_t *database,
   enum IRR_OBJECTS curr_f;
   enum STATES save_state, state;
   long lineno = 0;
+  int batch = 0;
 
-  /* init everything */
-  if (update_flag)
-    position = save_offset = offset = (u_long) ftell (fp);
-  else
-    position = save_offset = offset = 0;
+  /* init everything.  a load normally starts at the top of the file, but
+   * may pick up where an index snapshot left off */
+  position = save_offset = offset = (u_long) ftell (fp);
 
   mode       = IRR_NOMODE;
   state      = BLANK_LINE; 
@@ -296,6 +303,17 @@ void *scan_irr_file_main (FILE *fp, irr_database_t *database,
   if (scan_scope == SCAN_FILE)
     database->hash_spec_tmp = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, (GDestroyNotify)Delete_hash_spec);
 
+#ifdef HAVE_LIBPTHREAD
+  /* a load of a big file is parsed on several threads; the scan below
+   * picks up whatever they leave */
+  if (scan_scope == SCAN_FILE && !update_flag && !atomic_trans &&
+      IRR.scan_threads > 1) {
+    if (scan_irr_file_chunked (fp, database))
+      state = DB_EOF;
+    position = save_offset = offset = (u_long) ftell (fp);
+  }
+#endif /* HAVE_LIBPTHREAD */
+
   /* okay, here we go scanning the file */
   while (state != DB_EOF) { /* scan to end of file */
     if ((cp = fgets (buffer, sizeof (buffer), fp)) != NULL) {
@@ -378,30 +396,7 @@ void *scan_irr_file_main (FILE *fp, irr_database_t *database,
     }
 
     if (curr_f != NO_FIELD && (state & (START_F | LINE_CONT)) ) {
-
-      /* if continuation line, attribute value starts at beginning + 1 */
-      if (state == LINE_CONT)
-        cp = buffer + 1; /* Ignore initial whitespace or '+' */
-      else /* skip over attribute name label */
-	cp = buffer + strlen(key_info[curr_f].name);
-
-      /* NAME_F indicates object class name attribute */
-      if (key_info[curr_f].f_type & NAME_F) {
-        whitespace_remove(cp);
-	if (*cp != '\0') { /* class name value may be on a continuation line */
-          if (irr_object->name != NULL) {
- 	    /* Shouldn't have more than one class name attribute */
-            trace (NORM, default_trace, "Warning! Multiple class name attributes: Previous - %s %s,  New - %s %s\n", key_info[irr_object->type].name, irr_object->name, key_info[curr_f].name, cp );
-	  } else {
-	    irr_object->name = strdup (cp);
-	    irr_object->type = curr_f;
-	    irr_object->filter_val = key_info[curr_f].filter_val;
-	  }
-	}
-      } else if (key_info[curr_f].f_type & SECONDARY_F)
-        /* add secondary keys, and store things like origin, nic-hdl, etc.  */
-        pick_off_secondary_fields (cp, curr_f, irr_object);
-
+      scan_attribute (buffer, state, curr_f, irr_object);
       continue;
     }
 
@@ -431,6 +426,14 @@ void *scan_irr_file_main (FILE *fp, irr_database_t *database,
       Delete_IRR_Object (irr_object);
       irr_object = NULL;
       mode = IRR_NOMODE;
+
+      /* a long mirror goes in batches, see scan_mirror_batch () */
+      if (update_flag == 2 && scan_scope == SCAN_FILE && !atomic_trans &&
+	  state != DB_EOF && database->mirror_batch > 0 &&
+	  ++batch >= database->mirror_batch) {
+	scan_mirror_batch (database);
+	batch = 0;
+      }
     }
   } /* while (state != DB_EOF) */
 
@@ -443,6 +446,419 @@ void *scan_irr_file_main (FILE *fp, irr_database_t *database,
   return (void *) p;	/* return error string (if any) */
 }
 
+/* scan_mirror_batch
+ * Commit what a mirror has applied so far and let the queries in before
+ * going on, so a large catch-up does not hold the writer lock for
+ * minutes.  The caller holds irr_update_lock (); the clean lock stays
+ * with us, so no other update, reload or clean can come in between.
+ * The serial number has already moved on with each object.
+ */
+static void scan_mirror_batch (irr_database_t *database) {
+
+  commit_spec_hash (database);
+  g_hash_table_destroy (database->hash_spec_tmp);
+  database->hash_spec_tmp = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, (GDestroyNotify)Delete_hash_spec);
+  fflush (database->db_fp);
+
+  trace (TRACE, default_trace, "(%s) Mirror batch applied, serial now %u\n",
+	 database->name, database->serial_number);
+  irr_unlock (database);
+  irr_lock (database);
+}
+
+#ifdef HAVE_LIBPTHREAD
+
+/* Parallel load of a single .db file.
+ *
+ * The rest of the file is cut at blank lines into chunks of about
+ * SCAN_CHUNK_BYTES.  IRR.scan_threads threads parse the chunks into lists
+ * of objects, each reading the file at its own offset, while the calling
+ * thread indexes the lists in file order.  So the indexes come out just
+ * as the serial scan builds them.  A chunk the threads cannot parse the
+ * way the serial scan would (it has a '*ERROR*' or 'WARNING' line, or a
+ * NUL byte) ends the parallel pass, and scan_irr_file_main () scans from
+ * there on itself.
+ */
+
+#define SCAN_CHUNK_BYTES	(16*1024*1024)
+#define SCAN_CHUNKS_AHEAD	2	/* per thread, parsed but not yet indexed */
+#define SCAN_READ_BUF		(64*1024)
+
+enum CHUNK_STATE {
+  CHUNK_PENDING,
+  CHUNK_PARSED,		/* the objects are ready to index */
+  CHUNK_SERIAL		/* left to the serial scan */
+};
+
+struct scan_chunk {
+  u_long		start;
+  u_long		end;		/* 0 if the chunk runs to EOF */
+  LINKED_LIST		*ll_objects;
+  enum CHUNK_STATE	state;
+};
+
+struct scan_pool {
+  int			fd;
+  struct scan_chunk	*chunks;
+  int			n;
+  int			next;		/* next chunk to parse */
+  int			indexed;	/* chunks indexed so far */
+  int			window;		/* how far parsing may run ahead */
+  int			stop;
+  int			running;
+  pthread_mutex_t	mutex_lock;
+  pthread_cond_t	cond;
+};
+
+/* a private read position in the db file, for chunk_gets () */
+struct chunk_reader {
+  int			fd;
+  u_long		off;		/* file offset of buf[0] */
+  int			pos;
+  int			fill;
+  char			buf[SCAN_READ_BUF];
+};
+
+static void chunk_reader_seek (struct chunk_reader *r, u_long offset) {
+  r->off = offset;
+  r->pos = r->fill = 0;
+}
+
+/* chunk_gets
+ * Read what fgets (s, size, fp) would.  (*len) is set to the number of
+ * bytes read, which is more than strlen (s) if the line has a NUL in it.
+ */
+static char *chunk_gets (char *s, int size, struct chunk_reader *r, int *len) {
+  char *nl = NULL;
+  ssize_t got;
+  int i = 0, n;
+
+  while (i < size - 1 && nl == NULL) {
+    if (r->pos == r->fill) {
+      r->off += r->fill;
+      r->pos = r->fill = 0;
+      if ((got = pread (r->fd, r->buf, sizeof (r->buf), (off_t) r->off)) <= 0)
+	break;
+      r->fill = (int) got;
+    }
+    n = r->fill - r->pos;
+    if (n > size - 1 - i)
+      n = size - 1 - i;
+    if ((nl = memchr (r->buf + r->pos, '\n', n)) != NULL)
+      n = nl - (r->buf + r->pos) + 1;
+    memcpy (s + i, r->buf + r->pos, n);
+    r->pos += n;
+    i += n;
+  }
+
+  s[i] = '\0';
+  *len = i;
+  return ((i > 0) ? s : NULL);
+}
+
+/* scan_chunk_boundary
+ * Find the first place at or past (from) where a chunk can start.  That
+ * is just past a blank line which follows a whole line other than a
+ * comment, as the serial scan is then sure to end the object there.  A
+ * "\n" can also be the tail of a line too long for the scan buffer, or
+ * come after a comment that followed such a line.
+ *
+ * Return:
+ *  the offset, or 0 if the file ends first
+ */
+static u_long scan_chunk_boundary (struct chunk_reader *r, u_long from) {
+  char buf[4096];
+  u_long offset = from;
+  int len, at_bol = 0, whole, prev_whole = 0;
+
+  chunk_reader_seek (r, from);
+  while (chunk_gets (buf, sizeof (buf), r, &len) != NULL) {
+    offset += len;
+
+    /* a line read in one piece, starting where the scan's fgets () does */
+    whole = (at_bol && buf[len - 1] == '\n');
+    if (whole && prev_whole &&
+	((len == 1 && buf[0] == '\n') ||
+	 (len == 2 && buf[0] == '\r' && buf[1] == '\n')))
+      return offset;
+
+    prev_whole = (whole && buf[0] != '#');
+    at_bol = (buf[len - 1] == '\n');
+  }
+
+  return 0;
+}
+
+/* scan_chunk_parse
+ * Parse the objects of (chunk) into chunk->ll_objects the way
+ * scan_irr_file_main () does on a load.
+ *
+ * Return:
+ *  CHUNK_PARSED, or CHUNK_SERIAL if the chunk needs the serial scan
+ */
+static enum CHUNK_STATE scan_chunk_parse (struct scan_chunk *chunk,
+					  struct chunk_reader *r) {
+  char buffer[4096], *cp;
+  u_long offset, position = 0, len = 0;
+  irr_object_t *irr_object = NULL;
+  enum IRR_OBJECTS curr_f = NO_FIELD;
+  enum STATES save_state, state = BLANK_LINE;
+  int n, serial = 0;
+
+  chunk->ll_objects = LL_Create (LL_DestroyFunction, Delete_IRR_Object, 0);
+  chunk_reader_seek (r, chunk->start);
+  offset = chunk->start;
+
+  while (state != DB_EOF && (chunk->end == 0 || offset < chunk->end)) {
+    if ((cp = chunk_gets (buffer, sizeof (buffer), r, &n)) != NULL) {
+      /* the scan counts offsets with strlen () */
+      if (strlen (buffer) != (size_t) n) {
+	serial = 1;
+	break;
+      }
+      position = offset;
+      len = n;
+      offset += len;
+    }
+
+    state = get_state (cp, len, state, &save_state);
+    if (state & (OVRFLW | OVRFLW_END | COMMENT))
+      continue;
+
+    if (state & (DB_EOF | BLANK_LINE))
+      curr_f = NO_FIELD;
+    else if (state != LINE_CONT)
+      curr_f = get_curr_f (buffer);
+
+    if (irr_object == NULL && state == START_F)
+      irr_object = New_IRR_Object (buffer, position, IRR_NOMODE);
+
+    /* these abort a load; the scan logs them */
+    if (curr_f == SYNTAX_ERR || curr_f == WARNING) {
+      serial = 1;
+      break;
+    }
+
+    if (curr_f != NO_FIELD && (state & (START_F | LINE_CONT))) {
+      scan_attribute (buffer, state, curr_f, irr_object);
+      continue;
+    }
+
+    if ((state & (BLANK_LINE | DB_EOF)) && irr_object != NULL) {
+      if (state == DB_EOF)
+	position = offset;
+      irr_object->len = position - irr_object->offset;
+      LL_Add (chunk->ll_objects, irr_object);
+      irr_object = NULL;
+    }
+  }
+
+  /* a chunk ends on an object boundary */
+  if (irr_object != NULL) {
+    Delete_IRR_Object (irr_object);
+    serial = 1;
+  }
+
+  if (serial) {
+    LL_Destroy (chunk->ll_objects);
+    chunk->ll_objects = NULL;
+    return CHUNK_SERIAL;
+  }
+  return CHUNK_PARSED;
+}
+
+static void *scan_chunk_thread (struct scan_pool *pool) {
+  struct chunk_reader *r;
+  enum CHUNK_STATE state;
+  int k;
+
+  r = irrd_malloc (sizeof (struct chunk_reader));
+  r->fd = pool->fd;
+
+  pthread_mutex_lock (&pool->mutex_lock);
+  while (1) {
+    /* don't get too far ahead of the indexing */
+    while (!pool->stop && pool->next < pool->n &&
+	   pool->next >= pool->indexed + pool->window)
+      pthread_cond_wait (&pool->cond, &pool->mutex_lock);
+    if (pool->stop || pool->next == pool->n)
+      break;
+    k = pool->next++;
+    pthread_mutex_unlock (&pool->mutex_lock);
+
+    state = scan_chunk_parse (&pool->chunks[k], r);
+
+    pthread_mutex_lock (&pool->mutex_lock);
+    pool->chunks[k].state = state;
+    pthread_cond_broadcast (&pool->cond);
+  }
+  pool->running--;
+  pthread_cond_broadcast (&pool->cond);
+  pthread_mutex_unlock (&pool->mutex_lock);
+
+  irrd_free (r);
+  mrt_thread_exit ();
+  return (NULL);
+}
+
+/* scan_irr_file_chunked
+ * Index the objects from the current position of (fp) to EOF with
+ * IRR.scan_threads parser threads, if there is enough left of the file
+ * to be worth it.
+ *
+ * Return:
+ *  1 if every object was indexed; (fp) is at EOF
+ *  0 otherwise; (fp) is where the serial scan is to carry on
+ */
+static int scan_irr_file_chunked (FILE *fp, irr_database_t *database) {
+  struct scan_pool pool;
+  struct scan_chunk *chunk;
+  struct chunk_reader *r;
+  struct stat st;
+  irr_object_t *irr_object;
+  u_long start, from, target;
+  int i, k, max;
+
+  start = (u_long) ftell (fp);
+  if (fstat (fileno (fp), &st) < 0 ||
+      (u_long) st.st_size < start + 2 * SCAN_CHUNK_BYTES)
+    return 0;
+  fflush (fp);
+
+  memset (&pool, 0, sizeof (pool));
+  pool.fd = fileno (fp);
+  pool.window = SCAN_CHUNKS_AHEAD * IRR.scan_threads;
+  max = ((u_long) st.st_size - start) / SCAN_CHUNK_BYTES + 1;
+  pool.chunks = irrd_malloc (max * sizeof (struct scan_chunk));
+
+  /* cut the file into chunks */
+  r = irrd_malloc (sizeof (struct chunk_reader));
+  r->fd = pool.fd;
+  for (from = start; ; ) {
+    chunk = &pool.chunks[pool.n++];
+    chunk->start = from;
+    chunk->end = 0;
+    chunk->ll_objects = NULL;
+    chunk->state = CHUNK_PENDING;
+
+    target = from + SCAN_CHUNK_BYTES;
+    if (pool.n == max || target >= (u_long) st.st_size ||
+	(from = scan_chunk_boundary (r, target)) == 0 ||
+	from >= (u_long) st.st_size)
+      break;
+    chunk->end = from;
+  }
+  irrd_free (r);
+
+  if (pool.n < 2) {
+    irrd_free (pool.chunks);
+    return 0;
+  }
+
+  pthread_mutex_init (&pool.mutex_lock, NULL);
+  pthread_cond_init (&pool.cond, NULL);
+
+  for (i = 0; i < IRR.scan_threads; i++) {
+    pthread_mutex_lock (&pool.mutex_lock);
+    pool.running++;
+    pthread_mutex_unlock (&pool.mutex_lock);
+    if (mrt_thread_create ("IRR scan", NULL, 
+			   (thread_fn_t) scan_chunk_thread, &pool) == NULL) {
+      pthread_mutex_lock (&pool.mutex_lock);
+      pool.running--;
+      pthread_mutex_unlock (&pool.mutex_lock);
+      trace (ERROR, default_trace, "scan_irr_file_chunked (): could not "
+	     "start thread %d, continuing with fewer\n", i);
+      break;
+    }
+  }
+
+  /* index the chunks in file order as they come in */
+  for (k = 0; i > 0 && k < pool.n; k++) {
+    pthread_mutex_lock (&pool.mutex_lock);
+    while (pool.chunks[k].state == CHUNK_PENDING)
+      pthread_cond_wait (&pool.cond, &pool.mutex_lock);
+    pthread_mutex_unlock (&pool.mutex_lock);
+
+    if (pool.chunks[k].state == CHUNK_SERIAL)
+      break;
+
+    LL_Iterate (pool.chunks[k].ll_objects, irr_object)
+      build_indexes (fp, database, irr_object, 
+		     irr_object->offset + irr_object->len, 0, "");
+    LL_Destroy (pool.chunks[k].ll_objects);
+    pool.chunks[k].ll_objects = NULL;
+
+    pthread_mutex_lock (&pool.mutex_lock);
+    pool.indexed = k + 1;
+    pthread_cond_broadcast (&pool.cond);
+    pthread_mutex_unlock (&pool.mutex_lock);
+  }
+
+  pthread_mutex_lock (&pool.mutex_lock);
+  pool.stop = 1;
+  pthread_cond_broadcast (&pool.cond);
+  while (pool.running > 0)
+    pthread_cond_wait (&pool.cond, &pool.mutex_lock);
+  pthread_mutex_unlock (&pool.mutex_lock);
+
+  for (k = 0; k < pool.n; k++)
+    if (pool.chunks[k].ll_objects != NULL)
+      LL_Destroy (pool.chunks[k].ll_objects);
+  pthread_mutex_destroy (&pool.mutex_lock);
+  pthread_cond_destroy (&pool.cond);
+
+  if (pool.indexed == pool.n) {
+    trace (NORM, default_trace, "Parsed %s in %d chunks on %d threads\n",
+	   database->name, pool.n, i);
+    fseek (fp, 0L, SEEK_END);
+  }
+  else {
+    if (i > 0)
+      trace (NORM, default_trace, "Parsed %d of %d chunks of %s on %d "
+	     "threads, scanning the rest serially\n", pool.indexed, pool.n,
+	     database->name, i);
+    fseek (fp, (long) pool.chunks[pool.indexed].start, SEEK_SET);
+  }
+
+  irrd_free (pool.chunks);
+  return (pool.indexed == pool.n);
+}
+
+#endif /* HAVE_LIBPTHREAD */
+
+/* scan_attribute
+ * Fold the attribute line in (buffer), or a continuation of it, into
+ * (irr_object): the class name, or a secondary field.
+ */
+static void scan_attribute (char *buffer, enum STATES state, 
+			    enum IRR_OBJECTS curr_f, irr_object_t *irr_object) {
+  char *cp;
+
+  /* if continuation line, attribute value starts at beginning + 1 */
+  if (state == LINE_CONT)
+    cp = buffer + 1; /* Ignore initial whitespace or '+' */
+  else /* skip over attribute name label */
+    cp = buffer + strlen(key_info[curr_f].name);
+
+  /* NAME_F indicates object class name attribute */
+  if (key_info[curr_f].f_type & NAME_F) {
+    whitespace_remove(cp);
+    if (*cp != '\0') { /* class name value may be on a continuation line */
+      if (irr_object->name != NULL) {
+	/* Shouldn't have more than one class name attribute */
+	trace (NORM, default_trace, "Warning! Multiple class name attributes: Previous - %s %s,  New - %s %s\n", key_info[irr_object->type].name, irr_object->name, key_info[curr_f].name, cp );
+      } else {
+	irr_object->name = strdup (cp);
+	irr_object->type = curr_f;
+	irr_object->filter_val = key_info[curr_f].filter_val;
+      }
+    }
+  } else if (key_info[curr_f].f_type & SECONDARY_F)
+    /* add secondary keys, and store things like origin, nic-hdl, etc.  */
+    pick_off_secondary_fields (cp, curr_f, irr_object);
+}
+
 /* pick_off_secondary_fields
  * store some information like as_origin, communities,
  * and secondary indicie keys
@@ -452,6 +868,8 @@ void pick_off_secondary_fields (char *buffer, int curr_f,
 				irr_object_t *irr_object) {
   char *cp = buffer;
   char *tmpptr;
+  char roa_status[BUFSIZE];
+  int maxlen = 0;
  
   switch (curr_f) {
   case ORIGIN:
@@ -473,6 +891,13 @@ void pick_off_secondary_fields (char *buffer, int curr_f,
         irr_object->origin_found = 1;
     }
     break;
+  case ROASTATUS_ATTR:
+    /* "v=1; s=...; m=<maxlen>; ..." on the first line, URIs may follow */
+    snprintf (roa_status, sizeof (roa_status), ":%s", cp);
+    if (get_roamaxlen (roa_status, &maxlen) == 0 && maxlen > 0 &&
+	maxlen <= 128)
+      irr_object->roa_maxlen = maxlen;
+    break;
   case NIC_HDL:
     whitespace_newline_remove(cp);
     irr_object->nic_hdl = strdup (cp);
@@ -867,7 +1292,7 @@ int dump_object_check (irr_object_t *object, enum STATES state, u_long mode,
   return (state);
 }
 
-static int populate_keyhash (irr_database_t *database) {
+int populate_keyhash (irr_database_t *database) {
   int i;
 
   IRR.key_string_hash = g_hash_table_new(g_str_hash, g_str_equal);
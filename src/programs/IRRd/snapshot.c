@@ -0,0 +1,751 @@
+/* Index snapshots.  Building a database's indexes from its .db file
+ * means parsing every object in it, which for a full set of mirrors
+ * takes minutes on each restart.  With irr_index_snapshot configured,
+ * the indexes (key index, radix trees and special hash) are written to
+ * <db>.idx after a full load, reload or dbclean, stamped with the serial
+ * number and with the size, mtime and inode of the .db file.
+ *
+ * At startup irr_snapshot_load () maps the snapshot, checks its version
+ * and checksum and that it still describes the .db file, and rebuilds
+ * the indexes from it.  Updates made since are then caught up from the
+ * journal: an object deleted or replaced by an entry newer than the
+ * snapshot serial is found marked '*xx' in the .db file and loses its
+ * indexes, and the objects appended past the snapshot's end of file are
+ * scanned as on any load.  Anything that does not add up gives -1 and
+ * the caller falls back to a full scan.
+ *
+ * Snapshots are in host byte order; they are a cache, not an
+ * interchange format.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <glib.h>
+
+#include "mrt.h"
+#include "trace.h"
+#include "config_file.h"
+#include "irrd.h"
+
+#define SNAPSHOT_MAGIC		"IRRDIDX"
+#define SNAPSHOT_VERSION	1
+#define SNAPSHOT_BYTE_ORDER	0x01020304
+
+typedef struct _snapshot_hdr_t {
+  char		magic[8];
+  uint32_t	version;
+  uint32_t	byte_order;
+  uint32_t	serial;		/* database serial number when written */
+  uint32_t	crc;		/* of everything past the header */
+  uint64_t	body_len;
+  uint64_t	db_size;	/* the .db file the indexes describe */
+  int64_t	db_mtime;
+  uint64_t	db_dev;
+  uint64_t	db_ino;
+  int64_t	bytes;
+  int32_t	num_objects[IRR_MAX_CLASS_KEYS];
+  uint32_t	keys;		/* number of records in each section */
+  uint32_t	prefixes;
+  uint32_t	specs;
+  uint32_t	unused;
+} snapshot_hdr_t;
+
+/* key index section: uint32 length | key '\0' | uint32 count | records */
+typedef struct _snapshot_key_t {
+  uint64_t	offset;
+  uint32_t	len;
+  u_char	type;
+  u_char	p_or_s;
+  u_char	unused[2];
+} snapshot_key_t;
+
+/* radix sections: u_char family | u_char bitlen | address |
+ * uint32 count | records */
+typedef struct _snapshot_prefix_t {
+  uint64_t	offset;
+  uint32_t	len;
+  uint32_t	origin;
+  uint32_t	type;
+  uint32_t	maxlen;		/* of a ROA, 0 if none */
+} snapshot_prefix_t;
+
+/* special hash section: uint32 length | key '\0' | uint32 length | value */
+
+typedef struct _snapshot_out_t {
+  FILE		*fp;
+  uint32_t	crc;
+  uint64_t	len;
+  int		error;
+} snapshot_out_t;
+
+typedef struct _snapshot_in_t {
+  u_char	*cp;
+  u_char	*end;
+} snapshot_in_t;
+
+static uint32_t crc_table[256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void crc_init (void) {
+  uint32_t c;
+  int i, k;
+
+  for (i = 0; i < 256; i++) {
+    c = (uint32_t) i;
+    for (k = 0; k < 8; k++)
+      c = (c & 1) ? 0xEDB88320U ^ (c >> 1) : c >> 1;
+    crc_table[i] = c;
+  }
+}
+
+static uint32_t crc_update (uint32_t crc, u_char *p, size_t n) {
+
+  crc = ~crc;
+  while (n--)
+    crc = crc_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+  return (~crc);
+}
+
+static void snapshot_name (irr_database_t *database, char *file, int tmp) {
+
+  if (tmp)
+    sprintf (file, "%s/.%s.idx", IRR.database_dir, database->name);
+  else
+    sprintf (file, "%s/%s.idx", IRR.database_dir, database->name);
+}
+
+static void snap_put (snapshot_out_t *out, void *p, size_t n) {
+
+  if (fwrite (p, 1, n, out->fp) != n)
+    out->error = 1;
+  out->crc = crc_update (out->crc, (u_char *) p, n);
+  out->len += n;
+}
+
+static void snap_put_string (snapshot_out_t *out, char *s) {
+  uint32_t len = strlen (s) + 1;
+
+  snap_put (out, &len, sizeof (len));
+  snap_put (out, s, len);
+}
+
+static int snap_get (snapshot_in_t *in, void *p, size_t n) {
+
+  if ((size_t) (in->end - in->cp) < n)
+    return (-1);
+  memcpy (p, in->cp, n);
+  in->cp += n;
+  return (1);
+}
+
+/* snap_get_string
+ * Return a pointer to a '\0' terminated string in the snapshot itself.
+ */
+static char *snap_get_string (snapshot_in_t *in) {
+  uint32_t len;
+  char *s;
+
+  if (snap_get (in, &len, sizeof (len)) < 0 || len == 0 ||
+      (size_t) (in->end - in->cp) < len || in->cp[len - 1] != '\0')
+    return (NULL);
+  s = (char *) in->cp;
+  in->cp += len;
+  return (s);
+}
+
+static u_int snapshot_put_radix (snapshot_out_t *out, radix_tree_t *radix) {
+  radix_node_t *node;
+  irr_prefix_object_t *prefix_object;
+  snapshot_prefix_t rec;
+  uint32_t count;
+  u_char family, bitlen;
+  u_int n = 0;
+
+  memset (&rec, 0, sizeof (rec));
+  RADIX_WALK (radix->head, node) {
+    if (node->data != NULL) {
+      family = (node->prefix->family == AF_INET6) ? 6 : 4;
+      bitlen = node->prefix->bitlen;
+      snap_put (out, &family, 1);
+      snap_put (out, &bitlen, 1);
+      snap_put (out, prefix_touchar (node->prefix), (family == 6) ? 16 : 4);
+
+      count = 0;
+      for (prefix_object = node->data; prefix_object != NULL;
+	   prefix_object = prefix_object->next)
+	count++;
+      snap_put (out, &count, sizeof (count));
+
+      for (prefix_object = node->data; prefix_object != NULL;
+	   prefix_object = prefix_object->next) {
+	rec.offset = prefix_object->offset;
+	rec.len = prefix_object->len;
+	rec.origin = prefix_object->origin;
+	rec.type = prefix_object->type;
+	rec.maxlen = prefix_object->maxlen;
+	snap_put (out, &rec, sizeof (rec));
+      }
+      n++;
+    }
+  } RADIX_WALK_END;
+
+  return (n);
+}
+
+static void snapshot_put_spec (char *key, hash_item_t *hash_item,
+			       snapshot_out_t *out) {
+  uint32_t len = hash_spec_value_len (hash_item->value);
+
+  snap_put_string (out, hash_item->key);
+  snap_put (out, &len, sizeof (len));
+  snap_put (out, hash_item->value, len);
+}
+
+/* irr_snapshot_write
+ * Write the indexes of (database) to <db>.idx.  Takes the read lock, so
+ * updates wait while the snapshot is written but queries do not.
+ *
+ * Return:
+ *  1 if the snapshot was written
+ *  -1 otherwise
+ */
+int irr_snapshot_write (irr_database_t *database) {
+  char file[BUFSIZE], tmp[BUFSIZE];
+  snapshot_hdr_t hdr;
+  snapshot_out_t out;
+  snapshot_key_t rec;
+  irr_key_entry_t *entry;
+  struct stat st;
+  time_t start = time (NULL);
+  u_int pos = 0, count, i;
+  char *key;
+
+  pthread_once (&crc_once, crc_init);
+  snapshot_name (database, file, 0);
+  snapshot_name (database, tmp, 1);
+
+  irr_read_lock (database);
+
+  /* size and mtime have to include anything still buffered */
+  if (database->db_fp == NULL || fflush (database->db_fp) != 0 ||
+      fstat (fileno (database->db_fp), &st) < 0) {
+    irr_read_unlock (database);
+    return (-1);
+  }
+
+  memset (&out, 0, sizeof (out));
+  if ((out.fp = fopen (tmp, "w")) == NULL) {
+    irr_read_unlock (database);
+    trace (ERROR, default_trace, "irr_snapshot_write (): could not open %s "
+	   "(%s)\n", tmp, strerror (errno));
+    return (-1);
+  }
+
+  memset (&hdr, 0, sizeof (hdr));
+  strcpy (hdr.magic, SNAPSHOT_MAGIC);
+  hdr.version = SNAPSHOT_VERSION;
+  hdr.byte_order = SNAPSHOT_BYTE_ORDER;
+  hdr.serial = database->serial_number;
+  hdr.db_size = st.st_size;
+  hdr.db_mtime = st.st_mtime;
+  hdr.db_dev = st.st_dev;
+  hdr.db_ino = st.st_ino;
+  hdr.bytes = database->bytes;
+  for (i = 0; i < IRR_MAX_CLASS_KEYS; i++)
+    hdr.num_objects[i] = database->num_objects[i];
+
+  /* the real header goes in once we know the checksum */
+  if (fwrite (&hdr, sizeof (hdr), 1, out.fp) != 1)
+    out.error = 1;
+
+  memset (&rec, 0, sizeof (rec));
+  while ((key = irr_key_index_next (database->key_index, &pos, &entry,
+				    &count)) != NULL) {
+    snap_put_string (&out, key);
+    snap_put (&out, &count, sizeof (count));
+    for (i = 0; i < count; i++, entry++) {
+      rec.offset = entry->offset;
+      rec.len = entry->len;
+      rec.type = entry->type;
+      rec.p_or_s = entry->p_or_s;
+      snap_put (&out, &rec, sizeof (rec));
+    }
+    hdr.keys++;
+  }
+
+  hdr.prefixes = snapshot_put_radix (&out, database->radix_v4);
+  hdr.prefixes += snapshot_put_radix (&out, database->radix_v6);
+
+  hdr.specs = g_hash_table_size (database->hash_spec);
+  g_hash_table_foreach (database->hash_spec, (GHFunc) snapshot_put_spec, &out);
+
+  irr_read_unlock (database);
+
+  hdr.crc = out.crc;
+  hdr.body_len = out.len;
+  if (fseek (out.fp, 0L, SEEK_SET) < 0 ||
+      fwrite (&hdr, sizeof (hdr), 1, out.fp) != 1 ||
+      fflush (out.fp) != 0 || fsync (fileno (out.fp)) < 0)
+    out.error = 1;
+
+  if (fclose (out.fp) != 0 || out.error || rename (tmp, file) < 0) {
+    trace (ERROR, default_trace, "irr_snapshot_write (): could not write %s "
+	   "(%s)\n", file, strerror (errno));
+    unlink (tmp);
+    return (-1);
+  }
+
+  trace (NORM, default_trace, "Wrote index snapshot %s (serial %u, %lu bytes) "
+	 "in %d seconds\n", file, hdr.serial,
+	 (u_long) (sizeof (hdr) + hdr.body_len), (int) (time (NULL) - start));
+  return (1);
+}
+
+/* irr_snapshot_remove
+ * The .db file was changed behind our back (e.g. an atomic transaction
+ * was rolled back), so the snapshot can no longer be trusted.
+ */
+void irr_snapshot_remove (irr_database_t *database) {
+  char file[BUFSIZE];
+
+  snapshot_name (database, file, 0);
+  if (unlink (file) == 0)
+    trace (NORM, default_trace, "Removed index snapshot %s\n", file);
+}
+
+/* snapshot_reset
+ * Throw away a partly restored set of indexes.
+ */
+static void snapshot_reset (irr_database_t *database) {
+  int i;
+
+  radix_flush (database->radix_v4);
+  radix_flush (database->radix_v6);
+  database->radix_v4 = New_Radix (32);
+  database->radix_v6 = New_Radix (128);
+  irr_key_index_destroy (database->key_index);
+  database->key_index = irr_key_index_new (0);
+  g_hash_table_destroy (database->hash_spec);
+  database->hash_spec = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, (GDestroyNotify)irr_hash_destroy);
+
+  database->bytes = 0;
+  for (i = 0; i < IRR_MAX_CLASS_KEYS; i++)
+    database->num_objects[i] = 0;
+}
+
+/* snapshot_restore
+ * Rebuild the indexes of (database) from the body of a snapshot.
+ */
+static int snapshot_restore (irr_database_t *database, snapshot_hdr_t *hdr,
+			     snapshot_in_t *in) {
+  snapshot_key_t rec;
+  snapshot_prefix_t prec;
+  irr_prefix_object_t *prefix_object, *last;
+  radix_node_t *node;
+  prefix_t *prefix;
+  u_char family, bitlen, addr[16];
+  uint32_t count, len;
+  char *key, *value;
+  u_int i;
+
+  irr_key_index_reserve (database->key_index, hdr->keys);
+  for (i = 0; i < hdr->keys; i++) {
+    if ((key = snap_get_string (in)) == NULL ||
+	snap_get (in, &count, sizeof (count)) < 0)
+      return (-1);
+    while (count-- > 0) {
+      if (snap_get (in, &rec, sizeof (rec)) < 0 ||
+	  irr_key_index_add (database->key_index, key, rec.type, rec.p_or_s,
+			     (u_long) rec.offset, rec.len) < 0)
+	return (-1);
+    }
+  }
+
+  for (i = 0; i < hdr->prefixes; i++) {
+    if (snap_get (in, &family, 1) < 0 || snap_get (in, &bitlen, 1) < 0)
+      return (-1);
+    if (family == 4 && bitlen <= 32) {
+      if (snap_get (in, addr, 4) < 0)
+	return (-1);
+      prefix = New_Prefix (AF_INET, addr, bitlen);
+      node = radix_lookup (database->radix_v4, prefix);
+    }
+    else if (family == 6 && bitlen <= 128) {
+      if (snap_get (in, addr, 16) < 0)
+	return (-1);
+      prefix = New_Prefix (AF_INET6, addr, bitlen);
+      node = radix_lookup (database->radix_v6, prefix);
+    }
+    else
+      return (-1);
+    Deref_Prefix (prefix);
+
+    /* keep the objects in the order they were written */
+    if (node->data != NULL || snap_get (in, &count, sizeof (count)) < 0)
+      return (-1);
+    for (last = NULL; count > 0; count--) {
+      if (snap_get (in, &prec, sizeof (prec)) < 0)
+	return (-1);
+      prefix_object = irrd_malloc(sizeof(irr_prefix_object_t));
+      prefix_object->next    = NULL;
+      prefix_object->offset  = prec.offset;
+      prefix_object->len     = prec.len;
+      prefix_object->origin  = prec.origin;
+      prefix_object->type    = prec.type;
+      prefix_object->maxlen  = prec.maxlen;
+      if (last == NULL)
+	node->data = prefix_object;
+      else
+	last->next = prefix_object;
+      last = prefix_object;
+    }
+  }
+
+  for (i = 0; i < hdr->specs; i++) {
+    if ((key = snap_get_string (in)) == NULL ||
+	snap_get (in, &len, sizeof (len)) < 0 ||
+	(size_t) (in->end - in->cp) < len)
+      return (-1);
+    value = irrd_malloc (len);
+    memcpy (value, in->cp, len);
+    in->cp += len;
+    irr_spec_hash_store (database, key, value);
+  }
+
+  if (in->cp != in->end)
+    return (-1);
+
+  database->bytes = hdr->bytes;
+  for (i = 0; i < IRR_MAX_CLASS_KEYS; i++)
+    database->num_objects[i] = hdr->num_objects[i];
+  return (1);
+}
+
+/* snapshot_load_marked
+ * Parse the object at (offset, len) in the db file which has since been
+ * marked deleted.  mark_deleted_irr_object () overwrote the first three
+ * letters of its class attribute; put them back from key_info [].
+ */
+static irr_object_t *snapshot_load_marked (irr_database_t *database,
+					   enum IRR_OBJECTS type,
+					   u_long offset, u_long len,
+					   FILE *tmp_fp) {
+  irr_object_t *object = NULL;
+  char *buf;
+
+  if (strlen (key_info[type].name) < 3 || (buf = malloc (len)) == NULL)
+    return (NULL);
+
+  if (irr_db_read (database, offset, buf, len) == (int) len) {
+    memcpy (buf, key_info[type].name, 3);
+    rewind (tmp_fp);
+    if (ftruncate (fileno (tmp_fp), 0) == 0 &&
+	fwrite (buf, 1, len, tmp_fp) == len &&
+	fflush (tmp_fp) == 0) {
+      rewind (tmp_fp);
+      object = (irr_object_t *) scan_irr_file_main (tmp_fp, database, 0, SCAN_OBJECT);
+    }
+  }
+  free (buf);
+
+  if (object != NULL) {
+    object->offset = offset;
+    object->len = len;
+  }
+  return (object);
+}
+
+/* snapshot_unindex
+ * (object) is a journal entry newer than the snapshot.  Drop the indexes
+ * of the copies of it the snapshot knows about (offset below (db_size))
+ * which the db file now has marked deleted.
+ *
+ * Return:
+ *  1 if all is well
+ *  -1 if a marked object could not be made sense of
+ */
+static int snapshot_unindex (irr_database_t *database, irr_object_t *object,
+			     u_long db_size, FILE *tmp_fp) {
+  irr_prefix_object_t *prefix_object;
+  irr_key_entry_t *entry, *found = NULL;
+  irr_object_t *stale;
+  radix_node_t *node;
+  prefix_t *prefix;
+  char key[BUFSIZE], mark[3];
+  u_int count = 0, n = 0, i;
+  int ret = 1;
+
+  /* collect the candidates first, unindexing changes what we look at */
+  if (object->type == ROUTE || object->type == ROUTE6 ||
+      object->type == INET6NUM) {
+    prefix = ascii2prefix ((object->type == ROUTE) ? AF_INET : AF_INET6,
+			   object->name);
+    if (prefix == NULL)
+      return (1);
+    node = prefix_search_exact (database, prefix);
+    Deref_Prefix (prefix);
+    if (node == NULL)
+      return (1);
+
+    for (prefix_object = node->data; prefix_object != NULL;
+	 prefix_object = prefix_object->next)
+      count++;
+    found = malloc (count * sizeof (irr_key_entry_t));
+    for (prefix_object = node->data; prefix_object != NULL;
+	 prefix_object = prefix_object->next) {
+      if (prefix_object->type == object->type &&
+	  prefix_object->origin == object->origin) {
+	found[n].offset = prefix_object->offset;
+	found[n++].len = prefix_object->len;
+      }
+    }
+  }
+  else {
+    strncpy (key, object->name, sizeof (key) - 1);
+    key[sizeof (key) - 1] = '\0';
+    convert_toupper (key);
+    if ((entry = irr_key_index_lookup (database->key_index, key, &count)) == NULL)
+      return (1);
+    found = malloc (count * sizeof (irr_key_entry_t));
+    for (i = 0; i < count; i++) {
+      if (entry[i].type == object->type)
+	found[n++] = entry[i];
+    }
+  }
+
+  for (i = 0; i < n && ret > 0; i++) {
+    if (found[i].offset >= db_size ||
+	irr_db_read (database, found[i].offset, mark, 3) != 3 ||
+	memcmp (mark, "*xx", 3))
+      continue;
+
+    stale = snapshot_load_marked (database, object->type, found[i].offset,
+				  found[i].len, tmp_fp);
+    if (stale == NULL || stale->name == NULL || stale->type != object->type ||
+	strcasecmp (stale->name, object->name) ||
+	stale->origin != object->origin) {
+      trace (ERROR, default_trace, "Index snapshot for %s: deleted object "
+	     "at offset %lu is not %s\n", database->name, found[i].offset,
+	     object->name);
+      ret = -1;
+    }
+    else if (unindex_irr_object (database, stale) > 0) {
+      database->num_objects[stale->type]--;
+      database->bytes -= stale->len;
+    }
+    if (stale != NULL)
+      Delete_IRR_Object (stale);
+  }
+
+  free (found);
+  return (ret);
+}
+
+/* snapshot_replay_journal
+ * Unindex the objects deleted or replaced by the entries of one journal
+ * file newer than (serial).  (*last) is set to the newest serial seen.
+ */
+static int snapshot_replay_journal (irr_database_t *database, int journal_ext,
+				    uint32_t serial, u_long db_size,
+				    FILE *tmp_fp, uint32_t *last, int *entries) {
+  char file[BUFSIZE], buf[BUFSIZE];
+  irr_object_t *object;
+  uint32_t sn;
+  FILE *fp;
+  int ret = 1;
+
+  make_journal_name (database->name, journal_ext, file);
+  if ((fp = fopen (file, "r")) == NULL)
+    return (1);
+
+  while (ret > 0 && fgets (buf, sizeof (buf), fp) != NULL) {
+    if (strncmp (buf, "% SERIAL", 8))
+      continue;
+    if (convert_to_32 (buf + 9, &sn) != 1) {
+      ret = -1;
+      break;
+    }
+    if (sn <= serial)
+      continue;
+    *last = sn;
+    (*entries)++;
+
+    /* "ADD" or "DEL", a blank line and then the object */
+    if (fgets (buf, sizeof (buf), fp) == NULL ||
+	fgets (buf, sizeof (buf), fp) == NULL)
+      break;
+    if ((object = (irr_object_t *) scan_irr_file_main (fp, database, 0, SCAN_OBJECT)) == NULL)
+      continue;
+    if (object->name != NULL && object->type != NO_FIELD &&
+	!(database->obj_filter & object->filter_val))
+      ret = snapshot_unindex (database, object, db_size, tmp_fp);
+    Delete_IRR_Object (object);
+  }
+
+  fclose (fp);
+  return (ret);
+}
+
+/* snapshot_replay
+ * Bring indexes restored from a snapshot up to date with the db file.
+ * Return the number of journal entries replayed, or -1.
+ */
+static int snapshot_replay (irr_database_t *database, snapshot_hdr_t *hdr) {
+  uint32_t oldest, last = hdr->serial;
+  struct stat st;
+  FILE *tmp_fp;
+  int entries = 0, ret = 1;
+
+  if (database->serial_number > hdr->serial) {
+    /* the journal has to reach back to the snapshot */
+    if (!find_oldest_serial (database->name, JOURNAL_OLD, &oldest) &&
+	!find_oldest_serial (database->name, JOURNAL_NEW, &oldest))
+      return (-1);
+    if (oldest > hdr->serial + 1) {
+      trace (NORM, default_trace, "Index snapshot for %s: journal starts at "
+	     "serial %u, snapshot is at %u\n", database->name, oldest, hdr->serial);
+      return (-1);
+    }
+
+    if ((tmp_fp = tmpfile ()) == NULL)
+      return (-1);
+    database->hash_spec_tmp = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, (GDestroyNotify)Delete_hash_spec);
+
+    ret = snapshot_replay_journal (database, JOURNAL_OLD, hdr->serial,
+				   hdr->db_size, tmp_fp, &last, &entries);
+    if (ret > 0)
+      ret = snapshot_replay_journal (database, JOURNAL_NEW, hdr->serial,
+				     hdr->db_size, tmp_fp, &last, &entries);
+    if (ret > 0)
+      commit_spec_hash (database);
+
+    g_hash_table_destroy (database->hash_spec_tmp);
+    database->hash_spec_tmp = NULL;
+    fclose (tmp_fp);
+
+    if (ret < 0)
+      return (-1);
+    if (last != database->serial_number) {
+      trace (NORM, default_trace, "Index snapshot for %s: journal ends at "
+	     "serial %u, database is at %u\n", database->name, last,
+	     database->serial_number);
+      return (-1);
+    }
+  }
+
+  /* and pick up the objects added since */
+  if (fstat (fileno (database->db_fp), &st) < 0)
+    return (-1);
+  if ((uint64_t) st.st_size > hdr->db_size) {
+    if (fseek (database->db_fp, (long) hdr->db_size, SEEK_SET) < 0 ||
+	scan_irr_file_main (database->db_fp, database, 0, SCAN_FILE) != NULL)
+      return (-1);
+  }
+
+  return (entries);
+}
+
+/* irr_snapshot_load
+ * Build the indexes of (database) from its index snapshot.  Called with
+ * the update lock held, empty indexes and the serial number read.
+ *
+ * Return:
+ *  1 if the snapshot matched the db file as it is
+ *  2 if journal entries or appended objects had to be replayed
+ *  -1 if there is no usable snapshot; the indexes are left empty
+ */
+int irr_snapshot_load (irr_database_t *database) {
+  char file[BUFSIZE];
+  snapshot_hdr_t hdr;
+  snapshot_in_t in;
+  struct stat st;
+  time_t start = time (NULL);
+  size_t map_len;
+  u_char *addr;
+  int fd, ret;
+
+  snapshot_name (database, file, 0);
+  if ((fd = open (file, O_RDONLY, 0)) < 0)
+    return (-1);
+
+  if (fstat (fd, &st) < 0 || st.st_size < (off_t) sizeof (hdr) ||
+      (addr = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+    close (fd);
+    trace (ERROR, default_trace, "Index snapshot %s unreadable\n", file);
+    return (-1);
+  }
+  close (fd);
+  map_len = st.st_size;
+
+  pthread_once (&crc_once, crc_init);
+  memcpy (&hdr, addr, sizeof (hdr));
+  in.cp = addr + sizeof (hdr);
+  in.end = addr + map_len;
+
+  if (strcmp (hdr.magic, SNAPSHOT_MAGIC) || hdr.version != SNAPSHOT_VERSION ||
+      hdr.byte_order != SNAPSHOT_BYTE_ORDER ||
+      hdr.body_len != (uint64_t) (map_len - sizeof (hdr)) ||
+      hdr.crc != crc_update (0, in.cp, hdr.body_len)) {
+    trace (ERROR, default_trace, "Index snapshot %s is corrupt or from "
+	   "another version, ignoring it\n", file);
+    munmap (addr, map_len);
+    return (-1);
+  }
+
+  /* the snapshot has to be of this db file, and only appended to
+   * since; a dbclean or reload replaces the file */
+  ret = -1;
+  if (database->db_fp == NULL) {
+    char dbfile[BUFSIZE];
+
+    sprintf (dbfile, "%s/%s.db", IRR.database_dir, database->name);
+    database->db_fp = fopen (dbfile, "r+");
+  }
+  if (database->db_fp == NULL || fstat (fileno (database->db_fp), &st) < 0)
+    trace (NORM, default_trace, "Index snapshot %s: no db file\n", file);
+  else if (st.st_dev != (dev_t) hdr.db_dev || st.st_ino != (ino_t) hdr.db_ino ||
+	   (uint64_t) st.st_size < hdr.db_size ||
+	   database->serial_number < hdr.serial)
+    trace (NORM, default_trace, "Index snapshot %s is stale\n", file);
+  else if (database->serial_number == hdr.serial &&
+	   ((uint64_t) st.st_size != hdr.db_size || st.st_mtime != hdr.db_mtime))
+    trace (NORM, default_trace, "Index snapshot %s: db file changed outside "
+	   "of irrd\n", file);
+  else if ((ret = snapshot_restore (database, &hdr, &in)) < 0)
+    trace (ERROR, default_trace, "Index snapshot %s is malformed\n", file);
+  munmap (addr, map_len);
+
+  if (ret < 0) {
+    snapshot_reset (database);
+    return (-1);
+  }
+
+  journal_open (database);
+  if (IRR.key_string_hash == NULL)
+    populate_keyhash (database);
+
+  if ((ret = snapshot_replay (database, &hdr)) < 0) {
+    trace (NORM, default_trace, "Index snapshot %s could not be brought up "
+	   "to date, doing a full load\n", file);
+    snapshot_reset (database);
+    return (-1);
+  }
+
+  database->time_loaded = time (NULL);
+  trace (NORM, default_trace, "Loaded %s from index snapshot (serial %u, "
+	 "%d journal entries replayed) in %d seconds\n", database->name,
+	 hdr.serial, ret, (int) (time (NULL) - start));
+
+  if (ret == 0 && (uint64_t) st.st_size == hdr.db_size)
+    return (1);
+  return (2);
+}
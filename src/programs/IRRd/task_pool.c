@@ -0,0 +1,115 @@
+/* A pool of threads running small tasks for the queries, such as the
+ * nested sets of a !i expansion.
+ *
+ * Tasks go on one shared stack, so the most recently submitted (and
+ * most deeply nested) work is picked up first.  A thread waiting for a
+ * task takes it back if no worker has started on it yet, and otherwise
+ * sleeps until it is done.  It never runs anyone else's tasks: the
+ * waiter may hold database locks (a batch does, see batch.c) which a
+ * task of another connection would try to take again, and with the
+ * writer preferring locks that waits behind a queued writer for good.
+ * A task may still submit and wait for tasks of its own without tying
+ * up the pool, as each waiter runs its own queued tasks, and with no
+ * workers at all everything simply runs in the waiting thread.
+ *
+ * Workers are started on demand, up to IRR.expand_threads.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <glib.h>
+
+#include "mrt.h"
+#include "trace.h"
+#include "config_file.h"
+#include "irrd.h"
+
+enum TASK_STATE { TASK_QUEUED, TASK_RUNNING, TASK_DONE };
+
+static struct {
+  pthread_mutex_t	mutex_lock;
+  pthread_cond_t	cond;		/* a task was queued or finished */
+  GQueue		*queue;		/* queued tasks, newest first */
+  int			workers;
+} task_pool;
+
+void irr_task_pool_init () {
+
+  pthread_mutex_init (&task_pool.mutex_lock, NULL);
+  pthread_cond_init (&task_pool.cond, NULL);
+  task_pool.queue = g_queue_new ();
+}
+
+/* run (task), called and returning with the pool lock held */
+static void task_run_locked (irr_task_t *task) {
+
+  task->state = TASK_RUNNING;
+  pthread_mutex_unlock (&task_pool.mutex_lock);
+  (task->fn) (task->arg);
+  pthread_mutex_lock (&task_pool.mutex_lock);
+  task->state = TASK_DONE;
+  pthread_cond_broadcast (&task_pool.cond);
+}
+
+static void *task_pool_worker (void *arg) {
+  irr_task_t *task;
+  sigset_t set;
+
+  sigemptyset (&set);
+  sigaddset (&set, SIGALRM);
+  sigaddset (&set, SIGHUP);
+  pthread_sigmask (SIG_BLOCK, &set, NULL);
+
+  pthread_mutex_lock (&task_pool.mutex_lock);
+  while (1) {
+    while ((task = g_queue_pop_head (task_pool.queue)) == NULL)
+      pthread_cond_wait (&task_pool.cond, &task_pool.mutex_lock);
+    task_run_locked (task);
+  }
+  /* NOTREACHED */
+  return (NULL);
+}
+
+/* irr_task_submit
+ * Queue (task) to run (task->fn) (task->arg).  The caller must
+ * irr_task_wait () for it.
+ */
+void irr_task_submit (irr_task_t *task) {
+
+  pthread_mutex_lock (&task_pool.mutex_lock);
+#ifdef HAVE_LIBPTHREAD
+  while (task_pool.workers < IRR.expand_threads) {
+    if (mrt_thread_create ("IRR task", NULL,
+			   (thread_fn_t) task_pool_worker, NULL) == NULL) {
+      trace (ERROR, default_trace, "irr_task_submit (): could not start "
+	     "worker %d\n", task_pool.workers);
+      break;
+    }
+    task_pool.workers++;
+  }
+#endif /* HAVE_LIBPTHREAD */
+
+  task->state = TASK_QUEUED;
+  g_queue_push_head (task_pool.queue, task);
+  pthread_cond_broadcast (&task_pool.cond);
+  pthread_mutex_unlock (&task_pool.mutex_lock);
+}
+
+/* irr_task_wait
+ * Return once (task) has run, running it here if no worker has started
+ * on it yet.
+ */
+void irr_task_wait (irr_task_t *task) {
+
+  pthread_mutex_lock (&task_pool.mutex_lock);
+  while (task->state != TASK_DONE) {
+    if (task->state == TASK_QUEUED) {
+      g_queue_remove (task_pool.queue, task);
+      task_run_locked (task);
+    } else
+      pthread_cond_wait (&task_pool.cond, &task_pool.mutex_lock);
+  }
+  pthread_mutex_unlock (&task_pool.mutex_lock);
+}
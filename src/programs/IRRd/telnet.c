@@ -6,6 +6,7 @@
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #ifndef SETPGRP_VOID
 #include <termios.h>
 #endif
@@ -35,11 +36,10 @@
 #define SOCKADDR sockaddr_in
 #endif
 
-static int irr_read_command (irr_connection_t * irr);
 
 /* local yokel's */
 void irr_write_answer  (irr_answer_t *, irr_connection_t *);
-void irr_write_direct (irr_connection_t *irr, FILE *fp, int len);
+void irr_write_direct (irr_connection_t *irr, irr_database_t *db, u_long offset, int len);
 #ifndef HAVE_LIBPTHREAD    
 static int irr_read_command_schedule (irr_connection_t *irr);
 #endif /* HAVE_LIBPTHREAD */
@@ -122,6 +122,7 @@ int irr_accept_connection (int fd) {
   struct SOCKADDR addr;
   irr_connection_t *irr_connection;
   u_int one = 1;
+  struct timeval tv;
   char *ascii_prefix;
   char tmp[BUFSIZE];
   irr_database_t *database; 
@@ -144,6 +145,20 @@ int irr_accept_connection (int fd) {
     close (sockfd);
     return (-1);
   }
+
+  /* select () only says some of an answer can go out, a write of the rest
+   * would block for as long as the client cares to not read it.  Reactor
+   * workers are shared by all connections, so give up on the client
+   * instead (the write fails with EAGAIN). */
+  tv.tv_sec = WRITE_TIMEOUT;
+  tv.tv_usec = 0;
+  if (setsockopt (sockfd, SOL_SOCKET, SO_SNDTIMEO, (char *) &tv,
+		  sizeof (tv)) < 0) {
+    trace (ERROR, default_trace, "setsockopt SO_SNDTIMEO failed (%s)\n",
+	   strerror (errno));
+    close (sockfd);
+    return (-1);
+  }
  
 #ifdef HAVE_IPV6 
   if ((family = addr.sin6_family) == AF_INET) {
@@ -265,6 +280,11 @@ int irr_accept_connection (int fd) {
     trace (ERROR, default_trace, "unlocking -- connection_mutex_lock--: %s\n",
 	   strerror (errno));
 
+  /* the reactor's worker pool serves the connection if it is running,
+   * else the connection gets a thread of its own */
+  if (irr_reactor_add (irr_connection) > 0)
+    return (1);
+
   sprintf (tmp, "IRR %s", ascii_prefix);
   mrt_thread_create (tmp, irr_connection->schedule,
 		     (thread_fn_t) start_irr_connection, irr_connection);
@@ -373,7 +393,7 @@ static int irr_read_command_schedule (irr_connection_t *irr) {
  * and process the buffer. We may, or may not have a command...
  * If we have not processed a command, return 0 (1 otherwise)
  */
-static int irr_read_command (irr_connection_t * irr) {
+int irr_read_command (irr_connection_t * irr) {
   int n, i, state;
   char *cp, *newline, *tmp_ptr;
   int command_found = 0;
@@ -468,6 +488,7 @@ static int irr_read_command (irr_connection_t * irr) {
 int irr_destroy_connection (irr_connection_t * connection) {
   connection_hash_t *connection_hash_item;
   char *ascii_prefix;
+  int reactor;
 
   if (pthread_mutex_lock (&IRR.connections_mutex_lock) != 0)
     trace (ERROR, default_trace, "connection_mutex_lock--: %s\n",
@@ -519,9 +540,18 @@ int irr_destroy_connection (irr_connection_t * connection) {
 
   if (connection->answer != NULL)
     irrd_free(connection->answer);
+  if (connection->spill_fp != NULL)
+    fclose (connection->spill_fp);
+  if (connection->ll_batch != NULL)
+    LL_Destroy (connection->ll_batch);
 
+  reactor = connection->reactor;
   irrd_free(connection);
 
+  /* reactor workers go back to the pool */
+  if (reactor)
+    return (-1);
+
   mrt_thread_exit ();
   /* NOTREACHED */
   return(-1);
@@ -588,34 +618,171 @@ void irr_send_answer (irr_connection_t * irr) {
   irr->answer = NULL;
 }
 
+/* drop the queued answer of a connection that is going away */
+static void irr_write_discard (irr_connection_t *irr) {
+
+  irr->scheduled_for_deletion = 1;
+  if (irr->ll_final_answer != NULL)
+    LL_Destroy (irr->ll_final_answer);
+  irr->ll_final_answer = NULL;
+  irr->final_answer_bytes = 0;
+  if (irr->spill_fp != NULL)
+    fclose (irr->spill_fp);
+  irr->spill_fp = NULL;
+}
+
+/* irr_write_spill
+ * Move the queued answer of (irr) to its spill file.  An answer is never
+ * written to the socket while the databases are locked for reading, or
+ * a slow client would keep the locks and the thread for as long as it
+ * liked.  So while one is built its queue goes to disk each time it
+ * reaches IRR.answer_buffer_size bytes, and irr_write_buffer_flush ()
+ * sends it from there once the locks are released.  Without a spill
+ * file the answer simply stays queued in memory.
+ *
+ * The file costs disk rather than memory, up to IRR_MAX_ANSWER_SPILL
+ * bytes for each connection.  An answer growing past that is given up
+ * and the connection closed, as the client has no way to tell a cut
+ * short answer from a whole one.
+ */
+void irr_write_spill (irr_connection_t *irr) {
+  final_answer_t *final_answer;
+  size_t len;
+
+  if (irr->scheduled_for_deletion || irr->ll_final_answer == NULL)
+    return;
+
+  if (irr->spill_fp == NULL && (irr->spill_fp = tmpfile ()) == NULL) {
+    trace (ERROR, default_trace, "irr_write_spill: tmpfile () failed (%s), "
+	   "answer kept in memory\n", strerror (errno));
+    return;
+  }
+
+  if (ftell (irr->spill_fp) + irr->final_answer_bytes > IRR_MAX_ANSWER_SPILL) {
+    trace (ERROR, default_trace, "irr_write_spill: answer over %ld bytes, "
+	   "dropping the connection\n", IRR_MAX_ANSWER_SPILL);
+    irr_write_discard (irr);
+    return;
+  }
+
+  LL_Iterate (irr->ll_final_answer, final_answer) {
+    len = final_answer->ptr - final_answer->buf;
+    if (fwrite (final_answer->buf, 1, len, irr->spill_fp) != len) {
+      trace (ERROR, default_trace, "irr_write_spill: write error (%s)\n",
+	     strerror (errno));
+      irr_write_discard (irr);
+      return;
+    }
+  }
+  LL_Destroy (irr->ll_final_answer);
+  irr->ll_final_answer = NULL;
+  irr->final_answer_bytes = 0;
+}
+
+/* irr_write_socket
+ * Write (len) bytes at (buf) out to the connection, waiting for the client
+ * for up to WRITE_TIMEOUT seconds at a time.  Returns -1 if the connection
+ * failed.
+ */
+static int irr_write_socket (irr_connection_t *irr, char *buf, int len) {
+  int fd = irr->sockfd;
+  fd_set          write_fds;
+  struct timeval  tv;
+  int n, ret;
+
+  while (len > 0) {
+    FD_ZERO(&write_fds);
+    FD_SET(fd, &write_fds);
+    tv.tv_sec = WRITE_TIMEOUT;
+    tv.tv_usec = 0;
+
+    ret = select (fd + 1, 0, &write_fds, 0, &tv);
+    if (ret <= 0) {
+      if (ret == 0)
+	trace (NORM, default_trace, "select timeout on buffered write\n");
+      else
+	trace (ERROR, default_trace,
+	       "select error on buffered write -- error (%s)\n", strerror (errno));
+      return (-1);
+    }
+
+    if ((n = write (fd, buf, len)) < 0) {
+      trace (ERROR, default_trace, "buffered write error (%s)\n", strerror (errno));
+      return (-1);
+    }
+    buf += n;
+    len -= n;
+  }
+  return (1);
+}
+
+/* send what irr_write_spill () put aside, ahead of what is queued */
+static int irr_write_spill_flush (irr_connection_t *irr) {
+  char buf[BUFSIZE];
+  size_t n;
+
+  rewind (irr->spill_fp);
+  while ((n = fread (buf, 1, BUFSIZE, irr->spill_fp)) > 0) {
+    if (irr_write_socket (irr, buf, (int) n) < 0)
+      return (-1);
+  }
+  if (ferror (irr->spill_fp)) {
+    trace (ERROR, default_trace, "read error on the answer spill file (%s)\n",
+	   strerror (errno));
+    return (-1);
+  }
+  fclose (irr->spill_fp);
+  irr->spill_fp = NULL;
+  return (1);
+}
+
 /* irr_write_buffer_flush
- * Called after we're done itterating through the database building up an answer.
+ * Called after we're done itterating through the database building up an answer
+ * and releasing all the locks.
  * This routine actually writes out to the socket, feeding it final_answer
- * structures built during irr_write
+ * structures built during irr_write, IRR_MAX_IOV at a time with writev ()
  */
 void irr_write_buffer_flush (irr_connection_t *irr) {
-  int n, ret;
+  int n, ret, i, cnt;
   int fd = irr->sockfd;
-  u_char *ptr;
   fd_set          write_fds;
   struct timeval  tv;
+  struct iovec	  iov[IRR_MAX_IOV];
   final_answer_t *final_answer;
 
   /* something happened to the socket at some point -- delete before read */
   if (irr->scheduled_for_deletion)
     return;
 
-  FD_ZERO(&write_fds);
-  FD_SET(fd, &write_fds);
+  /* a batch query's answer is kept until the batch sends it */
+  if (irr->batch_query)
+    return;
 
-  if (irr->ll_final_answer == NULL) return;
+  if (irr->spill_fp != NULL && irr_write_spill_flush (irr) < 0) {
+    irr_write_discard (irr);
+    return;
+  }
+
+  if (irr->ll_final_answer == NULL)
+    return;
 
   /* iterate through all of our linked answers */
-  LL_Iterate (irr->ll_final_answer, final_answer) {
-    ptr = final_answer->buf;
+  final_answer = LL_GetHead (irr->ll_final_answer);
+  while (final_answer != NULL) {
+    for (cnt = 0; final_answer != NULL && cnt < IRR_MAX_IOV;
+	 final_answer = LL_GetNext (irr->ll_final_answer, final_answer)) {
+      if (final_answer->ptr == final_answer->buf)
+	continue;
+      iov[cnt].iov_base = (char *) final_answer->buf;
+      iov[cnt].iov_len = final_answer->ptr - final_answer->buf;
+      cnt++;
+    }
 
-    while (ptr < final_answer->ptr) {
-      tv.tv_sec = 60; /* 60 second timeout on trying to write to socket */
+    i = 0;
+    while (i < cnt) {
+      FD_ZERO(&write_fds);
+      FD_SET(fd, &write_fds);
+      tv.tv_sec = WRITE_TIMEOUT;
       tv.tv_usec = 0;
 
       ret = select (fd + 1, 0, &write_fds, 0, &tv);
@@ -628,23 +795,35 @@ void irr_write_buffer_flush (irr_connection_t *irr) {
 	irr->scheduled_for_deletion = 1;
 	LL_Destroy (irr->ll_final_answer);
 	irr->ll_final_answer = NULL;
+	irr->final_answer_bytes = 0;
 	return;
       }
 
-      if ((n = write (fd, ptr, final_answer->ptr - ptr)) < 0) {
+      if ((n = writev (fd, &iov[i], cnt - i)) < 0) {
 	trace (ERROR, default_trace, "buffered write error (%s)\n", strerror (errno));
 	irr->scheduled_for_deletion = 1;
 	LL_Destroy (irr->ll_final_answer);
 	irr->ll_final_answer = NULL;
+	irr->final_answer_bytes = 0;
 	return;
       }
-      ptr += n;
+
+      /* step over what went out, a short write leaves us mid-segment */
+      while (i < cnt && n >= iov[i].iov_len) {
+	n -= iov[i].iov_len;
+	i++;
+      }
+      if (i < cnt) {
+	iov[i].iov_base = (char *) iov[i].iov_base + n;
+	iov[i].iov_len -= n;
+      }
     }
   }
 
-  /* free ll_final_answer structs!!!! Need to write a destroy routine */
+  /* free ll_final_answer structs */
   LL_Destroy (irr->ll_final_answer);
   irr->ll_final_answer = NULL;
+  irr->final_answer_bytes = 0;
   return;
 }
 
@@ -663,11 +842,17 @@ void irr_write_nobuffer (irr_connection_t *irr, char *buf) {
   if (irr->scheduled_for_deletion)
     return;
 
+  /* keep it in order with the rest of a batch query's answer */
+  if (irr->batch_query) {
+    irr_write (irr, buf, len);
+    return;
+  }
+
   FD_ZERO(&write_fds);
   FD_SET(fd, &write_fds);
 
   while ((ptr - buf) < len) {
-    tv.tv_sec = 60; /* 60 second timeout on trying to write to socket */
+    tv.tv_sec = WRITE_TIMEOUT;
     tv.tv_usec = 0;
 
     ret = select (fd + 1, 0, &write_fds, 0, &tv);
@@ -692,37 +877,104 @@ void irr_write_nobuffer (irr_connection_t *irr, char *buf) {
 }
 
 void delete_final_answer (final_answer_t *tmp) {
-  irrd_free(tmp->buf);
+  if (tmp->shared != NULL)
+    irr_shared_block_release (tmp->shared);
+  else
+    irrd_free(tmp->buf);
   irrd_free(tmp);
 }
 
+/* irr_write_stream
+ * While an answer is streamed, put what is queued aside once it reaches
+ * IRR.answer_buffer_size bytes, so a connection never holds much more
+ * than that in memory however big the answer.  The answer is built
+ * under the read locks, it goes to the client after they are released.
+ */
+static void irr_write_stream (irr_connection_t *irr) {
+
+  if (irr->stream_answer && !irr->batch_query &&
+      IRR.answer_buffer_size > 0 &&
+      irr->final_answer_bytes >= IRR.answer_buffer_size)
+    irr_write_spill (irr);
+}
+
+/* final_answer_room
+ * Return the final_answer buffer to copy the next part of an answer into,
+ * adding a new one when the tail is full or references a shared block.
+ * (*room) is set to the space left in it.
+ */
+static final_answer_t *final_answer_room (irr_connection_t *irr, int *room) {
+  final_answer_t *final_answer;
+
+  if (irr->ll_final_answer == NULL) /* check if first time */
+    irr->ll_final_answer = LL_Create (LL_DestroyFunction, delete_final_answer, 0);
+  else if ((final_answer = LL_GetTail (irr->ll_final_answer)) != NULL &&
+	   final_answer->shared == NULL &&
+	   (*room = IRR_ANSWER_BLOCK_SIZE - (final_answer->ptr - final_answer->buf)) > 0)
+    return (final_answer);
+
+  /* no room, we need to add another one */
+  final_answer = irrd_malloc(sizeof(final_answer_t));
+  final_answer->buf = final_answer->ptr = irrd_malloc(IRR_ANSWER_BLOCK_SIZE);
+  final_answer->shared = NULL;
+  LL_Add (irr->ll_final_answer, final_answer);
+  *room = IRR_ANSWER_BLOCK_SIZE;
+  return (final_answer);
+}
+
+/* irr_shared_block_release
+ * Drop a reference to (block), freeing it with the last one.
+ */
+void irr_shared_block_release (irr_shared_block_t *block) {
+
+  if (g_atomic_int_dec_and_test (&block->ref_count)) {
+    irrd_free (block->addr);
+    irrd_free (block);
+  }
+}
+
+/* irr_write_shared
+ * Queue the whole of (block) without copying it.  The answer takes over
+ * the caller's reference to (block) and drops it once the bytes are
+ * written out, so (block) must not change while it is referenced.
+ */
+void irr_write_shared (irr_connection_t *irr, irr_shared_block_t *block) {
+  final_answer_t *final_answer;
+
+  if (irr->scheduled_for_deletion || block->len == 0) {
+    irr_shared_block_release (block);
+    return;
+  }
+
+  if (irr->ll_final_answer == NULL)
+    irr->ll_final_answer = LL_Create (LL_DestroyFunction, delete_final_answer, 0);
+  final_answer = irrd_malloc(sizeof(final_answer_t));
+  final_answer->buf = (u_char *) block->addr;
+  final_answer->ptr = final_answer->buf + block->len;
+  final_answer->shared = block;
+  LL_Add (irr->ll_final_answer, final_answer);
+  irr->final_answer_bytes += block->len;
+  irr_write_stream (irr);
+}
+
 /* irr_write_direct
- * copy direct from disk to memory buffers in a linked_list hung off the  
- * irr_connection structure.
+ * copy direct from the db file mapping to memory buffers in a linked_list
+ * hung off the irr_connection structure.
  * We later call irr_write_buffer_flush after we finish gathering answer
- * and releasing all the locks
+ * and releasing all the locks.  The bytes are always copied: the mapping
+ * is shared with the file, which updates and rollbacks rewrite in place
+ * once the locks are released.
  */
-void irr_write_direct (irr_connection_t *irr, FILE *fp, int len) {
-  int bytes, n = 0, read = 0;
+void irr_write_direct (irr_connection_t *irr, irr_database_t *db, u_long offset, int len) {
+  int bytes, n, read = 0;
   final_answer_t *final_answer;
 
-  while (read < len) {
-    if (irr->ll_final_answer == NULL) { /* check if first time */
-      irr->ll_final_answer = LL_Create (LL_DestroyFunction, delete_final_answer, 0);
-      final_answer = NULL;
-    } else {
-      final_answer = LL_GetTail (irr->ll_final_answer);
-      if (final_answer != NULL)
-        n = 4096 - (final_answer->ptr - final_answer->buf);
-    }
+  /* the connection is going away, don't pile up output for it */
+  if (irr->scheduled_for_deletion)
+    return;
 
-    /* no room, we need to add another one */
-    if (final_answer == NULL || n == 0) {
-      final_answer = irrd_malloc(sizeof(final_answer_t));
-      final_answer->buf = final_answer->ptr = malloc (4096); 
-      LL_Add (irr->ll_final_answer, final_answer);
-      n = 4096;
-    }
+  while (read < len) {
+    final_answer = final_answer_room (irr, &n);
 
     /* write either all thats left, or as much room as left in buffer */
     if (n < (len - read)) 
@@ -730,9 +982,17 @@ void irr_write_direct (irr_connection_t *irr, FILE *fp, int len) {
     else
       bytes = len - read;
 
-    (void)fread(final_answer->ptr, 1, bytes, fp);
+    /* a short read leaves a hole in an answer whose length has already
+     * gone out, there is no way to patch it up for the client */
+    if (irr_db_read (db, offset + read, final_answer->ptr, bytes) != bytes) {
+      trace (ERROR, default_trace, "irr_write_direct: short read of %s at "
+	     "%lu (%s)\n", db->name, offset + read, strerror (errno));
+      irr_write_discard (irr);
+      return;
+    }
     read += bytes;
     final_answer->ptr += bytes;
+    irr->final_answer_bytes += bytes;
 #if OPT_POSTGRES
     /* Add geoidx hook; someday this will be a proper database and joins will do this */
     /* Someday (sooner, I hope) this will support > 1 geoidx */
@@ -786,6 +1046,7 @@ void irr_write_direct (irr_connection_t *irr, FILE *fp, int len) {
     }
 #endif
   }
+  irr_write_stream (irr);
   return;
 }
 
@@ -796,29 +1057,18 @@ void irr_write_direct (irr_connection_t *irr, FILE *fp, int len) {
  * and releasing all the locks
  */
 void irr_write (irr_connection_t *irr, char *buf, int len) {
-  int bytes, n = 0;
+  int bytes, n;
   char *ptr;
   final_answer_t *final_answer;
 
   ptr = buf;
+
+  /* the connection is going away, don't pile up output for it */
+  if (irr->scheduled_for_deletion)
+    return;
   
   while ((ptr - buf) < len) {
-    if (irr->ll_final_answer == NULL) { /* check if ll_final_answer initialized */
-      irr->ll_final_answer = LL_Create (LL_DestroyFunction, delete_final_answer, 0);
-      final_answer = NULL;
-    } else {
-      final_answer = LL_GetTail (irr->ll_final_answer);
-      if (final_answer != NULL)
-        n = 4096 - (final_answer->ptr - final_answer->buf);
-    }
-
-    /* no room, we need to add another one */
-    if (final_answer == NULL || n == 0) {
-      final_answer = irrd_malloc(sizeof(final_answer_t));
-      final_answer->buf = final_answer->ptr = malloc (4096); 
-      LL_Add (irr->ll_final_answer, final_answer);
-      n = 4096;
-    }
+    final_answer = final_answer_room (irr, &n);
 
     /* write either all thats left, or as much room as left in buffer */
     if (n < (len - (ptr-buf))) 
@@ -830,6 +1080,8 @@ void irr_write (irr_connection_t *irr, char *buf, int len) {
     ptr += bytes;
     final_answer->ptr += bytes;
   }
+  irr->final_answer_bytes += len;
+  irr_write_stream (irr);
   return;
 }
 
@@ -890,6 +1142,10 @@ void send_dbobjs_answer (irr_connection_t *irr, enum INDEX_T index, int mode) {
     return;
   }
 
+  /* the size is known up front, so the objects can go out as they are
+   * read rather than all at once when the answer is complete */
+  irr->stream_answer = 1;
+
   if (mode == RAWHOISD_MODE) {
     /* # of bytes in answer */
     sprintf (buffer, "A%d\n", (int) answer_size);
@@ -923,63 +1179,47 @@ void send_dbobjs_answer (irr_connection_t *irr, enum INDEX_T index, int mode) {
     irr_write (irr, "C\n", 2);
   else if (irr->stay_open == 1) /* irrtoolset wants two null lines after RIPE-style queries */
     irr_write (irr, "\n\n", 2);
+  irr->stream_answer = 0;
 
   trace (NORM, default_trace, "Sent %d bytes\n", answer_size);  
 
 } /* end send_dbobjs_answer() */
 
-void irr_write_answer (irr_answer_t *irr_answer, irr_connection_t *irr) {
-  int show_keyfields_only = irr->ripe_flags & KEYFIELDS_ONLY;
-  int gen_roa_status = irr->ripe_flags & ROA_STATUS;
-  int hide_cryptpw = 0, roamaxlen = -1;
-  u_long len;
+/* irr_write_roa_uri
+ * Write out the continuation lines (URIs) of the roa-status attribute
+ * of the ROA object (roa_obj).
+ */
+static void irr_write_roa_uri (irr_connection_t *irr,
+			       irr_prefix_object_t *roa_obj) {
+  u_long offset = roa_obj->offset;
   char buf[BUFSIZE];
-  char outbuf[BUFSIZE];
-
-  if (gen_roa_status && irr_answer->roa_obj) {
-    char *cp;
-    enum STATES state  = BLANK_LINE, save_state;
-    int curr_f = NO_FIELD;
-    int loop_exit = 0;
+  enum STATES state = BLANK_LINE, save_state;
+  int curr_f = NO_FIELD;
+  char *cp;
 
-    if (fseek (IRR.roa_database->db_fp, irr_answer->roa_obj->offset, SEEK_SET) < 0) {
-      trace (ERROR, default_trace, "fseek failed in roa_database\n");
-      return;
+  while ((cp = irr_db_gets (buf, BUFSIZE, IRR.roa_database, &offset)) != NULL) {
+    if (curr_f == ROASTATUS_ATTR &&
+	(*cp == ' ' || *cp == '\t' || *cp == '+')) {
+      irr_write (irr, buf, strlen (buf));
+      continue;
     }
-    do {
-      cp = fgets(buf, BUFSIZE, IRR.roa_database->db_fp);
-      len = strlen(buf);
-      strcpy(outbuf,buf);	/* need a copy because get_state may
-				   modify our string */
-      state = get_state (cp, len, state, &save_state);
-      switch (state) {
-        case START_F:
-          curr_f = get_curr_f (buf);
-	case LINE_CONT:
-          if (curr_f == ROASTATUS_ATTR) {
-            if (get_roamaxlen(outbuf,&roamaxlen) < 0) {
-	      irr_write_nobuffer(irr, "%% Internal error. ROA maxlen.\n");
-    	      trace (ERROR, default_trace, "error getting maxlen\n");
-	      return;
-	     } else
-	      loop_exit = 1;	/* we've got our maxlen field */
-	  }
-	  break;
-	case BLANK_LINE:
-	case DB_EOF:
-	  loop_exit = 1;
-	  break;
-        default:
-          break;
-      }
-    } while (!loop_exit);
+    if (curr_f == ROASTATUS_ATTR)
+      break;
+    state = get_state (cp, strlen (buf), state, &save_state);
+    if (state == BLANK_LINE || state == DB_EOF)
+      break;
+    if (state == START_F)
+      curr_f = get_curr_f (buf);
   }
+}
 
-  if (fseek (irr_answer->db->db_fp, irr_answer->offset, SEEK_SET) < 0) {
-    trace (ERROR, default_trace, "fseek failed in irr_write_answer\n");
-    irr_write_nobuffer(irr, "%% Internal error. fseek\n");
-    return;
-  }
+void irr_write_answer (irr_answer_t *irr_answer, irr_connection_t *irr) {
+  int show_keyfields_only = irr->ripe_flags & KEYFIELDS_ONLY;
+  int gen_roa_status = irr->ripe_flags & ROA_STATUS;
+  int hide_cryptpw = 0;
+  u_long len, offset;
+  char buf[BUFSIZE];
+  char outbuf[BUFSIZE];
 
   if  (irr_answer->type == MNTNER && irr_answer->db->cryptpw_access_list != 0 &&
     !apply_access_list(irr_answer->db->cryptpw_access_list, irr->from) )
@@ -994,8 +1234,9 @@ void irr_write_answer (irr_answer_t *irr_answer, irr_connection_t *irr) {
     if (irr_answer->len == 0)
       return;  /* Shouldn't happen, but check anyway */
 
+    offset = irr_answer->offset;
     do {
-      cp = fgets(buf, BUFSIZE, irr_answer->db->db_fp);
+      cp = irr_db_gets(buf, BUFSIZE, irr_answer->db, &offset);
       len = strlen(buf);
       strcpy(outbuf,buf);	/* need a copy because get_state may
 				   modify our string */
@@ -1016,27 +1257,15 @@ void irr_write_answer (irr_answer_t *irr_answer, irr_connection_t *irr) {
             irr_write (irr, outbuf, len);
 	  }
           if (gen_roa_status && curr_f == ORIGIN) {
-  	    enum OBJ_ROASTATUS roastatus = ROA_INVALID;
-
-	    if (roamaxlen == -1) { /* no ROA max length specified */
-	      if (!irr_answer->roa_obj) { /* no ROA found at all */
-		roastatus = ROA_UNKNOWN;
-	      } else if (irr_answer->prefix_bitlen == irr_answer->roa_bitlen && irr_answer->prefix_obj->origin == irr_answer->roa_obj->origin) {
-		roastatus = ROA_VALID;
-	      } else
-		roastatus = ROA_INVALID;
-	    } else {	/* ROA max length field preset, must check */
-	      if (irr_answer->prefix_obj->origin == irr_answer->roa_obj->origin
-		  && irr_answer->prefix_bitlen >= irr_answer->roa_bitlen
-		  && irr_answer->prefix_bitlen <= roamaxlen) {
-		roastatus = ROA_VALID;
-	      } else
-		roastatus = ROA_INVALID;
-	    }
+	    /* validated against the ROAs when the answer was built */
+  	    enum OBJ_ROASTATUS roastatus = ROA_UNKNOWN;
+
+	    if (irr_answer->prefix_obj != NULL)
+	      roastatus = irr_answer->roa_status;
 	    switch (roastatus) {
 	      case ROA_VALID:
-		if (roamaxlen != -1) {
-		  sprintf(outbuf, "roa-status: v=1; s=valid; m=%d; ",roamaxlen);
+		if (irr_answer->roa_maxlen != -1) {
+		  sprintf(outbuf, "roa-status: v=1; s=valid; m=%d; ", irr_answer->roa_maxlen);
 		} else {
 		  strcpy (outbuf, "roa-status: v=1; s=valid; ");
 		}
@@ -1050,17 +1279,8 @@ void irr_write_answer (irr_answer_t *irr_answer, irr_connection_t *irr) {
 	    }
 	    strcat (outbuf, IRR.roa_timebuffer);
 	    irr_write(irr, outbuf, strlen(outbuf));
-	    if (irr->ripe_flags & ROA_URI && (roastatus == ROA_VALID || roastatus == ROA_INVALID)) {
-	      do {
-	        cp = fgets(outbuf, BUFSIZE, IRR.roa_database->db_fp);
-	        if (cp == NULL)
-		  break;
-	        if (*cp == ' ' || *cp == '\t' || *cp == '+' )
-	          irr_write(irr, outbuf, strlen(outbuf));
-		else
-		  break;
-	      } while (TRUE);
-	    }
+	    if (irr->ripe_flags & ROA_URI && irr_answer->roa_obj != NULL)
+	      irr_write_roa_uri (irr, irr_answer->roa_obj);
 	  }
 	  break;
 	case BLANK_LINE:
@@ -1074,7 +1294,7 @@ void irr_write_answer (irr_answer_t *irr_answer, irr_connection_t *irr) {
       }
     } while (!loop_exit);
   } else {
-    irr_write_direct (irr, irr_answer->db->db_fp, irr_answer->len);      
+    irr_write_direct (irr, irr_answer->db, irr_answer->offset, irr_answer->len);      
   }
 }
 
@@ -1101,7 +1321,7 @@ void irr_build_prefix_answer (irr_connection_t *irr, irr_database_t *database, i
 } /* end irr_build_prefix_answer() */
 
 /* build a query answer referencing on-disk prefix type objects */
-void irr_build_roa_answer (irr_connection_t *irr, irr_database_t *database, irr_prefix_object_t *prefix_object, u_short bitlen, radix_node_t *roa_node) {
+void irr_build_roa_answer (irr_connection_t *irr, irr_database_t *database, irr_prefix_object_t *prefix_object, prefix_t *prefix) {
   irr_answer_t *irr_answer;
 
   irr_answer = irrd_malloc(sizeof(irr_answer_t));
@@ -1109,9 +1329,11 @@ void irr_build_roa_answer (irr_connection_t *irr, irr_database_t *database, irr_
   irr_answer->len = prefix_object->len;
   irr_answer->offset = prefix_object->offset;
   irr_answer->prefix_obj = prefix_object;
-  irr_answer->roa_obj = roa_node->data;
-  irr_answer->prefix_bitlen = bitlen;
-  irr_answer->roa_bitlen = roa_node->prefix->bitlen;
+  irr_answer->roa_status = irr_roa_validate (prefix, prefix_object->origin,
+					     &irr_answer->roa_obj);
+  irr_answer->roa_maxlen = -1;
+  if (irr_answer->roa_status == ROA_VALID && irr_answer->roa_obj->maxlen != 0)
+    irr_answer->roa_maxlen = irr_answer->roa_obj->maxlen;
   LL_Add (irr->ll_answer, irr_answer);
 } /* end irr_build_roa_answer() */
 
@@ -1134,8 +1356,12 @@ void show_connections (uii_connection_t *uii) {
   irr_connection_t *connection;
   int i = 1;
 
-  uii_add_bulk_output (uii, "Currently %d connection(s) [MAX %d]\r\n\r\n",
+  uii_add_bulk_output (uii, "Currently %d connection(s) [MAX %d]\r\n",
 		       IRR.connections, IRR.max_connections);
+  if (IRR.reactor_workers > 0)
+    uii_add_bulk_output (uii, "Served by %d worker threads\r\n",
+			 IRR.reactor_workers);
+  uii_add_bulk_output (uii, "\r\n");
 
   if (pthread_mutex_lock (&IRR.connections_mutex_lock) != 0)
     trace (ERROR, default_trace, "Error locking -- connection_mutex_lock--: %s\n",
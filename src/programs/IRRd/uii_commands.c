@@ -149,7 +149,8 @@ void show_database (uii_connection_t *uii) {
       else {
 	strftime (tmpt, BUFSIZE, "%T %m/%d/%Y", 
 		  localtime_r ((time_t *) &database->time_loaded, &my_tm));
-	uii_add_bulk_output (uii, "   Last loaded %s\r\n", tmpt);
+	uii_add_bulk_output (uii, "   Last loaded %s in %lu.%03lu seconds\r\n", tmpt,
+			     database->load_msecs / 1000, database->load_msecs % 1000);
       }
     } 
 
@@ -167,7 +168,24 @@ void show_database (uii_connection_t *uii) {
       uii_add_bulk_output (uii, "   Next dbclean in %s\r\n", buf);
     }
 
+    uii_add_bulk_output (uii, "   Locks: %d read (%d contended), %d write (%d contended)\r\n",
+			 g_atomic_int_get (&database->read_locks),
+			 g_atomic_int_get (&database->read_locks_contended),
+			 g_atomic_int_get (&database->write_locks),
+			 g_atomic_int_get (&database->write_locks_contended));
+
+    irr_read_lock (database);
+    uii_add_bulk_output (uii, "   Key index: %u keys, %lu entries, %lu bytes "
+			 "(%lu bytes of removed keys)\r\n",
+			 database->key_index->keys, database->key_index->entries,
+			 irr_key_index_bytes (database->key_index),
+			 database->key_index->dead_bytes);
+    irr_read_unlock (database);
+
   }
+  show_gas_cache (uii);
+  show_expand_cache (uii);
+  show_mirror_cache (uii);
   uii_send_bulk_data (uii);
 }
 
@@ -177,7 +195,10 @@ void show_database (uii_connection_t *uii) {
  */
 void uii_irr_reload (uii_connection_t *uii, char *name) {
   if (name != NULL) {
-    irr_reload_database (name, uii, NULL);
+    if (!strcasecmp (name, "all") && find_database (name) == NULL)
+      irr_reload_all (uii);
+    else
+      irr_reload_database (name, uii, NULL);
     irrd_free(name);
   }
 }
@@ -515,9 +536,7 @@ void uii_fetch_irr_object (uii_connection_t *uii,
   size_t len;
   int continue_line = 0;
   
-  fseek (database->db_fp, offset, SEEK_SET);
-    
-  while (fgets (buffer, BUFSIZE, database->db_fp) != NULL) {
+  while (irr_db_gets (buffer, BUFSIZE, database, &offset) != NULL) {
     len = strlen(buffer);
     if (len == 1 && !continue_line) break; /* single newline is end of obj */
     if (buffer[len - 1] != '\n') { /* line length exceeds buffer */
@@ -538,7 +557,7 @@ void uii_show_ip_exact (uii_connection_t *uii, prefix_t *prefix) {
   int first = 1;
 
   LL_Iterate (IRR.ll_database, database) {
-    irr_lock (database);
+    irr_read_lock (database);
 
     node = prefix_search_exact (database, prefix);
 
@@ -551,7 +570,7 @@ void uii_show_ip_exact (uii_connection_t *uii, prefix_t *prefix) {
 	prefix_object = prefix_object->next;
       }
     }
-    irr_unlock (database);
+    irr_read_unlock (database);
   }    
   uii_send_bulk_data (uii);
 }
@@ -564,7 +583,7 @@ void uii_show_ip_less (uii_connection_t *uii, prefix_t *prefix, int flag) {
   int first = 1;
 
   LL_Iterate (IRR.ll_database, database) {
-    irr_lock (database);
+    irr_read_lock (database);
     
     tmp_prefix = prefix;
 
@@ -594,7 +613,7 @@ void uii_show_ip_less (uii_connection_t *uii, prefix_t *prefix, int flag) {
       /* break out after one loop for "l" case */
       if (flag == 0) break; 
     }
-    irr_unlock (database);
+    irr_read_unlock (database);
   }
   uii_send_bulk_data (uii);
 }
@@ -608,7 +627,7 @@ void uii_show_ip_more (uii_connection_t *uii, prefix_t *prefix) {
   int first = 1;
 
   LL_Iterate (IRR.ll_database, database) {
-    irr_lock (database);
+    irr_read_lock (database);
 
     start_node = NULL;
     node = NULL;    
@@ -640,7 +659,7 @@ void uii_show_ip_more (uii_connection_t *uii, prefix_t *prefix) {
       }
       RADIX_WALK_END;
     }
-    irr_unlock (database);
+    irr_read_unlock (database);
   }
   uii_send_bulk_data (uii);
 }
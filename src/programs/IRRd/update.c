@@ -429,6 +429,31 @@ int add_irr_object (irr_database_t *database, irr_object_t *irr_object) {
   return ret_code;
 }
 
+/* unindex_irr_object
+ * Remove the primary, secondary and special indexes of (stored_irr_object),
+ * an object as it was loaded from the db file.  The db file is not touched.
+ */
+int unindex_irr_object (irr_database_t *database,
+			irr_object_t *stored_irr_object) {
+  int ret_code = 1, store_hash = 0;
+
+  /* remove the special indexes for this object */
+  stored_irr_object->mode = IRR_DELETE;
+  store_hash = irr_special_indexing_store (database, stored_irr_object); 
+
+  if (store_hash) {
+    if ((ret_code = irr_database_remove (database, stored_irr_object->name, 
+					 stored_irr_object->offset)) > 0)
+      if ( (stored_irr_object->type == PERSON ||
+		stored_irr_object->type == ROLE) &&
+	  (ret_code = build_secondary_keys (database, stored_irr_object)) < 0)
+	irr_database_store (database, stored_irr_object->name, PRIMARY, 
+			    stored_irr_object->type, stored_irr_object->offset, 
+			    stored_irr_object->len);
+  }
+  return ret_code;
+}
+
 /* delete_irr_object 
  * First, load the current version of the object. We need to check a) that it
  * exists, and b) we need to get the current offset/len and the secondary keys
@@ -436,7 +461,7 @@ int add_irr_object (irr_database_t *database, irr_object_t *irr_object) {
  */
 int delete_irr_object (irr_database_t *database, irr_object_t *irr_object,
                        u_long *db_offset) {
-  int ret_code = 1, store_hash = 0;
+  int ret_code = 1;
 
   irr_object_t *stored_irr_object;
 
@@ -447,20 +472,7 @@ int delete_irr_object (irr_database_t *database, irr_object_t *irr_object,
     return -1;
   }
 
-  /* remove the special indexes for this object */
-  stored_irr_object->mode = IRR_DELETE;
-  store_hash = irr_special_indexing_store (database, stored_irr_object); 
-
-  if (store_hash) {
-    if ((ret_code = irr_database_remove (database, irr_object->name, 
-					 stored_irr_object->offset)) > 0)
-      if ( (stored_irr_object->type == PERSON ||
-		stored_irr_object->type == ROLE) &&
-	  (ret_code = build_secondary_keys (database, stored_irr_object)) < 0)
-	irr_database_store (database, irr_object->name, PRIMARY, 
-			    stored_irr_object->type, stored_irr_object->offset, 
-			    stored_irr_object->len);
-  }
+  ret_code = unindex_irr_object (database, stored_irr_object);
   
   /* statistics */
   if (ret_code > 0) {